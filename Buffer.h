@@ -0,0 +1,451 @@
+#ifndef BUFFER_H
+#define BUFFER_H
+
+#include <boost/atomic.hpp>
+#include <boost/intrusive_ptr.hpp>
+#include <boost/noncopyable.hpp>
+#include <sys/uio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+// Reference counted storage behind Buffer segments. Fixed-size blocks
+// are recycled through a per-thread free list, bigger ones are one-off.
+// Bytes below Fill() are immutable once another segment refers to them.
+class BufferBlock : private boost::noncopyable
+{
+public:
+    const static size_t kBlockSize = 4096;
+    const static size_t kMaxFreeBlocks = 256;
+
+    static BufferBlock * New(size_t size = kBlockSize)
+    {
+        if (size > kBlockSize)
+        {
+            BufferBlock *block = new BufferBlock(false);
+            block->m_storage.resize(size);
+            return block;
+        }
+
+        FreeList &freeList = GetFreeList();
+        if (freeList.head)
+        {
+            BufferBlock *block = freeList.head;
+            freeList.head = block->m_next;
+            --freeList.count;
+            block->m_next = 0;
+            block->m_fill = 0;
+            return block;
+        }
+
+        BufferBlock *block = new BufferBlock(true);
+        block->m_storage.resize(kBlockSize);
+        return block;
+    }
+
+    // Wraps data without copying it, data is left empty
+    static BufferBlock * Take(std::string &data)
+    {
+        BufferBlock *block = new BufferBlock(false);
+        block->m_storage.swap(data);
+        block->m_fill = block->m_storage.size();
+        return block;
+    }
+
+    char * Data()
+    {
+        return &m_storage[0];
+    }
+
+    size_t Capacity() const
+    {
+        return m_storage.size();
+    }
+
+    size_t Fill() const
+    {
+        return m_fill;
+    }
+
+    void SetFill(size_t fill)
+    {
+        m_fill = fill;
+    }
+
+    bool IsShared() const
+    {
+        return m_refs.load(boost::memory_order_acquire) > 1;
+    }
+
+    friend void intrusive_ptr_add_ref(BufferBlock *block)
+    {
+        block->m_refs.fetch_add(1, boost::memory_order_relaxed);
+    }
+
+    friend void intrusive_ptr_release(BufferBlock *block)
+    {
+        if (block->m_refs.fetch_sub(1, boost::memory_order_release) == 1)
+        {
+            boost::atomic_thread_fence(boost::memory_order_acquire);
+            block->Recycle();
+        }
+    }
+
+private:
+    struct FreeList
+    {
+        BufferBlock *head;
+        size_t count;
+    };
+
+    explicit BufferBlock(bool pooled)
+        : m_refs(0),
+          m_fill(0),
+          m_pooled(pooled),
+          m_next(0)
+    { }
+
+    static FreeList & GetFreeList()
+    {
+        static __thread FreeList freeList = { 0, 0 };
+        return freeList;
+    }
+
+    // Blocks go back to the free list of the thread releasing them
+    void Recycle()
+    {
+        FreeList &freeList = GetFreeList();
+        if (m_pooled && freeList.count < kMaxFreeBlocks)
+        {
+            m_next = freeList.head;
+            freeList.head = this;
+            ++freeList.count;
+            return;
+        }
+        delete this;
+    }
+
+    boost::atomic<int> m_refs;
+    size_t m_fill;
+    bool m_pooled;
+    BufferBlock *m_next;
+    std::string m_storage;
+};
+
+typedef boost::intrusive_ptr<BufferBlock> BufferBlockPtr;
+
+// Chain of byte ranges over shared blocks. Copying, appending another
+// Buffer and splitting only adjust references, bytes are copied only by
+// Append(data, len) and Prepend, which fill the room around unshared
+// blocks before taking new ones from the pool.
+class Buffer
+{
+public:
+    Buffer()
+        : m_head(0),
+          m_size(0)
+    { }
+
+    explicit Buffer(const std::string &data)
+        : m_head(0),
+          m_size(0)
+    {
+        Append(data);
+    }
+
+    Buffer(const char *data, size_t len)
+        : m_head(0),
+          m_size(0)
+    {
+        Append(data, len);
+    }
+
+    size_t Size() const
+    {
+        return m_size;
+    }
+
+    bool Empty() const
+    {
+        return m_size == 0;
+    }
+
+    void Clear()
+    {
+        m_segments.clear();
+        m_head = 0;
+        m_size = 0;
+    }
+
+    void Append(const char *data, size_t len)
+    {
+        while (len)
+        {
+            size_t room;
+            char *tail = WritableTail(&room, len);
+            size_t n = len < room ? len : room;
+            memcpy(tail, data, n);
+            Commit(n);
+            data += n;
+            len -= n;
+        }
+    }
+
+    void Append(const std::string &data)
+    {
+        Append(data.data(), data.size());
+    }
+
+    // Shares the blocks of other, which may be this buffer
+    void Append(const Buffer &other)
+    {
+        size_t end = other.m_segments.size();
+        size_t size = other.m_size;
+        m_segments.reserve(m_segments.size() + end - other.m_head);
+        for (size_t i = other.m_head; i < end; ++i)
+        {
+            if (other.m_segments[i].length)
+                m_segments.push_back(other.m_segments[i]);
+        }
+        m_size += size;
+    }
+
+    // Appends data without copying it, data is left empty
+    void Take(std::string &data)
+    {
+        if (data.empty())
+            return;
+
+        Segment segment;
+        segment.block = BufferBlock::Take(data);
+        segment.offset = 0;
+        segment.length = segment.block->Fill();
+        m_segments.push_back(segment);
+        m_size += segment.length;
+    }
+
+    void Prepend(const char *data, size_t len)
+    {
+        if (len == 0)
+            return;
+
+        if (m_head < m_segments.size())
+        {
+            Segment &first = m_segments[m_head];
+            if (!first.block->IsShared() && first.offset >= len)
+            {
+                first.offset -= len;
+                first.length += len;
+                memcpy(first.block->Data() + first.offset, data, len);
+                m_size += len;
+                return;
+            }
+        }
+
+        // Fill the new block from its end, leaving headroom for more
+        Segment segment;
+        segment.block = BufferBlock::New(len);
+        segment.offset = segment.block->Capacity() - len;
+        segment.length = len;
+        segment.block->SetFill(segment.block->Capacity());
+        memcpy(segment.block->Data() + segment.offset, data, len);
+        InsertFront(segment);
+        m_size += len;
+    }
+
+    // Keeps len bytes free in front of an empty buffer, so framing can
+    // be prepended later without another block
+    void ReserveHeadroom(size_t len)
+    {
+        if (!Empty())
+            return;
+
+        Clear();
+        Segment segment;
+        segment.block = BufferBlock::New(len + 1);
+        segment.offset = len;
+        segment.length = 0;
+        segment.block->SetFill(len);
+        m_segments.push_back(segment);
+    }
+
+    // Moves the first len bytes to the end of front
+    void Split(size_t len, Buffer &front)
+    {
+        if (len > m_size)
+            len = m_size;
+
+        while (len)
+        {
+            Segment &first = m_segments[m_head];
+            if (first.length <= len)
+            {
+                front.m_segments.push_back(first);
+                front.m_size += first.length;
+                len -= first.length;
+                m_size -= first.length;
+                first.block.reset();
+                ++m_head;
+                continue;
+            }
+
+            Segment part = first;
+            part.length = len;
+            front.m_segments.push_back(part);
+            front.m_size += len;
+            first.offset += len;
+            first.length -= len;
+            m_size -= len;
+            len = 0;
+        }
+        Compact();
+    }
+
+    // Drops len bytes from the front
+    void Consume(size_t len)
+    {
+        if (len >= m_size)
+        {
+            Clear();
+            return;
+        }
+
+        while (len)
+        {
+            Segment &first = m_segments[m_head];
+            if (first.length <= len)
+            {
+                len -= first.length;
+                m_size -= first.length;
+                first.block.reset();
+                ++m_head;
+                continue;
+            }
+
+            first.offset += len;
+            first.length -= len;
+            m_size -= len;
+            len = 0;
+        }
+        Compact();
+    }
+
+    // Free room after the last byte, at least min bytes unless the
+    // tail block already has some. Commit what was written into it.
+    char * WritableTail(size_t *room, size_t min = 1)
+    {
+        if (m_head < m_segments.size())
+        {
+            Segment &last = m_segments.back();
+            BufferBlock *block = last.block.get();
+            size_t end = last.offset + last.length;
+            if (!block->IsShared() && end == block->Fill() &&
+                end < block->Capacity())
+            {
+                *room = block->Capacity() - end;
+                return block->Data() + end;
+            }
+        }
+
+        Segment segment;
+        segment.block = BufferBlock::New(min);
+        segment.offset = 0;
+        segment.length = 0;
+        m_segments.push_back(segment);
+
+        *room = segment.block->Capacity();
+        return segment.block->Data();
+    }
+
+    void Commit(size_t len)
+    {
+        Segment &last = m_segments.back();
+        last.length += len;
+        last.block->SetFill(last.offset + last.length);
+        m_size += len;
+    }
+
+    size_t SegmentCount() const
+    {
+        return m_segments.size() - m_head;
+    }
+
+    const char * SegmentData(size_t i) const
+    {
+        const Segment &segment = m_segments[m_head + i];
+        return segment.block->Data() + segment.offset;
+    }
+
+    size_t SegmentSize(size_t i) const
+    {
+        return m_segments[m_head + i].length;
+    }
+
+    // Fills at most max entries, returns how many were used
+    size_t FillIovec(struct iovec *iov, size_t max) const
+    {
+        size_t count = 0;
+        for (size_t i = m_head; i < m_segments.size() && count < max; ++i)
+        {
+            const Segment &segment = m_segments[i];
+            if (!segment.length)
+                continue;
+            iov[count].iov_base = segment.block->Data() + segment.offset;
+            iov[count].iov_len = segment.length;
+            ++count;
+        }
+        return count;
+    }
+
+    void AppendTo(std::string &output) const
+    {
+        output.reserve(output.size() + m_size);
+        for (size_t i = 0; i < SegmentCount(); ++i)
+            output.append(SegmentData(i), SegmentSize(i));
+    }
+
+    std::string ToString() const
+    {
+        std::string output;
+        AppendTo(output);
+        return output;
+    }
+
+private:
+    struct Segment
+    {
+        BufferBlockPtr block;
+        size_t offset;
+        size_t length;
+    };
+
+    void InsertFront(const Segment &segment)
+    {
+        if (m_head > 0)
+            m_segments[--m_head] = segment;
+        else
+            m_segments.insert(m_segments.begin(), segment);
+    }
+
+    // Consumed segments stay in place until they are many, so the
+    // segment vector keeps its capacity
+    void Compact()
+    {
+        if (m_head == m_segments.size())
+        {
+            Clear();
+        }
+        else if (m_head > 32 && m_head * 2 > m_segments.size())
+        {
+            m_segments.erase(m_segments.begin(),
+                             m_segments.begin() + m_head);
+            m_head = 0;
+        }
+    }
+
+    std::vector<Segment> m_segments;
+    size_t m_head;
+    size_t m_size;
+};
+
+#endif // BUFFER_H
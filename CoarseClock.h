@@ -0,0 +1,39 @@
+#ifndef COARSE_CLOCK_H
+#define COARSE_CLOCK_H
+
+#include <stdint.h>
+#include <time.h>
+
+// Cheap clocks for timeouts, metrics and the Date header. The coarse
+// clocks are read from the vDSO without a syscall and tick every few
+// milliseconds, which is plenty for anything measured in seconds.
+// Latencies need NowUs, also from the vDSO but a little dearer.
+class CoarseClock
+{
+public:
+    // Monotonic milliseconds, only meaningful as differences
+    static uint64_t NowMs()
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+        return static_cast<uint64_t>(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+    }
+
+    // Monotonic microseconds at full resolution
+    static uint64_t NowUs()
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return static_cast<uint64_t>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+    }
+
+    // Wall clock seconds
+    static time_t Now()
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+        return ts.tv_sec;
+    }
+};
+
+#endif // COARSE_CLOCK_H
@@ -0,0 +1,195 @@
+#ifndef HDR_HISTOGRAM_H
+#define HDR_HISTOGRAM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+// Log-linear buckets of integer values: below 2^SubBits each value has
+// one of its own, above that every power of two is cut into
+// 2^(SubBits - 1) linear steps, up to 2^MaxBits where the last bucket
+// takes the rest
+template <int SubBits, int MaxBits>
+struct HdrBuckets
+{
+    const static size_t kSubBuckets = size_t(1) << SubBits;
+    const static size_t kHalf = kSubBuckets / 2;
+    const static size_t kBuckets = kSubBuckets + (MaxBits - SubBits) * kHalf;
+
+    static size_t GetIndex(uint64_t value)
+    {
+        if (value < kSubBuckets)
+            return value;
+
+        int msb = 63 - __builtin_clzll(value);
+        if (msb >= MaxBits)
+            return kBuckets - 1;
+        int shift = msb - (SubBits - 1);
+        return kSubBuckets + (shift - 1) * kHalf + ((value >> shift) - kHalf);
+    }
+
+    static uint64_t GetLowest(size_t index)
+    {
+        if (index < kSubBuckets)
+            return index;
+
+        size_t shift = (index - kSubBuckets) / kHalf + 1;
+        return (kHalf + (index - kSubBuckets) % kHalf) << shift;
+    }
+
+    static uint64_t GetHighest(size_t index)
+    {
+        if (index < kSubBuckets)
+            return index;
+
+        size_t shift = (index - kSubBuckets) / kHalf + 1;
+        return GetLowest(index) + (uint64_t(1) << shift) - 1;
+    }
+
+    // Highest value of the bucket the q (0..1) quantile of counts falls
+    // in, at most max
+    static uint64_t GetPercentile(const std::vector<uint64_t> &counts,
+                                  double q, uint64_t max)
+    {
+        uint64_t total = 0;
+        for (size_t i = 0; i < counts.size(); ++i)
+            total += counts[i];
+        if (!total)
+            return 0;
+
+        uint64_t target = static_cast<uint64_t>(q * total + 0.5);
+        if (target < 1)
+            target = 1;
+
+        uint64_t seen = 0;
+        for (size_t i = 0; i < counts.size(); ++i)
+        {
+            seen += counts[i];
+            if (seen >= target)
+            {
+                uint64_t highest = GetHighest(i);
+                return highest < max ? highest : max;
+            }
+        }
+        return max;
+    }
+};
+
+template <int SubBits, int MaxBits>
+const size_t HdrBuckets<SubBits, MaxBits>::kSubBuckets;
+template <int SubBits, int MaxBits>
+const size_t HdrBuckets<SubBits, MaxBits>::kHalf;
+template <int SubBits, int MaxBits>
+const size_t HdrBuckets<SubBits, MaxBits>::kBuckets;
+
+// High dynamic range histogram of integer values, e.g. latencies in
+// microseconds. Values below 2048 are counted exactly, larger ones in
+// 1024 linear steps per power of two, i.e. to three significant digits,
+// up to 2^40.
+class HdrHistogram
+{
+public:
+    typedef HdrBuckets<11, 40> Buckets;
+    const static size_t kBuckets = Buckets::kBuckets;
+
+    HdrHistogram()
+        : m_counts(kBuckets),
+          m_count(0),
+          m_min(~uint64_t(0)),
+          m_max(0),
+          m_sum(0)
+    { }
+
+    void Record(uint64_t value, uint64_t count = 1)
+    {
+        if (!count)
+            return;
+        m_counts[Buckets::GetIndex(value)] += count;
+        m_count += count;
+        m_sum += static_cast<double>(value) * count;
+        if (value < m_min)
+            m_min = value;
+        if (value > m_max)
+            m_max = value;
+    }
+
+    // For a measurement that waits for each answer before the next one:
+    // a value above expectedInterval kept the ones behind it from being
+    // taken, they are added as they would have come out
+    void RecordCorrected(uint64_t value, uint64_t expectedInterval,
+                         uint64_t count = 1)
+    {
+        Record(value, count);
+        if (!expectedInterval)
+            return;
+        for (uint64_t missing = value; missing > expectedInterval; )
+        {
+            missing -= expectedInterval;
+            Record(missing, count);
+        }
+    }
+
+    void Add(const HdrHistogram &other)
+    {
+        for (size_t i = 0; i < kBuckets; ++i)
+            m_counts[i] += other.m_counts[i];
+        m_count += other.m_count;
+        m_sum += other.m_sum;
+        if (other.m_min < m_min)
+            m_min = other.m_min;
+        if (other.m_max > m_max)
+            m_max = other.m_max;
+    }
+
+    // Adds other with RecordCorrected applied to every value after the
+    // fact, bucket by bucket
+    void AddCorrected(const HdrHistogram &other, uint64_t expectedInterval)
+    {
+        for (size_t i = 0; i < kBuckets; ++i)
+        {
+            if (other.m_counts[i])
+                RecordCorrected(Buckets::GetLowest(i), expectedInterval,
+                                other.m_counts[i]);
+        }
+    }
+
+    uint64_t GetCount() const
+    {
+        return m_count;
+    }
+
+    uint64_t GetMin() const
+    {
+        return m_count ? m_min : 0;
+    }
+
+    uint64_t GetMax() const
+    {
+        return m_max;
+    }
+
+    double GetMean() const
+    {
+        return m_count ? m_sum / m_count : 0;
+    }
+
+    // Highest value of the bucket the q (0..1) quantile falls in
+    uint64_t GetPercentile(double q) const
+    {
+        return Buckets::GetPercentile(m_counts, q, m_max);
+    }
+
+    uint64_t GetBucketCount(size_t index) const
+    {
+        return m_counts[index];
+    }
+
+private:
+    std::vector<uint64_t> m_counts;
+    uint64_t m_count;
+    uint64_t m_min;
+    uint64_t m_max;
+    double m_sum;
+};
+
+#endif // HDR_HISTOGRAM_H
@@ -1,6 +1,9 @@
 #ifndef TCP_SERVER_H
 #define TCP_SERVER_H
 
+#include "Buffer.h"
+#include "CoarseClock.h"
+
 #include <boost/asio.hpp>
 #include <boost/asio/spawn.hpp>
 #include <boost/function.hpp>
@@ -10,7 +13,7 @@
 #include <boost/enable_shared_from_this.hpp>
 
 #include <iostream>
-#include <deque>
+#include <vector>
 
 namespace
 {
@@ -26,10 +29,6 @@ namespace
     }
 }
 
-typedef std::string Buffer;
-typedef boost::shared_ptr<Buffer> BufferPtr;
-typedef std::deque<BufferPtr> DequeBuffer;
-
 class Session : public boost::enable_shared_from_this<Session>,
                 private boost::noncopyable
 {
@@ -38,8 +37,13 @@ public:
         : m_writeTimeout(kTimeout),
           m_readTimeout(kTimeout),
           m_writing(false),
+          m_closeAfterWrite(false),
+          m_linger(false),
+          m_readDeadline(0),
+          m_writeDeadline(0),
           m_service(service),
-          m_socket(m_service)
+          m_socket(m_service),
+          m_watchdog(m_service)
     { }
 
     virtual ~Session()
@@ -52,6 +56,11 @@ public:
         return m_socket;
     }
 
+    boost::asio::io_service & Service()
+    {
+        return m_service;
+    }
+
     std::string GetRemoteIpString() const
     {
         return m_remoteIpString;
@@ -63,6 +72,9 @@ public:
         boost::asio::spawn(
             m_service, boost::bind(&Session::TcpService,
                                    shared_from_this(), _1));
+        boost::asio::spawn(
+            m_service, boost::bind(&Session::Watchdog,
+                                   shared_from_this(), _1));
     }
 
     void SetWriteTimeout(unsigned int t)
@@ -79,13 +91,34 @@ protected:
     virtual bool OnData(const char *buffer, std::size_t bufferLength) = 0;
     virtual void OnClose() = 0;
 
+    // Called after each buffer went out, with what is still queued
+    virtual void OnWritten(std::size_t pendingBytes)
+    { }
+
+    virtual void OnReadTimeout()
+    {
+        Shutdown();
+    }
+
+    // Reading stopped, either OnData refused more or the read failed
+    // with error (eof once the client shut its side down). By default
+    // the connection closes after the queued responses went out.
+    virtual void OnReadEnd(const boost::system::error_code &error)
+    {
+        CloseAfterWrite();
+    }
+
     void TcpService(boost::asio::yield_context yield)
     {
-        char buffer[kBufferSize];
+        // Reads land in the free room of a pooled block, which stays
+        // with m_readBuffer as nothing is ever committed to it
+        boost::system::error_code error;
         while (1)
         {
-            std::size_t bufferLength = kBufferSize;
-            if (!ReadData(buffer, &bufferLength, yield))
+            std::size_t bufferLength;
+            char *buffer = m_readBuffer.WritableTail(&bufferLength,
+                                                     kBufferSize);
+            if (!ReadData(buffer, &bufferLength, yield, error))
             {
                 std::cerr << "read data error" << std::endl;
                 break;
@@ -97,20 +130,21 @@ protected:
                 break;
             }
         }
-        Shutdown();
+
+        if (m_socket.is_open())
+            OnReadEnd(error);
     }
 
     bool ReadData(char *buffer, std::size_t *len,
-                  boost::asio::yield_context yield)
+                  boost::asio::yield_context yield,
+                  boost::system::error_code &error)
     {
-        boost::asio::deadline_timer timer(m_service);
-        StartTimer(timer, m_readTimeout);
+        m_readDeadline = Deadline(m_readTimeout);
 
-        boost::system::error_code error;
         std::size_t size = m_socket.async_read_some(
             boost::asio::buffer(buffer, *len), yield[error]);
 
-        CancelTimer(timer);
+        m_readDeadline = 0;
 
         *len = size;
 
@@ -119,14 +153,20 @@ protected:
 
     void WriteResponse(const char *buffer, std::size_t len)
     {
-        BufferPtr data(new Buffer(buffer, len));
-        WriteResponse(data);
+        m_writeBuffer.Append(buffer, len);
+        StartWriting();
     }
 
-    void WriteResponse(const BufferPtr &data)
+    // Queues the blocks of data, nothing is copied
+    void WriteResponse(const Buffer &data)
     {
-        m_writeBuffer.push_back(data);
-        if (!m_writing)
+        m_writeBuffer.Append(data);
+        StartWriting();
+    }
+
+    void StartWriting()
+    {
+        if (!m_writing && !m_writeBuffer.Empty())
         {
             m_writing = true;
             boost::asio::spawn(
@@ -138,63 +178,159 @@ protected:
     bool WriteData(boost::asio::yield_context yield)
     {
         boost::system::error_code error;
-        while (!error && !m_writeBuffer.empty())
+        std::vector<boost::asio::const_buffer> gather;
+        while (!error && !m_writeBuffer.Empty())
         {
-            boost::asio::deadline_timer timer(m_service);
-            StartTimer(timer, m_writeTimeout);
+            m_writeDeadline = Deadline(m_writeTimeout);
+
+            // Everything queued so far goes out in one gather write.
+            // Data queued meanwhile only lands behind these bytes.
+            std::size_t count = m_writeBuffer.SegmentCount();
+            if (count > kMaxGather)
+                count = kMaxGather;
+            std::size_t bytes = 0;
+            gather.clear();
+            for (std::size_t i = 0; i < count; ++i)
+            {
+                gather.push_back(boost::asio::buffer(
+                    m_writeBuffer.SegmentData(i), m_writeBuffer.SegmentSize(i)));
+                bytes += m_writeBuffer.SegmentSize(i);
+            }
 
-            BufferPtr buffer = m_writeBuffer.front();
-            m_writeBuffer.pop_front();
+            boost::asio::async_write(m_socket, gather, yield[error]);
 
-            boost::asio::async_write(
-                m_socket, boost::asio::buffer(buffer->data(), buffer->size()), yield[error]);
+            m_writeDeadline = 0;
 
-            CancelTimer(timer);
+            m_writeBuffer.Consume(bytes);
+            if (!error)
+                OnWritten(m_writeBuffer.Size());
         }
 
         m_writing = false;
+        if (m_closeAfterWrite)
+        {
+            if (error)
+                Shutdown();
+            else
+                CloseWritten();
+        }
         return !error;
     }
 
-    void Shutdown()
+    std::size_t PendingBytes() const
     {
-        if (!m_socket.is_open())
-            return;
+        return m_writeBuffer.Size();
+    }
 
-        OnClose();
-        boost::system::error_code ignoreError;
-        m_socket.close(ignoreError);
+    bool IsOpen() const
+    {
+        return m_socket.is_open();
     }
 
-    void StartTimer(boost::asio::deadline_timer &timer, int timeToTimeout)
+    // Closes once everything queued so far has been written
+    void CloseAfterWrite()
     {
-        if (!timeToTimeout)
-            return;
+        if (m_writing)
+            m_closeAfterWrite = true;
+        else
+            CloseWritten();
+    }
 
-        boost::system::error_code ignoreError;
-        timer.expires_from_now(
-            boost::posix_time::seconds(timeToTimeout), ignoreError);
+    // For a close with a request left unread: closing then would reset
+    // the connection and could take the response with it. Instead only
+    // the sending side is shut and what still comes in is read and
+    // dropped, up to kLingerBytes or kLingerMs.
+    void SetLinger()
+    {
+        m_linger = true;
+    }
+
+    void CloseWritten()
+    {
+        if (!m_linger || !m_socket.is_open())
+        {
+            Shutdown();
+            return;
+        }
 
+        m_linger = false;
         boost::asio::spawn(
-            m_service, boost::bind(&Session::Timer, shared_from_this(),
-                                   boost::ref(timer), _1));
+            m_service, boost::bind(&Session::Linger, shared_from_this(), _1));
     }
 
-    void Timer(boost::asio::deadline_timer &timer, boost::asio::yield_context yield)
+    void Linger(boost::asio::yield_context yield)
     {
         boost::system::error_code error;
-        timer.async_wait(yield[error]);
-        if (error != boost::asio::error::operation_aborted)
+        m_socket.shutdown(boost::asio::ip::tcp::socket::shutdown_send, error);
+
+        // The watchdog ends it with OnReadTimeout
+        m_readDeadline = CoarseClock::NowMs() + kLingerMs;
+        std::size_t left = kLingerBytes;
+        while (!error && left && m_socket.is_open())
         {
-            std::cout << "Timeout" << std::endl;
-            Shutdown();
+            std::size_t bufferLength;
+            char *buffer = m_readBuffer.WritableTail(&bufferLength,
+                                                     kBufferSize);
+            std::size_t size = m_socket.async_read_some(
+                boost::asio::buffer(buffer, bufferLength), yield[error]);
+            left -= size < left ? size : left;
         }
+
+        m_readDeadline = 0;
+        Shutdown();
     }
 
-    void CancelTimer(boost::asio::deadline_timer &timer)
+    void Shutdown()
     {
+        if (!m_socket.is_open())
+            return;
+
+        OnClose();
         boost::system::error_code ignoreError;
-        timer.cancel(ignoreError);
+        m_socket.close(ignoreError);
+        m_watchdog.cancel(ignoreError);
+    }
+
+    uint64_t Deadline(unsigned int timeout) const
+    {
+        return timeout ? CoarseClock::NowMs() + timeout * 1000ULL : 0;
+    }
+
+    // One timer per connection enforces both deadlines. Reads and writes
+    // only store a coarse timestamp, the timer sleeps until the nearest
+    // one and goes back to sleep if it was pushed further meanwhile.
+    void Watchdog(boost::asio::yield_context yield)
+    {
+        while (m_socket.is_open())
+        {
+            uint64_t now = CoarseClock::NowMs();
+            uint64_t wake = now + kWatchdogIdle;
+
+            if (m_writeDeadline && now >= m_writeDeadline)
+            {
+                std::cout << "Timeout" << std::endl;
+                Shutdown();
+                break;
+            }
+
+            if (m_readDeadline && now >= m_readDeadline)
+            {
+                std::cout << "Timeout" << std::endl;
+                m_readDeadline = 0;
+                OnReadTimeout();
+                continue;
+            }
+
+            if (m_writeDeadline && m_writeDeadline < wake)
+                wake = m_writeDeadline;
+            if (m_readDeadline && m_readDeadline < wake)
+                wake = m_readDeadline;
+
+            boost::system::error_code error;
+            m_watchdog.expires_from_now(
+                boost::posix_time::milliseconds(wake - now), error);
+            m_watchdog.async_wait(yield[error]);
+        }
     }
 
     void CacheRemoteIpString()
@@ -206,17 +342,27 @@ protected:
             m_remoteIpString = endpoint.address().to_string();
     }
 
-    const static int kBufferSize = 128;
+    const static std::size_t kBufferSize = 2048;
+    const static std::size_t kMaxGather = 64;
     const static int kTimeout = 10;
+    const static uint64_t kWatchdogIdle = 1000;
+    const static std::size_t kLingerBytes = 1024 * 1024;
+    const static uint64_t kLingerMs = 2000;
 
     unsigned int m_writeTimeout;
     unsigned int m_readTimeout;
 
     bool m_writing;
-    DequeBuffer m_writeBuffer;
+    bool m_closeAfterWrite;
+    bool m_linger;
+    uint64_t m_readDeadline;
+    uint64_t m_writeDeadline;
+    Buffer m_readBuffer;
+    Buffer m_writeBuffer;
 
     boost::asio::io_service &m_service;
     boost::asio::ip::tcp::socket m_socket;
+    boost::asio::deadline_timer m_watchdog;
     std::string m_remoteIpString;
 };
 
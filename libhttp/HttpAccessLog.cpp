@@ -0,0 +1,251 @@
+#include "HttpAccessLog.h"
+#include "../CoarseClock.h"
+#include <boost/bind.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <iostream>
+
+const char HttpAccessLog::kMagic[8] = { 'H', 'T', 'T', 'P', 'A', 'C', 'C', '1' };
+
+namespace
+{
+    const size_t kDrainChunk = 256;
+    const unsigned int kIdleMs = 5;
+
+    template <class T>
+    void AppendValue(std::string &output, T value)
+    {
+        output.append(reinterpret_cast<const char *>(&value), sizeof(value));
+    }
+
+    bool WriteAll(int fd, const char *data, size_t len)
+    {
+        while (len)
+        {
+            ssize_t n = ::write(fd, data, len);
+            if (n < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                return false;
+            }
+            data += n;
+            len -= n;
+        }
+        return true;
+    }
+}
+
+HttpAccessLog::HttpAccessLog(const HttpAccessLogOptions &options)
+    : m_options(options),
+      m_local(&HttpAccessLog::KeepRing),
+      m_fd(-1),
+      m_fileBytes(0),
+      m_fileIndex(0),
+      m_stop(false),
+      m_written(0),
+      m_dropped(0)
+{
+    m_batch.reserve(m_options.writeBytes + kDrainChunk *
+                    sizeof(HttpAccessRecord));
+}
+
+HttpAccessLog::~HttpAccessLog()
+{
+    m_stop = true;
+    if (m_thread)
+        m_thread->join();
+
+    CloseFile();
+    for (size_t i = 0; i < m_rings.size(); ++i)
+        delete m_rings[i];
+}
+
+void HttpAccessLog::SetRouteNames(const std::vector<std::string> &names)
+{
+    boost::mutex::scoped_lock lock(m_namesMutex);
+    m_names = names;
+}
+
+bool HttpAccessLog::Start()
+{
+    if (m_thread)
+        return true;
+
+    if (!OpenFile())
+        return false;
+
+    m_thread.reset(new boost::thread(boost::bind(&HttpAccessLog::Run, this)));
+    return true;
+}
+
+void HttpAccessLog::Write(const HttpAccess &access)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    HttpAccessRecord record;
+    memset(&record, 0, sizeof(record));
+    record.timeUs = static_cast<uint64_t>(ts.tv_sec) * 1000000 +
+        ts.tv_nsec / 1000;
+    record.requestBytes = access.requestBytes;
+    record.responseBytes = access.responseBytes;
+    memcpy(record.peer, access.peer, sizeof(record.peer));
+    record.latencyUs = access.latencyUs > 0xffffffffULL ?
+        0xffffffffU : static_cast<uint32_t>(access.latencyUs);
+    record.route = access.route < 0 ? 0 : access.route;
+    record.status = static_cast<uint16_t>(access.status);
+    record.method = static_cast<uint8_t>(access.method);
+
+    if (!GetRing().push(record))
+        m_dropped.fetch_add(1, boost::memory_order_relaxed);
+}
+
+uint64_t HttpAccessLog::GetWritten() const
+{
+    return m_written.load();
+}
+
+uint64_t HttpAccessLog::GetDropped() const
+{
+    return m_dropped.load();
+}
+
+HttpAccessLog::Ring & HttpAccessLog::GetRing()
+{
+    Ring *ring = m_local.get();
+    if (!ring)
+    {
+        // Kept after the thread exits, the writer still drains it
+        ring = new Ring(m_options.ringRecords);
+        m_local.reset(ring);
+        boost::mutex::scoped_lock lock(m_ringsMutex);
+        m_rings.push_back(ring);
+    }
+    return *ring;
+}
+
+void HttpAccessLog::Run()
+{
+    uint64_t lastFlush = CoarseClock::NowMs();
+    while (1)
+    {
+        bool stopping = m_stop;
+        size_t drained = Drain();
+
+        uint64_t now = CoarseClock::NowMs();
+        if (m_batch.size() >= m_options.writeBytes ||
+            (!m_batch.empty() &&
+             (stopping || now - lastFlush >= m_options.flushMs)))
+        {
+            Flush();
+            lastFlush = now;
+        }
+
+        // What was pushed before the stop is drained to the end
+        if (stopping && !drained)
+            break;
+        if (!drained)
+            boost::this_thread::sleep(boost::posix_time::milliseconds(kIdleMs));
+    }
+}
+
+size_t HttpAccessLog::Drain()
+{
+    HttpAccessRecord records[kDrainChunk];
+    size_t drained = 0;
+
+    boost::mutex::scoped_lock lock(m_ringsMutex);
+    for (size_t i = 0; i < m_rings.size(); ++i)
+    {
+        while (m_batch.size() < m_options.writeBytes)
+        {
+            size_t n = m_rings[i]->pop(records, kDrainChunk);
+            if (!n)
+                break;
+            m_batch.append(reinterpret_cast<const char *>(records),
+                           n * sizeof(HttpAccessRecord));
+            drained += n;
+        }
+    }
+    return drained;
+}
+
+void HttpAccessLog::Flush()
+{
+    if (m_fd >= 0 && m_fileBytes + m_batch.size() > m_options.maxFileBytes)
+        CloseFile();
+
+    size_t records = m_batch.size() / sizeof(HttpAccessRecord);
+    if ((m_fd >= 0 || OpenFile()) &&
+        WriteAll(m_fd, m_batch.data(), m_batch.size()))
+    {
+        m_fileBytes += m_batch.size();
+        m_written.fetch_add(records, boost::memory_order_relaxed);
+    }
+    else
+    {
+        // Tried again on a new file next time
+        m_dropped.fetch_add(records, boost::memory_order_relaxed);
+        CloseFile();
+    }
+    m_batch.clear();
+}
+
+bool HttpAccessLog::OpenFile()
+{
+    char stamp[32];
+    time_t now = CoarseClock::Now();
+    struct tm tm;
+    gmtime_r(&now, &tm);
+    strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", &tm);
+
+    char index[16];
+    snprintf(index, sizeof(index), ".%u", m_fileIndex++);
+    std::string name = m_options.path + "." + stamp + index;
+
+    m_fd = ::open(name.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (m_fd < 0)
+    {
+        std::cerr << "access log: cannot open " << name << ": "
+                  << strerror(errno) << std::endl;
+        return false;
+    }
+
+    std::string header(kMagic, sizeof(kMagic));
+    {
+        boost::mutex::scoped_lock lock(m_namesMutex);
+        AppendValue(header, static_cast<uint32_t>(sizeof(HttpAccessRecord)));
+        AppendValue(header, static_cast<uint32_t>(m_names.size()));
+        for (size_t i = 0; i < m_names.size(); ++i)
+        {
+            uint16_t length = m_names[i].size() > 0xffff ?
+                0xffff : static_cast<uint16_t>(m_names[i].size());
+            AppendValue(header, length);
+            header.append(m_names[i], 0, length);
+        }
+    }
+
+    if (!WriteAll(m_fd, header.data(), header.size()))
+    {
+        CloseFile();
+        return false;
+    }
+    m_fileBytes = header.size();
+    return true;
+}
+
+void HttpAccessLog::CloseFile()
+{
+    if (m_fd >= 0)
+    {
+        ::close(m_fd);
+        m_fd = -1;
+    }
+    m_fileBytes = 0;
+}
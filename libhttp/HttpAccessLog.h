@@ -0,0 +1,118 @@
+#ifndef HTTP_ACCESS_LOG_H
+#define HTTP_ACCESS_LOG_H
+
+#include "HttpServer.h"
+#include <boost/noncopyable.hpp>
+#include <boost/atomic.hpp>
+#include <boost/static_assert.hpp>
+#include <boost/lockfree/spsc_queue.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/tss.hpp>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// One request as stored in the files, in the host's byte order
+struct HttpAccessRecord
+{
+    // Wall clock when the response was serialized, microseconds since
+    // the epoch
+    uint64_t timeUs;
+    uint64_t requestBytes;
+    uint64_t responseBytes;
+    unsigned char peer[16];
+    uint32_t latencyUs;
+    // Index into the route names of the file header
+    int32_t route;
+    uint16_t status;
+    uint8_t method;
+    uint8_t reserved0;
+    uint32_t reserved1;
+};
+
+BOOST_STATIC_ASSERT(sizeof(HttpAccessRecord) == 56);
+
+struct HttpAccessLogOptions
+{
+    HttpAccessLogOptions()
+        : path("access.log"),
+          maxFileBytes(256 * 1024 * 1024),
+          ringRecords(16 * 1024),
+          writeBytes(1024 * 1024),
+          flushMs(200)
+    { }
+
+    // Files are named path.YYYYmmdd-HHMMSS.N, N counting up from 0
+    std::string path;
+    // A new file is started before this size would be passed
+    uint64_t maxFileBytes;
+    // Records each thread can have queued, more are dropped and counted
+    size_t ringRecords;
+    // Records are written in batches of this size, or after flushMs
+    size_t writeBytes;
+    unsigned int flushMs;
+};
+
+// Binary access log. Connection threads only push fixed size records
+// into rings of their own, a background thread drains them into large
+// sequential writes. Files start with kMagic, the record size and the
+// route names, then records follow back to back.
+class HttpAccessLog : private boost::noncopyable
+{
+public:
+    static const char kMagic[8];
+
+    explicit HttpAccessLog(const HttpAccessLogOptions &options);
+
+    // Writes out what is still queued
+    ~HttpAccessLog();
+
+    // Written into the header of each new file, index = route id
+    void SetRouteNames(const std::vector<std::string> &names);
+
+    // Opens the first file and starts the writer, false if it cannot be
+    // created
+    bool Start();
+
+    // From any thread, never blocks
+    void Write(const HttpAccess &access);
+
+    uint64_t GetWritten() const;
+    uint64_t GetDropped() const;
+
+private:
+    typedef boost::lockfree::spsc_queue<HttpAccessRecord> Ring;
+
+    static void KeepRing(Ring *ring)
+    { }
+
+    Ring & GetRing();
+    void Run();
+    size_t Drain();
+    void Flush();
+    bool OpenFile();
+    void CloseFile();
+
+    HttpAccessLogOptions m_options;
+
+    boost::thread_specific_ptr<Ring> m_local;
+    boost::mutex m_ringsMutex;
+    std::vector<Ring *> m_rings;
+
+    // Owned by the writer thread once started
+    boost::mutex m_namesMutex;
+    std::vector<std::string> m_names;
+    std::string m_batch;
+    int m_fd;
+    uint64_t m_fileBytes;
+    unsigned int m_fileIndex;
+
+    boost::atomic<bool> m_stop;
+    boost::atomic<uint64_t> m_written;
+    boost::atomic<uint64_t> m_dropped;
+    boost::scoped_ptr<boost::thread> m_thread;
+};
+
+#endif // HTTP_ACCESS_LOG_H
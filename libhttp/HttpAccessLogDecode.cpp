@@ -0,0 +1,146 @@
+// Prints the records of binary access log files as text or CSV:
+//   http_access_log_decode [--csv] file...
+
+#include "HttpAccessLog.h"
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <string>
+#include <vector>
+
+namespace
+{
+    template <class T>
+    bool ReadValue(FILE *file, T *value)
+    {
+        return fread(value, sizeof(*value), 1, file) == 1;
+    }
+
+    bool ReadHeader(FILE *file, std::vector<std::string> &routes)
+    {
+        char magic[sizeof(HttpAccessLog::kMagic)];
+        uint32_t recordSize;
+        uint32_t count;
+        if (fread(magic, sizeof(magic), 1, file) != 1 ||
+            memcmp(magic, HttpAccessLog::kMagic, sizeof(magic)) != 0 ||
+            !ReadValue(file, &recordSize) ||
+            recordSize != sizeof(HttpAccessRecord) ||
+            !ReadValue(file, &count))
+            return false;
+
+        routes.clear();
+        for (uint32_t i = 0; i < count; ++i)
+        {
+            uint16_t length;
+            if (!ReadValue(file, &length))
+                return false;
+            std::string name(length, '\0');
+            if (length && fread(&name[0], length, 1, file) != 1)
+                return false;
+            routes.push_back(name);
+        }
+        return true;
+    }
+
+    std::string FormatPeer(const unsigned char *peer)
+    {
+        static const unsigned char kMapped[12] =
+            { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff };
+
+        char buf[INET6_ADDRSTRLEN];
+        if (memcmp(peer, kMapped, sizeof(kMapped)) == 0)
+            inet_ntop(AF_INET, peer + 12, buf, sizeof(buf));
+        else
+            inet_ntop(AF_INET6, peer, buf, sizeof(buf));
+        return buf;
+    }
+
+    std::string FormatTime(uint64_t timeUs)
+    {
+        time_t seconds = static_cast<time_t>(timeUs / 1000000);
+        struct tm tm;
+        gmtime_r(&seconds, &tm);
+
+        char buf[64];
+        size_t length = strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%S", &tm);
+        snprintf(buf + length, sizeof(buf) - length, ".%06uZ",
+                 static_cast<unsigned int>(timeUs % 1000000));
+        return buf;
+    }
+
+    void PrintRecord(const HttpAccessRecord &record,
+                     const std::vector<std::string> &routes, bool csv)
+    {
+        const char *route = record.route >= 0 &&
+            static_cast<size_t>(record.route) < routes.size() ?
+            routes[record.route].c_str() : "?";
+        const char *method = http_method_str(
+            static_cast<enum http_method>(record.method));
+
+        if (csv)
+        {
+            printf("%s,%s,%s,\"%s\",%u,%llu,%llu,%u\n",
+                   FormatTime(record.timeUs).c_str(),
+                   FormatPeer(record.peer).c_str(), method, route,
+                   static_cast<unsigned int>(record.status),
+                   static_cast<unsigned long long>(record.requestBytes),
+                   static_cast<unsigned long long>(record.responseBytes),
+                   static_cast<unsigned int>(record.latencyUs));
+        }
+        else
+        {
+            printf("%s %s %s %s %u %llu %llu %uus\n",
+                   FormatTime(record.timeUs).c_str(),
+                   FormatPeer(record.peer).c_str(), method, route,
+                   static_cast<unsigned int>(record.status),
+                   static_cast<unsigned long long>(record.requestBytes),
+                   static_cast<unsigned long long>(record.responseBytes),
+                   static_cast<unsigned int>(record.latencyUs));
+        }
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    bool csv = false;
+    std::vector<const char *> files;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "--csv") == 0)
+            csv = true;
+        else
+            files.push_back(argv[i]);
+    }
+
+    if (files.empty())
+    {
+        fprintf(stderr, "usage: %s [--csv] file...\n", argv[0]);
+        return 2;
+    }
+
+    if (csv)
+        printf("time,peer,method,route,status,request_bytes,"
+               "response_bytes,latency_us\n");
+
+    int status = 0;
+    for (size_t i = 0; i < files.size(); ++i)
+    {
+        FILE *file = fopen(files[i], "rb");
+        std::vector<std::string> routes;
+        if (!file || !ReadHeader(file, routes))
+        {
+            fprintf(stderr, "%s: not an access log\n", files[i]);
+            if (file)
+                fclose(file);
+            status = 1;
+            continue;
+        }
+
+        HttpAccessRecord record;
+        while (fread(&record, sizeof(record), 1, file) == 1)
+            PrintRecord(record, routes, csv);
+        fclose(file);
+    }
+    return status;
+}
@@ -0,0 +1,121 @@
+#include "HttpArena.h"
+#include <algorithm>
+
+namespace
+{
+    class NewDeleteResource : public HttpMemoryResource
+    {
+    protected:
+        virtual void * DoAllocate(size_t size, size_t align)
+        {
+            return ::operator new(size);
+        }
+
+        virtual void DoDeallocate(void *p, size_t size, size_t align)
+        {
+            ::operator delete(p);
+        }
+    };
+}
+
+const size_t HttpMemoryResource::kMaxAlign;
+const size_t HttpArena::kBlockSize;
+const size_t HttpArena::kMaxBlockSize;
+
+HttpMemoryResource * HttpMemoryResource::Default()
+{
+    static NewDeleteResource resource;
+    return &resource;
+}
+
+HttpArena::~HttpArena()
+{
+    while (m_first)
+    {
+        Block *next = m_first->next;
+        ::operator delete(m_first);
+        m_first = next;
+    }
+}
+
+void HttpArena::Shrink(size_t threshold)
+{
+    // Nothing is in use right after Reset, even the first block may go
+    bool idle = GetUsed() == 0;
+    Block **link = &m_first;
+    size_t kept = 0;
+    if (!idle)
+    {
+        for (Block *block = m_first; block != m_current; block = block->next)
+            kept += block->size;
+        kept += m_current->size;
+        link = &m_current->next;
+    }
+
+    while (*link && kept + (*link)->size <= threshold)
+    {
+        kept += (*link)->size;
+        link = &(*link)->next;
+    }
+
+    Block *block = *link;
+    *link = 0;
+    while (block)
+    {
+        Block *next = block->next;
+        ::operator delete(block);
+        block = next;
+    }
+
+    if (idle)
+        Reset();
+}
+
+size_t HttpArena::GetCapacity() const
+{
+    size_t capacity = 0;
+    for (const Block *block = m_first; block; block = block->next)
+        capacity += block->size;
+    return capacity;
+}
+
+void * HttpArena::Grow(size_t size, size_t align)
+{
+    // Enough for size wherever the block data happens to be
+    size_t need = size + align - 1;
+    if (need < size)
+        throw std::bad_alloc();
+
+    Block *next = m_first;
+    if (m_current)
+    {
+        m_used += m_pos - Data(m_current);
+        next = m_current->next;
+    }
+
+    // A kept block that is too small waits for a later request
+    if (!next || next->size < need)
+    {
+        size_t blockSize = m_current ?
+            std::min(m_current->size * 2, kMaxBlockSize) : kBlockSize;
+        blockSize = std::max(blockSize, need);
+        if (blockSize + sizeof(Block) < blockSize)
+            throw std::bad_alloc();
+
+        Block *block = static_cast<Block *>(
+            ::operator new(sizeof(Block) + blockSize));
+        block->size = blockSize;
+        block->next = next;
+        if (m_current)
+            m_current->next = block;
+        else
+            m_first = block;
+        next = block;
+    }
+
+    m_current = next;
+    m_end = Data(next) + next->size;
+    char *p = AlignUp(Data(next), align);
+    m_pos = p + size;
+    return p;
+}
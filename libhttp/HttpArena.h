@@ -0,0 +1,229 @@
+#ifndef HTTP_ARENA_H
+#define HTTP_ARENA_H
+
+#include <boost/noncopyable.hpp>
+#include <boost/type_traits/alignment_of.hpp>
+#include <stddef.h>
+#include <new>
+#include <string>
+
+// Where HttpArenaAllocator gets its memory, after the manner of
+// std::pmr::memory_resource. Align is a power of two.
+class HttpMemoryResource
+{
+public:
+    const static size_t kMaxAlign = 16;
+
+    virtual ~HttpMemoryResource()
+    { }
+
+    void * Allocate(size_t size, size_t align = kMaxAlign)
+    {
+        return DoAllocate(size, align);
+    }
+
+    void Deallocate(void *p, size_t size, size_t align = kMaxAlign)
+    {
+        DoDeallocate(p, size, align);
+    }
+
+    // Plain operator new and delete, aligned up to kMaxAlign
+    static HttpMemoryResource * Default();
+
+protected:
+    virtual void * DoAllocate(size_t size, size_t align) = 0;
+    virtual void DoDeallocate(void *p, size_t size, size_t align) = 0;
+};
+
+// Monotonic memory of one request. Allocating bumps a pointer through
+// blocks that are kept across Reset, Deallocate does nothing and Reset
+// releases everything at once, so destructors of what lives here are
+// not needed and never run. Blocks are only taken on first use. Not
+// thread-safe.
+class HttpArena : public HttpMemoryResource, private boost::noncopyable
+{
+public:
+    const static size_t kBlockSize = 4096;
+    const static size_t kMaxBlockSize = 64 * 1024;
+
+    HttpArena()
+        : m_first(0),
+          m_current(0),
+          m_pos(0),
+          m_end(0),
+          m_used(0)
+    { }
+
+    virtual ~HttpArena();
+
+    // Forgets every allocation, the blocks are reused from the first
+    void Reset()
+    {
+        m_current = m_first;
+        m_pos = m_first ? Data(m_first) : 0;
+        m_end = m_first ? m_pos + m_first->size : 0;
+        m_used = 0;
+    }
+
+    // Releases the blocks not in use past the first threshold bytes
+    void Shrink(size_t threshold);
+
+    // Bytes allocated since Reset, alignment included
+    size_t GetUsed() const
+    {
+        return m_current ? m_used + (m_pos - Data(m_current)) : 0;
+    }
+
+    size_t GetCapacity() const;
+
+protected:
+    virtual void * DoAllocate(size_t size, size_t align)
+    {
+        char *p = AlignUp(m_pos, align);
+        if (m_current && p <= m_end && size <= static_cast<size_t>(m_end - p))
+        {
+            m_pos = p + size;
+            return p;
+        }
+        return Grow(size, align);
+    }
+
+    virtual void DoDeallocate(void *p, size_t size, size_t align)
+    { }
+
+private:
+    // Followed by size bytes, its own size keeps them aligned
+    struct Block
+    {
+        Block *next;
+        size_t size;
+    };
+
+    static char * Data(Block *block)
+    {
+        return reinterpret_cast<char *>(block + 1);
+    }
+
+    static const char * Data(const Block *block)
+    {
+        return reinterpret_cast<const char *>(block + 1);
+    }
+
+    static char * AlignUp(char *p, size_t align)
+    {
+        size_t mask = align - 1;
+        return reinterpret_cast<char *>(
+            (reinterpret_cast<size_t>(p) + mask) & ~mask);
+    }
+
+    // Moves on to the next kept block, or a new one if it is too small
+    void * Grow(size_t size, size_t align);
+
+    Block *m_first;
+    Block *m_current;
+    char *m_pos;
+    char *m_end;
+    // In the blocks before m_current
+    size_t m_used;
+};
+
+// Standard allocator over a HttpMemoryResource, for containers that do
+// not outlive it, e.g. a vector on the arena of the request:
+//   std::vector<int, HttpArenaAllocator<int> > ids(requester.GetArena());
+template <class T>
+class HttpArenaAllocator
+{
+public:
+    typedef T value_type;
+    typedef T * pointer;
+    typedef const T * const_pointer;
+    typedef T & reference;
+    typedef const T & const_reference;
+    typedef size_t size_type;
+    typedef ptrdiff_t difference_type;
+
+    template <class U>
+    struct rebind
+    {
+        typedef HttpArenaAllocator<U> other;
+    };
+
+    HttpArenaAllocator()
+        : m_resource(HttpMemoryResource::Default())
+    { }
+
+    HttpArenaAllocator(HttpMemoryResource &resource)
+        : m_resource(&resource)
+    { }
+
+    template <class U>
+    HttpArenaAllocator(const HttpArenaAllocator<U> &other)
+        : m_resource(other.GetResource())
+    { }
+
+    pointer allocate(size_type n, const void * = 0)
+    {
+        if (n > max_size())
+            throw std::bad_alloc();
+        return static_cast<pointer>(m_resource->Allocate(
+            n * sizeof(T), boost::alignment_of<T>::value));
+    }
+
+    void deallocate(pointer p, size_type n)
+    {
+        m_resource->Deallocate(p, n * sizeof(T),
+                               boost::alignment_of<T>::value);
+    }
+
+    size_type max_size() const
+    {
+        return static_cast<size_type>(-1) / sizeof(T);
+    }
+
+    pointer address(reference value) const
+    {
+        return &value;
+    }
+
+    const_pointer address(const_reference value) const
+    {
+        return &value;
+    }
+
+    void construct(pointer p, const T &value)
+    {
+        new (p) T(value);
+    }
+
+    void destroy(pointer p)
+    {
+        p->~T();
+    }
+
+    HttpMemoryResource * GetResource() const
+    {
+        return m_resource;
+    }
+
+private:
+    HttpMemoryResource *m_resource;
+};
+
+template <class T, class U>
+inline bool operator==(const HttpArenaAllocator<T> &a,
+                       const HttpArenaAllocator<U> &b)
+{
+    return a.GetResource() == b.GetResource();
+}
+
+template <class T, class U>
+inline bool operator!=(const HttpArenaAllocator<T> &a,
+                       const HttpArenaAllocator<U> &b)
+{
+    return a.GetResource() != b.GetResource();
+}
+
+typedef std::basic_string<
+    char, std::char_traits<char>, HttpArenaAllocator<char> > HttpArenaString;
+
+#endif // HTTP_ARENA_H
@@ -0,0 +1,43 @@
+#ifndef HTTP_ASYNC_RESPONSE_H
+#define HTTP_ASYNC_RESPONSE_H
+
+#include <boost/noncopyable.hpp>
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+
+class HttpRequester;
+class HttpResponser;
+
+// Response of a handler that returned before it was ready, taken with
+// HttpResponser::Defer. The connection keeps its place among pipelined
+// requests until Complete, which may be called from any thread.
+class HttpAsyncResponse : private boost::noncopyable
+{
+public:
+    typedef boost::function< void() > CancelCallback;
+
+    virtual ~HttpAsyncResponse()
+    { }
+
+    // The request stays valid as long as the response is referenced
+    virtual const HttpRequester & Requester() const = 0;
+
+    // Filled in by the handler, must not be touched after Complete
+    virtual HttpResponser & Responser() = 0;
+
+    // Hands the response to the connection. Dropping the last reference
+    // without it answers with 500 instead.
+    virtual void Complete() = 0;
+
+    // True once the client went away, the response would be dropped
+    virtual bool IsCancelled() const = 0;
+
+    // Runs on the connection's thread when the client goes away before
+    // Complete, or right away if it already has
+    virtual void OnCancel(const CancelCallback &callback) = 0;
+};
+
+typedef boost::shared_ptr<HttpAsyncResponse> HttpAsyncResponsePtr;
+typedef boost::function< HttpAsyncResponsePtr() > HttpDeferCallback;
+
+#endif // HTTP_ASYNC_RESPONSE_H
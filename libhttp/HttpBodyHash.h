@@ -0,0 +1,82 @@
+#ifndef HTTP_BODY_HASH_H
+#define HTTP_BODY_HASH_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+// Word at a time hash that gives the same value however the body is
+// split into pieces
+class HttpBodyHash
+{
+public:
+    explicit HttpBodyHash(uint64_t seed)
+        : m_hash(seed),
+          m_carry(0),
+          m_carryLength(0)
+    { }
+
+    void Update(const char *data, size_t len)
+    {
+        while (len && m_carryLength)
+        {
+            AddByte(*data++);
+            --len;
+        }
+
+        while (len >= 8)
+        {
+            uint64_t word;
+            memcpy(&word, data, 8);
+            Mix(word);
+            data += 8;
+            len -= 8;
+        }
+
+        while (len)
+        {
+            AddByte(*data++);
+            --len;
+        }
+    }
+
+    uint64_t Final()
+    {
+        if (m_carryLength)
+            Mix(m_carry ^ (uint64_t(m_carryLength) << 56));
+
+        uint64_t h = m_hash;
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ULL;
+        h ^= h >> 33;
+        return h;
+    }
+
+private:
+    void AddByte(char c)
+    {
+        m_carry |= uint64_t(static_cast<unsigned char>(c)) <<
+            (8 * m_carryLength);
+        if (++m_carryLength == 8)
+        {
+            Mix(m_carry);
+            m_carry = 0;
+            m_carryLength = 0;
+        }
+    }
+
+    void Mix(uint64_t word)
+    {
+        m_hash ^= word * 0x87c37b91114253d5ULL;
+        m_hash = (m_hash << 27) | (m_hash >> 37);
+        m_hash = m_hash * 5 + 0x52dce729;
+    }
+
+    uint64_t m_hash;
+    uint64_t m_carry;
+    size_t m_carryLength;
+};
+
+#endif // HTTP_BODY_HASH_H
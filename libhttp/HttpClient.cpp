@@ -0,0 +1,581 @@
+#include "HttpClient.h"
+#include "../TcpServer.h"
+#include <boost/bind.hpp>
+#include <stdio.h>
+#include <strings.h>
+
+int HttpClientResponse::GetStatusCode() const
+{
+    return m_parser ? m_parser->GetStatusCode() : 0;
+}
+
+const HttpHeaderMap & HttpClientResponse::GetHeaders() const
+{
+    static const HttpHeaderMap kNoHeaders;
+    return m_parser ? m_parser->GetHeaders() : kNoHeaders;
+}
+
+const char * HttpClientResponse::GetHeader(const std::string &name) const
+{
+    return m_parser ? m_parser->GetHeader(name) : "";
+}
+
+const Buffer & HttpClientResponse::GetBody() const
+{
+    static const Buffer kNoBody;
+    return m_body ? *m_body : kNoBody;
+}
+
+// One keep-alive connection to a host. Requests go out through the
+// session's write queue, responses come back in order on its read loop,
+// and its watchdog enforces the timeouts.
+class HttpClientConnection : public Session
+{
+public:
+    HttpClientConnection(boost::asio::io_service &service,
+                         const HttpClient::HostPtr &host,
+                         const HttpClientOptions &options)
+        : Session(service),
+          m_host(host),
+          m_options(options),
+          m_connectTimer(service),
+          m_connected(false),
+          m_timedOut(false),
+          m_started(false),
+          m_tooLarge(false),
+          m_data(0),
+          m_dataUsed(0)
+    {
+        SetReadTimeout(options.timeout);
+        SetWriteTimeout(options.timeout);
+
+        HttpLimits limits;
+        limits.maxUrlLength = 0;
+        limits.maxBodySize = 0;
+        m_parser.SetLimits(limits);
+        m_parser.SetBodyCallback(
+            boost::bind(&HttpClientConnection::OnBody, this, _1, _2));
+    }
+
+    void Connect(const boost::asio::ip::tcp::endpoint &endpoint)
+    {
+        HttpClientConnectionPtr self = Self();
+        Socket().async_connect(endpoint, boost::bind(
+            &HttpClientConnection::OnConnect, self, _1));
+        if (m_options.connectTimeoutMs)
+        {
+            m_connectTimer.expires_from_now(
+                boost::posix_time::milliseconds(m_options.connectTimeoutMs));
+            m_connectTimer.async_wait(boost::bind(
+                &HttpClientConnection::OnConnectTimeout, self, _1));
+        }
+    }
+
+    bool IsConnected() const
+    {
+        return m_connected;
+    }
+
+    size_t InFlight() const
+    {
+        return m_inFlight.size();
+    }
+
+    // Nothing is pipelined behind a request that is not idempotent
+    bool CanPipeline() const
+    {
+        return m_inFlight.empty() ||
+            HttpClient::IsIdempotent(m_inFlight.back()->method);
+    }
+
+    void Send(const HttpClient::CallPtr &call)
+    {
+        if (m_inFlight.empty())
+        {
+            m_parser.SetSkipBody(call->method == HTTP_HEAD);
+            // The read waiting on an idle connection started long ago
+            m_readDeadline = Deadline(m_readTimeout);
+        }
+        m_inFlight.push_back(call);
+        WriteResponse(call->data);
+    }
+
+    void Close()
+    {
+        Shutdown();
+    }
+
+protected:
+    virtual bool OnData(const char *buffer, std::size_t bufferLength)
+    {
+        // The bytes stay in the block they were read into, bodies refer
+        // to it instead of being copied out
+        m_readBuffer.Commit(bufferLength);
+        m_data = buffer;
+        m_dataUsed = 0;
+        bool ok = Parse(buffer, bufferLength);
+        m_readBuffer.Clear();
+        m_data = 0;
+
+        HttpClient::HostPtr host = m_host.lock();
+        if (ok && host && host->client)
+            host->client->Schedule(host);
+        return ok;
+    }
+
+    virtual void OnReadTimeout()
+    {
+        // Also how idle connections leave the pool
+        m_timedOut = true;
+        Shutdown();
+    }
+
+    virtual void OnReadEnd(const boost::system::error_code &error)
+    {
+        // A response without length ends with the connection
+        if (m_started && (!error || error == boost::asio::error::eof) &&
+            m_parser.Parse(0, 0) && m_parser.IsComplete())
+            Answer();
+
+        if (error)
+            m_error = error;
+        Shutdown();
+    }
+
+    virtual void OnClose()
+    {
+        boost::system::error_code ignoreError;
+        m_connectTimer.cancel(ignoreError);
+
+        bool connected = m_connected;
+        m_connected = false;
+        std::deque<HttpClient::CallPtr> unanswered;
+        unanswered.swap(m_inFlight);
+
+        HttpClient::HostPtr host = m_host.lock();
+        if (!host || !host->client || !connected)
+            return;
+
+        boost::system::error_code error = m_timedOut ?
+            boost::asio::error::timed_out : m_tooLarge ?
+            boost::asio::error::message_size : m_error ?
+            m_error : boost::asio::error::eof;
+        host->client->OnClosed(host, this, unanswered, m_started, error);
+    }
+
+private:
+    HttpClientConnectionPtr Self()
+    {
+        return boost::static_pointer_cast<HttpClientConnection>(
+            shared_from_this());
+    }
+
+    static void OnConnect(const HttpClientConnectionPtr &self,
+                          const boost::system::error_code &error)
+    {
+        boost::system::error_code ignoreError;
+        self->m_connectTimer.cancel(ignoreError);
+
+        HttpClient::HostPtr host = self->m_host.lock();
+        if (!host || !host->client)
+            return;
+
+        if (error || !self->IsOpen())
+        {
+            self->Socket().close(ignoreError);
+            host->client->OnConnectFailed(host, self.get(), self->m_timedOut ?
+                boost::asio::error::timed_out : error);
+            return;
+        }
+
+        self->Socket().set_option(boost::asio::ip::tcp::no_delay(true),
+                                  ignoreError);
+        self->m_connected = true;
+        self->Go();
+        host->client->Schedule(host);
+    }
+
+    static void OnConnectTimeout(const HttpClientConnectionPtr &self,
+                                 const boost::system::error_code &error)
+    {
+        if (error || self->m_connected)
+            return;
+
+        self->m_timedOut = true;
+        boost::system::error_code ignoreError;
+        self->Socket().close(ignoreError);
+    }
+
+    bool Parse(const char *data, size_t len)
+    {
+        while (len)
+        {
+            // Nothing was asked for
+            if (m_inFlight.empty())
+                return false;
+
+            m_started = true;
+            size_t parsed = 0;
+            if (!m_parser.Parse(data, len, &parsed))
+            {
+                if (!m_tooLarge)
+                    m_error = boost::asio::error::invalid_argument;
+                return false;
+            }
+            data += parsed;
+            len -= parsed;
+
+            if (!m_parser.IsComplete())
+                break;
+            if (!Answer())
+                return false;
+        }
+        return true;
+    }
+
+    // Hands the complete response at the front to its callback, false if
+    // the connection cannot carry another one
+    bool Answer()
+    {
+        int status = m_parser.GetStatusCode();
+        bool keepAlive = m_parser.ShouldKeepAlive();
+        if (status >= 200 || status == 101)
+        {
+            HttpClient::CallPtr call = m_inFlight.front();
+            m_inFlight.pop_front();
+            m_started = false;
+
+            HttpClientResponse response(m_parser, m_body);
+            call->callback(boost::system::error_code(), response);
+        }
+
+        // Interim 1xx responses are skipped. The callback may have sent
+        // the next request, it is set up only now.
+        m_body.Clear();
+        m_parser.Reset();
+        if (!m_inFlight.empty())
+            m_parser.SetSkipBody(m_inFlight.front()->method == HTTP_HEAD);
+        return keepAlive;
+    }
+
+    bool OnBody(const char *data, size_t len)
+    {
+        if (m_options.maxBodySize && m_body.Size() + len > m_options.maxBodySize)
+        {
+            m_tooLarge = true;
+            return false;
+        }
+
+        // The read buffer holds what OnData got from m_dataUsed on
+        size_t offset = data - m_data;
+        m_readBuffer.Consume(offset - m_dataUsed);
+        m_readBuffer.Split(len, m_body);
+        m_dataUsed = offset + len;
+        return true;
+    }
+
+    boost::weak_ptr<HttpClient::Host> m_host;
+    HttpClientOptions m_options;
+    boost::asio::deadline_timer m_connectTimer;
+    bool m_connected;
+    bool m_timedOut;
+    // Part of the front response came in
+    bool m_started;
+    bool m_tooLarge;
+    boost::system::error_code m_error;
+
+    std::deque<HttpClient::CallPtr> m_inFlight;
+    HttpParser m_parser;
+    Buffer m_body;
+    const char *m_data;
+    size_t m_dataUsed;
+};
+
+HttpClient::HttpClient(boost::asio::io_service &service,
+                       const HttpClientOptions &options)
+    : m_service(service),
+      m_options(options),
+      m_resolver(service)
+{
+    if (!m_options.maxConnections)
+        m_options.maxConnections = 1;
+    if (!m_options.pipelineDepth)
+        m_options.pipelineDepth = 1;
+}
+
+HttpClient::~HttpClient()
+{
+    Hosts hosts;
+    hosts.swap(m_hosts);
+    for (Hosts::iterator it = hosts.begin(); it != hosts.end(); ++it)
+    {
+        Host &host = *it->second;
+        host.client = 0;
+        std::vector<HttpClientConnectionPtr> connections;
+        connections.swap(host.connections);
+        for (size_t i = 0; i < connections.size(); ++i)
+            connections[i]->Close();
+    }
+}
+
+bool HttpClient::Send(const HttpClientRequest &request,
+                      const HttpClientCallback &callback)
+{
+    const std::string &url = request.url;
+    struct http_parser_url parts;
+    http_parser_url_init(&parts);
+    if (http_parser_parse_url(url.data(), url.size(), 0, &parts) ||
+        !(parts.field_set & (1 << UF_SCHEMA)) ||
+        !(parts.field_set & (1 << UF_HOST)) ||
+        parts.field_data[UF_SCHEMA].len != 4 ||
+        strncasecmp(url.data() + parts.field_data[UF_SCHEMA].off, "http", 4))
+        return false;
+
+    std::string name = url.substr(parts.field_data[UF_HOST].off,
+                                  parts.field_data[UF_HOST].len);
+    std::string port = "80";
+    if (parts.field_set & (1 << UF_PORT))
+        port = url.substr(parts.field_data[UF_PORT].off,
+                          parts.field_data[UF_PORT].len);
+
+    // Path and query as they are, without the fragment
+    size_t begin = url.size();
+    if (parts.field_set & (1 << UF_PATH))
+        begin = parts.field_data[UF_PATH].off;
+    else if (parts.field_set & (1 << UF_QUERY))
+        begin = parts.field_data[UF_QUERY].off - 1;
+    size_t end = url.size();
+    if (parts.field_set & (1 << UF_FRAGMENT))
+        end = parts.field_data[UF_FRAGMENT].off - 1;
+
+    std::string head(http_method_str(request.method));
+    head.append(" ");
+    if (begin < end && url[begin] != '/')
+        head.append("/");
+    head.append(url, begin, end - begin);
+    if (begin >= end)
+        head.append("/");
+    head.append(" HTTP/1.1\r\n");
+
+    bool hasHost = false;
+    for (HttpHeaderMap::const_iterator it = request.headers.begin();
+         it != request.headers.end(); ++it)
+    {
+        if (strcasecmp(it->first.c_str(), "Content-Length") == 0)
+            continue;
+        if (strcasecmp(it->first.c_str(), "Host") == 0)
+            hasHost = true;
+        head.append(it->first);
+        head.append(": ");
+        head.append(it->second);
+        head.append("\r\n");
+    }
+
+    if (!hasHost)
+    {
+        head.append("Host: ");
+        head.append(name);
+        if (port != "80")
+        {
+            head.append(":");
+            head.append(port);
+        }
+        head.append("\r\n");
+    }
+
+    HttpMethod method = request.method;
+    if (!request.body.Empty() || method == HTTP_POST ||
+        method == HTTP_PUT || method == HTTP_PATCH)
+    {
+        char buf[64];
+        snprintf(buf, sizeof(buf), "Content-Length: %lu\r\n",
+                 static_cast<unsigned long>(request.body.Size()));
+        head.append(buf);
+    }
+    head.append("\r\n");
+
+    CallPtr call(new Call);
+    call->method = method;
+    call->callback = callback;
+    call->data.Append(head);
+    call->data.Append(request.body);
+
+    HostPtr &host = m_hosts[name + ":" + port];
+    if (!host)
+    {
+        host.reset(new Host);
+        host->client = this;
+        host->name = name;
+        host->port = port;
+    }
+    host->queue.push_back(call);
+
+    if (host->resolved)
+    {
+        Schedule(host);
+    }
+    else if (!host->resolving)
+    {
+        host->resolving = true;
+        boost::asio::ip::tcp::resolver::query query(name, port);
+        m_resolver.async_resolve(query, boost::bind(
+            &HttpClient::OnResolve, boost::weak_ptr<Host>(host), _1, _2));
+    }
+    return true;
+}
+
+bool HttpClient::Get(const std::string &url, const HttpClientCallback &callback)
+{
+    HttpClientRequest request;
+    request.url = url;
+    return Send(request, callback);
+}
+
+// Idle connections first, then new ones up to the limit, then pipelining
+// onto the least busy one. The rest waits for a connection to free up.
+void HttpClient::Schedule(const HostPtr &host)
+{
+    while (!host->queue.empty())
+    {
+        bool idempotent = IsIdempotent(host->queue.front()->method);
+        HttpClientConnection *idle = 0;
+        HttpClientConnection *pipeline = 0;
+        size_t connecting = 0;
+        for (size_t i = 0; i < host->connections.size(); ++i)
+        {
+            HttpClientConnection *connection = host->connections[i].get();
+            if (!connection->IsConnected())
+            {
+                ++connecting;
+                continue;
+            }
+
+            size_t inFlight = connection->InFlight();
+            if (!inFlight)
+            {
+                idle = connection;
+                break;
+            }
+            if (idempotent && inFlight < m_options.pipelineDepth &&
+                connection->CanPipeline() &&
+                (!pipeline || inFlight < pipeline->InFlight()))
+                pipeline = connection;
+        }
+
+        if (!idle && host->queue.size() > connecting &&
+            host->connections.size() < m_options.maxConnections)
+        {
+            HttpClientConnectionPtr connection(
+                new HttpClientConnection(m_service, host, m_options));
+            host->connections.push_back(connection);
+            connection->Connect(host->endpoint);
+            continue;
+        }
+
+        HttpClientConnection *connection = idle ? idle : pipeline;
+        if (!connection)
+            break;
+
+        CallPtr call = host->queue.front();
+        host->queue.pop_front();
+        connection->Send(call);
+    }
+}
+
+void HttpClient::OnResolve(const boost::weak_ptr<Host> &weakHost,
+                           const boost::system::error_code &error,
+                           boost::asio::ip::tcp::resolver::iterator it)
+{
+    HostPtr host = weakHost.lock();
+    if (!host || !host->client)
+        return;
+
+    host->resolving = false;
+    if (error || it == boost::asio::ip::tcp::resolver::iterator())
+    {
+        std::deque<CallPtr> failed;
+        failed.swap(host->queue);
+        Fail(failed, error ? error : boost::asio::error::host_not_found);
+        return;
+    }
+
+    host->endpoint = *it;
+    host->resolved = true;
+    host->client->Schedule(host);
+}
+
+void HttpClient::Fail(std::deque<CallPtr> &calls,
+                      const boost::system::error_code &error)
+{
+    HttpClientResponse none;
+    for (size_t i = 0; i < calls.size(); ++i)
+        calls[i]->callback(error, none);
+}
+
+void HttpClient::OnConnectFailed(const HostPtr &host,
+                                 HttpClientConnection *connection,
+                                 const boost::system::error_code &error)
+{
+    HttpClientConnectionPtr keep;
+    for (size_t i = 0; i < host->connections.size(); ++i)
+    {
+        if (host->connections[i].get() == connection)
+        {
+            keep = host->connections[i];
+            host->connections.erase(host->connections.begin() + i);
+            break;
+        }
+    }
+
+    // Others may still take the queue, otherwise it cannot be served
+    std::deque<CallPtr> failed;
+    if (host->connections.empty())
+        failed.swap(host->queue);
+    Fail(failed, error);
+}
+
+void HttpClient::OnClosed(const HostPtr &host,
+                          HttpClientConnection *connection,
+                          std::deque<CallPtr> &unanswered, bool frontStarted,
+                          const boost::system::error_code &error)
+{
+    HttpClientConnectionPtr keep;
+    for (size_t i = 0; i < host->connections.size(); ++i)
+    {
+        if (host->connections[i].get() == connection)
+        {
+            keep = host->connections[i];
+            host->connections.erase(host->connections.begin() + i);
+            break;
+        }
+    }
+
+    // What got no answer yet is sent once more, unless it may have been
+    // acted on: a request that is not idempotent, or timed out
+    std::deque<CallPtr> failed;
+    for (size_t i = unanswered.size(); i-- > 0; )
+    {
+        const CallPtr &call = unanswered[i];
+        if (!call->retried && IsIdempotent(call->method) &&
+            error != boost::asio::error::timed_out &&
+            !(i == 0 && frontStarted))
+        {
+            call->retried = true;
+            host->queue.push_front(call);
+        }
+        else
+        {
+            failed.push_front(call);
+        }
+    }
+
+    Schedule(host);
+    Fail(failed, error);
+}
+
+bool HttpClient::IsIdempotent(HttpMethod method)
+{
+    return method == HTTP_GET || method == HTTP_HEAD ||
+        method == HTTP_PUT || method == HTTP_DELETE ||
+        method == HTTP_OPTIONS || method == HTTP_TRACE;
+}
@@ -0,0 +1,168 @@
+#ifndef HTTP_CLIENT_H
+#define HTTP_CLIENT_H
+
+#include "HttpParser.h"
+#include "../Buffer.h"
+#include <boost/asio.hpp>
+#include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/weak_ptr.hpp>
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+
+class HttpClientConnection;
+typedef boost::shared_ptr<HttpClientConnection> HttpClientConnectionPtr;
+
+struct HttpClientOptions
+{
+    HttpClientOptions()
+        : maxConnections(4),
+          pipelineDepth(1),
+          connectTimeoutMs(3000),
+          timeout(10),
+          maxBodySize(16 * 1024 * 1024)
+    { }
+
+    // Per host
+    size_t maxConnections;
+    // Requests sent on one connection before the first is answered, 1
+    // for none. Only idempotent requests are pipelined.
+    size_t pipelineDepth;
+    unsigned int connectTimeoutMs;
+    // Seconds a connection may go without reading or writing while a
+    // request waits on it, and stay idle in the pool
+    unsigned int timeout;
+    size_t maxBodySize;
+};
+
+struct HttpClientRequest
+{
+    HttpClientRequest()
+        : method(HTTP_GET)
+    { }
+
+    HttpMethod method;
+    // http://host[:port]/path?query
+    std::string url;
+    // Host and Content-Length are added
+    HttpHeaderMap headers;
+    Buffer body;
+};
+
+// Valid during the callback only, except the body which may be kept:
+// it refers to the blocks the connection read it into.
+class HttpClientResponse : private boost::noncopyable
+{
+public:
+    HttpClientResponse()
+        : m_parser(0),
+          m_body(0)
+    { }
+
+    HttpClientResponse(const HttpParser &parser, const Buffer &body)
+        : m_parser(&parser),
+          m_body(&body)
+    { }
+
+    // 0 when the request failed
+    int GetStatusCode() const;
+    const HttpHeaderMap & GetHeaders() const;
+    const char * GetHeader(const std::string &name) const;
+    const Buffer & GetBody() const;
+
+private:
+    const HttpParser *m_parser;
+    const Buffer *m_body;
+};
+
+typedef boost::function< void(const boost::system::error_code &,
+                              const HttpClientResponse &) > HttpClientCallback;
+
+// Asynchronous HTTP/1.1 client on the server's io_service, so handlers
+// can call other services without blocking the loop. Connections are
+// kept alive in a pool per host. Must be used from the io_service
+// thread, callbacks run there too.
+class HttpClient : private boost::noncopyable
+{
+public:
+    HttpClient(boost::asio::io_service &service,
+               const HttpClientOptions &options = HttpClientOptions());
+
+    // Requests still waiting are dropped without their callbacks
+    ~HttpClient();
+
+    // False if the url is not an http url, callback is not called then.
+    // Otherwise callback is called once, with an error if no response
+    // came back.
+    bool Send(const HttpClientRequest &request,
+              const HttpClientCallback &callback);
+    bool Get(const std::string &url, const HttpClientCallback &callback);
+
+private:
+    friend class HttpClientConnection;
+
+    // A request on its way, serialized once
+    struct Call
+    {
+        Call()
+            : method(HTTP_GET),
+              retried(false)
+        { }
+
+        HttpMethod method;
+        Buffer data;
+        HttpClientCallback callback;
+        bool retried;
+    };
+
+    typedef boost::shared_ptr<Call> CallPtr;
+
+    struct Host
+    {
+        Host()
+            : client(0),
+              resolving(false),
+              resolved(false)
+        { }
+
+        // Cleared when the client goes, connections then stop calling it
+        HttpClient *client;
+        std::string name;
+        std::string port;
+        boost::asio::ip::tcp::endpoint endpoint;
+        bool resolving;
+        bool resolved;
+        std::vector<HttpClientConnectionPtr> connections;
+        std::deque<CallPtr> queue;
+    };
+
+    typedef boost::shared_ptr<Host> HostPtr;
+    typedef std::map<std::string, HostPtr> Hosts;
+
+    void Schedule(const HostPtr &host);
+    static void OnResolve(const boost::weak_ptr<Host> &host,
+                          const boost::system::error_code &error,
+                          boost::asio::ip::tcp::resolver::iterator it);
+    static void Fail(std::deque<CallPtr> &calls,
+                     const boost::system::error_code &error);
+
+    // From the connections
+    void OnConnectFailed(const HostPtr &host,
+                         HttpClientConnection *connection,
+                         const boost::system::error_code &error);
+    void OnClosed(const HostPtr &host, HttpClientConnection *connection,
+                  std::deque<CallPtr> &unanswered, bool frontStarted,
+                  const boost::system::error_code &error);
+
+    static bool IsIdempotent(HttpMethod method);
+
+    boost::asio::io_service &m_service;
+    HttpClientOptions m_options;
+    boost::asio::ip::tcp::resolver m_resolver;
+    Hosts m_hosts;
+};
+
+#endif // HTTP_CLIENT_H
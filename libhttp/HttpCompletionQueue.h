@@ -0,0 +1,61 @@
+#ifndef HTTP_COMPLETION_QUEUE_H
+#define HTTP_COMPLETION_QUEUE_H
+
+#include <boost/asio.hpp>
+#include <boost/atomic.hpp>
+#include <boost/bind.hpp>
+#include <boost/function.hpp>
+#include <boost/lockfree/queue.hpp>
+#include <boost/noncopyable.hpp>
+
+// Hands work from other threads to an io_service. Posting only pushes to
+// a lock-free queue, the io_service gets one drain call per batch
+// instead of one handler per completion.
+class HttpCompletionQueue : private boost::noncopyable
+{
+public:
+    typedef boost::function< void() > Completion;
+
+    explicit HttpCompletionQueue(boost::asio::io_service &service)
+        : m_service(service),
+          m_queue(kInitialCapacity),
+          m_scheduled(false)
+    { }
+
+    ~HttpCompletionQueue()
+    {
+        Completion *completion;
+        while (m_queue.pop(completion))
+            delete completion;
+    }
+
+    // From any thread
+    void Post(const Completion &completion)
+    {
+        m_queue.push(new Completion(completion));
+        if (!m_scheduled.exchange(true))
+            m_service.post(boost::bind(&HttpCompletionQueue::Drain, this));
+    }
+
+private:
+    const static size_t kInitialCapacity = 1024;
+
+    void Drain()
+    {
+        // Cleared first, a completion pushed meanwhile schedules again
+        m_scheduled.store(false);
+
+        Completion *completion;
+        while (m_queue.pop(completion))
+        {
+            (*completion)();
+            delete completion;
+        }
+    }
+
+    boost::asio::io_service &m_service;
+    boost::lockfree::queue<Completion *> m_queue;
+    boost::atomic<bool> m_scheduled;
+};
+
+#endif // HTTP_COMPLETION_QUEUE_H
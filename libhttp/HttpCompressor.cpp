@@ -0,0 +1,467 @@
+#include "HttpCompressor.h"
+#include "HttpBodyHash.h"
+#include <boost/thread/tss.hpp>
+#include <strings.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+
+namespace
+{
+    const int kGzipWindowBits = 15 + 16;
+    const int kDeflateWindowBits = 15;
+    const int kMemLevel = 8;
+
+    typedef std::vector<std::pair<const char *, size_t> > BodyPieces;
+
+    // Contiguous pieces of a body, whichever way the responser holds it
+    void GetBodyPieces(const HttpResponser &resp, BodyPieces &pieces)
+    {
+        pieces.clear();
+        const std::string &body = resp.GetBody();
+        if (!body.empty())
+            pieces.push_back(std::make_pair(body.data(), body.size()));
+
+        const Buffer &shared = resp.GetSharedBody();
+        for (size_t i = 0; i < shared.SegmentCount(); ++i)
+        {
+            if (shared.SegmentSize(i))
+                pieces.push_back(std::make_pair(shared.SegmentData(i),
+                                                shared.SegmentSize(i)));
+        }
+    }
+
+    bool SameContent(const Buffer &buffer, const BodyPieces &pieces)
+    {
+        size_t segment = 0;
+        size_t segmentOffset = 0;
+        for (size_t i = 0; i < pieces.size(); ++i)
+        {
+            const char *data = pieces[i].first;
+            size_t len = pieces[i].second;
+            while (len)
+            {
+                if (segment >= buffer.SegmentCount())
+                    return false;
+
+                size_t room = buffer.SegmentSize(segment) - segmentOffset;
+                size_t n = len < room ? len : room;
+                if (memcmp(buffer.SegmentData(segment) + segmentOffset,
+                           data, n) != 0)
+                    return false;
+
+                data += n;
+                len -= n;
+                segmentOffset += n;
+                if (segmentOffset == buffer.SegmentSize(segment))
+                {
+                    ++segment;
+                    segmentOffset = 0;
+                }
+            }
+        }
+        return true;
+    }
+
+    // Seeded per process, entries are compared in full on a hit anyway
+    uint64_t GetHashSeed()
+    {
+        static uint64_t seed =
+            (uint64_t(time(0)) << 32) ^ uint64_t(random()) ^
+            0x9e3779b97f4a7c15ULL;
+        return seed;
+    }
+
+    bool StartsWith(const char *s, const char *prefix)
+    {
+        return strncasecmp(s, prefix, strlen(prefix)) == 0;
+    }
+
+    // Trims spaces around [begin, end)
+    void Trim(const char *&begin, const char *&end)
+    {
+        while (begin < end && (*begin == ' ' || *begin == '\t'))
+            ++begin;
+        while (end > begin && (end[-1] == ' ' || end[-1] == '\t'))
+            --end;
+    }
+
+    bool TokenIs(const char *begin, const char *end, const char *token)
+    {
+        size_t len = strlen(token);
+        return static_cast<size_t>(end - begin) == len &&
+            strncasecmp(begin, token, len) == 0;
+    }
+
+    HttpDeflater & GetThreadDeflater()
+    {
+        static boost::thread_specific_ptr<HttpDeflater> deflater;
+        if (!deflater.get())
+            deflater.reset(new HttpDeflater);
+        return *deflater;
+    }
+}
+
+HttpDeflater::HttpDeflater()
+    : m_initialized(false),
+      m_encoding(HttpEncoding_Identity),
+      m_level(0)
+{
+    memset(&m_stream, 0, sizeof(m_stream));
+}
+
+HttpDeflater::~HttpDeflater()
+{
+    if (m_initialized)
+        deflateEnd(&m_stream);
+}
+
+bool HttpDeflater::Begin(HttpEncoding encoding, int level)
+{
+    if (m_initialized && m_encoding == encoding && m_level == level)
+        return deflateReset(&m_stream) == Z_OK;
+
+    if (m_initialized)
+    {
+        deflateEnd(&m_stream);
+        m_initialized = false;
+    }
+
+    memset(&m_stream, 0, sizeof(m_stream));
+    int windowBits = encoding == HttpEncoding_Gzip ?
+        kGzipWindowBits : kDeflateWindowBits;
+    if (deflateInit2(&m_stream, level, Z_DEFLATED, windowBits,
+                     kMemLevel, Z_DEFAULT_STRATEGY) != Z_OK)
+        return false;
+
+    m_initialized = true;
+    m_encoding = encoding;
+    m_level = level;
+    return true;
+}
+
+bool HttpDeflater::Write(const char *data, size_t len, Buffer &output,
+                         bool flush)
+{
+    if (!m_initialized)
+        return false;
+
+    m_stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data));
+    m_stream.avail_in = len;
+    return Deflate(flush ? Z_SYNC_FLUSH : Z_NO_FLUSH, output);
+}
+
+bool HttpDeflater::Finish(Buffer &output)
+{
+    if (!m_initialized)
+        return false;
+
+    m_stream.next_in = 0;
+    m_stream.avail_in = 0;
+    return Deflate(Z_FINISH, output);
+}
+
+// Output goes straight into the free room of output's tail block
+bool HttpDeflater::Deflate(int flush, Buffer &output)
+{
+    while (1)
+    {
+        size_t room;
+        char *tail = output.WritableTail(&room);
+        m_stream.next_out = reinterpret_cast<Bytef *>(tail);
+        m_stream.avail_out = room;
+
+        int ret = deflate(&m_stream, flush);
+        output.Commit(room - m_stream.avail_out);
+
+        if (ret == Z_STREAM_END)
+            return true;
+        if (ret != Z_OK && ret != Z_BUF_ERROR)
+            return false;
+
+        // Room left over means zlib has nothing more to give for now
+        if (m_stream.avail_out != 0)
+            return flush != Z_FINISH;
+    }
+}
+
+bool HttpCompressor::CacheKey::operator<(const CacheKey &other) const
+{
+    if (hash != other.hash)
+        return hash < other.hash;
+    if (size != other.size)
+        return size < other.size;
+    if (encoding != other.encoding)
+        return encoding < other.encoding;
+    return level < other.level;
+}
+
+HttpCompressor::HttpCompressor()
+    : m_cacheSize(0)
+{ }
+
+void HttpCompressor::SetOptions(const HttpCompression &options)
+{
+    m_options = options;
+
+    boost::mutex::scoped_lock lock(m_cacheMutex);
+    m_cacheList.clear();
+    m_cacheMap.clear();
+    m_cacheSize = 0;
+}
+
+const HttpCompression & HttpCompressor::GetOptions() const
+{
+    return m_options;
+}
+
+HttpEncoding HttpCompressor::GetAccepted(const HttpRequester &req) const
+{
+    if (!m_options.enabled)
+        return HttpEncoding_Identity;
+    return ParseAcceptEncoding(req.GetHeader("Accept-Encoding"));
+}
+
+HttpEncoding HttpCompressor::Negotiate(HttpEncoding accepted,
+                                       HttpResponser &resp) const
+{
+    if (!m_options.enabled)
+        return HttpEncoding_Identity;
+
+    int status = resp.GetStatusCode();
+    if (status < 200 || status == HttpResponser::StatusCode_204NoContent ||
+        status == HttpResponser::StatusCode_304NotModified)
+        return HttpEncoding_Identity;
+
+    if (!resp.IsCompressible() || *resp.GetHeader("Content-Encoding") ||
+        !IsCompressibleType(resp.GetHeader("Content-Type")))
+        return HttpEncoding_Identity;
+
+    // A streamed body has no size yet, it is compressed as it goes
+    if (!resp.IsStreaming() && resp.GetBodySize() < m_options.minSize)
+        return HttpEncoding_Identity;
+
+    // Caches must keep the variants apart even when this one is identity
+    std::string vary = resp.GetHeader("Vary");
+    if (vary.empty())
+        resp.AddHeader("Vary", "Accept-Encoding");
+    else if (vary.find("Accept-Encoding") == std::string::npos)
+        resp.AddHeader("Vary", vary + ", Accept-Encoding");
+
+    return accepted;
+}
+
+bool HttpCompressor::Compress(HttpEncoding encoding,
+                              HttpResponser &resp) const
+{
+    if (encoding == HttpEncoding_Identity)
+        return false;
+
+    BodyPieces pieces;
+    GetBodyPieces(resp, pieces);
+
+    size_t size = resp.GetBodySize();
+    bool cacheable = m_options.cacheBytes && size <= m_options.maxCachedBody;
+
+    CacheKey key;
+    if (cacheable)
+    {
+        HttpBodyHash hash(GetHashSeed());
+        for (size_t i = 0; i < pieces.size(); ++i)
+            hash.Update(pieces[i].first, pieces[i].second);
+        key.hash = hash.Final();
+        key.size = size;
+        key.encoding = encoding;
+        key.level = m_options.level;
+
+        Buffer compressed;
+        if (FindCached(key, pieces, compressed))
+        {
+            resp.SetBody(compressed);
+            resp.AddHeader("Content-Encoding", GetEncodingName(encoding));
+            return true;
+        }
+    }
+
+    HttpDeflater &deflater = GetThreadDeflater();
+    if (!deflater.Begin(encoding, m_options.level))
+        return false;
+
+    Buffer compressed;
+    for (size_t i = 0; i < pieces.size(); ++i)
+    {
+        if (!deflater.Write(pieces[i].first, pieces[i].second,
+                            compressed, false))
+            return false;
+    }
+    if (!deflater.Finish(compressed))
+        return false;
+
+    if (cacheable)
+    {
+        // A shared body is kept by reference, an owned one is copied
+        Buffer original;
+        const std::string &body = resp.GetBody();
+        if (!body.empty())
+            original.Append(body);
+        original.Append(resp.GetSharedBody());
+        AddCached(key, original, compressed);
+    }
+
+    resp.SetBody(compressed);
+    resp.AddHeader("Content-Encoding", GetEncodingName(encoding));
+    return true;
+}
+
+HttpEncoding HttpCompressor::ParseAcceptEncoding(const char *acceptEncoding)
+{
+    bool gzip = false;
+    bool deflate = false;
+    bool gzipRefused = false;
+    bool any = false;
+
+    const char *p = acceptEncoding;
+    while (*p)
+    {
+        const char *end = strchr(p, ',');
+        if (!end)
+            end = p + strlen(p);
+
+        const char *tokenEnd = static_cast<const char *>(
+            memchr(p, ';', end - p));
+        if (!tokenEnd)
+            tokenEnd = end;
+
+        // "q=0" (or 0.0...) refuses the coding, any other weight accepts it
+        bool refused = false;
+        if (tokenEnd < end)
+        {
+            const char *q = tokenEnd + 1;
+            const char *qEnd = end;
+            Trim(q, qEnd);
+            if (qEnd - q >= 3 && StartsWith(q, "q=") && q[2] == '0')
+            {
+                refused = true;
+                for (const char *d = q + 3; d < qEnd; ++d)
+                {
+                    if (*d != '.' && *d != '0')
+                        refused = false;
+                }
+            }
+        }
+
+        const char *token = p;
+        Trim(token, tokenEnd);
+        if (TokenIs(token, tokenEnd, "gzip") ||
+            TokenIs(token, tokenEnd, "x-gzip"))
+        {
+            gzip = !refused;
+            gzipRefused = refused;
+        }
+        else if (TokenIs(token, tokenEnd, "deflate"))
+        {
+            deflate = !refused;
+        }
+        else if (TokenIs(token, tokenEnd, "*"))
+        {
+            any = !refused;
+        }
+
+        p = *end ? end + 1 : end;
+    }
+
+    if (gzip || (any && !gzipRefused))
+        return HttpEncoding_Gzip;
+    if (deflate)
+        return HttpEncoding_Deflate;
+    return HttpEncoding_Identity;
+}
+
+bool HttpCompressor::IsCompressibleType(const char *contentType)
+{
+    if (StartsWith(contentType, "image/svg"))
+        return true;
+
+    static const char *kCompressed[] =
+    {
+        "image/",
+        "video/",
+        "audio/",
+        "font/woff",
+        "application/zip",
+        "application/gzip",
+        "application/x-gzip",
+        "application/x-bzip2",
+        "application/x-xz",
+        "application/x-7z-compressed",
+        "application/octet-stream",
+    };
+
+    for (size_t i = 0; i < sizeof(kCompressed) / sizeof(kCompressed[0]); ++i)
+    {
+        if (StartsWith(contentType, kCompressed[i]))
+            return false;
+    }
+    return true;
+}
+
+const char * HttpCompressor::GetEncodingName(HttpEncoding encoding)
+{
+    switch (encoding)
+    {
+    case HttpEncoding_Gzip:
+        return "gzip";
+    case HttpEncoding_Deflate:
+        return "deflate";
+    default:
+        return "identity";
+    }
+}
+
+bool HttpCompressor::FindCached(const CacheKey &key, const BodyPieces &pieces,
+                                Buffer &compressed) const
+{
+    boost::mutex::scoped_lock lock(m_cacheMutex);
+    CacheMap::iterator it = m_cacheMap.find(key);
+    if (it == m_cacheMap.end())
+        return false;
+
+    if (!SameContent(it->second->original, pieces))
+        return false;
+
+    m_cacheList.splice(m_cacheList.begin(), m_cacheList, it->second);
+    compressed.Append(it->second->compressed);
+    return true;
+}
+
+void HttpCompressor::AddCached(const CacheKey &key, const Buffer &original,
+                               const Buffer &compressed) const
+{
+    size_t cost = original.Size() + compressed.Size();
+    if (cost > m_options.cacheBytes)
+        return;
+
+    boost::mutex::scoped_lock lock(m_cacheMutex);
+    CacheMap::iterator it = m_cacheMap.find(key);
+    if (it != m_cacheMap.end())
+    {
+        // Another thread got there first, or a colliding body
+        return;
+    }
+
+    while (m_cacheSize + cost > m_options.cacheBytes && !m_cacheList.empty())
+    {
+        CacheEntry &last = m_cacheList.back();
+        m_cacheSize -= last.original.Size() + last.compressed.Size();
+        m_cacheMap.erase(last.key);
+        m_cacheList.pop_back();
+    }
+
+    m_cacheList.push_front(CacheEntry());
+    CacheEntry &entry = m_cacheList.front();
+    entry.key = key;
+    entry.original.Append(original);
+    entry.compressed.Append(compressed);
+    m_cacheMap[key] = m_cacheList.begin();
+    m_cacheSize += cost;
+}
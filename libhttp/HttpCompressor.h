@@ -0,0 +1,127 @@
+#ifndef HTTP_COMPRESSOR_H
+#define HTTP_COMPRESSOR_H
+
+#include "HttpRequester.h"
+#include "HttpResponser.h"
+#include "../Buffer.h"
+#include <boost/noncopyable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <stdint.h>
+#include <zlib.h>
+#include <list>
+#include <map>
+#include <vector>
+
+struct HttpCompression
+{
+    HttpCompression()
+        : enabled(false),
+          level(Z_DEFAULT_COMPRESSION),
+          minSize(1024),
+          cacheBytes(16 * 1024 * 1024),
+          maxCachedBody(1024 * 1024)
+    { }
+
+    bool enabled;
+    int level;
+    // Bodies below this are sent as they are
+    size_t minSize;
+    // Compressed forms of identical bodies are kept up to this many bytes
+    size_t cacheBytes;
+    size_t maxCachedBody;
+};
+
+enum HttpEncoding
+{
+    HttpEncoding_Identity,
+    HttpEncoding_Gzip,
+    HttpEncoding_Deflate,
+};
+
+// zlib stream writing its output straight into Buffer blocks
+class HttpDeflater : private boost::noncopyable
+{
+public:
+    HttpDeflater();
+    ~HttpDeflater();
+
+    // Starts a new body, reusing the zlib state when the parameters match
+    bool Begin(HttpEncoding encoding, int level);
+
+    // flush makes everything written so far decodable by the client
+    bool Write(const char *data, size_t len, Buffer &output, bool flush);
+    bool Finish(Buffer &output);
+
+private:
+    bool Deflate(int flush, Buffer &output);
+
+    z_stream m_stream;
+    bool m_initialized;
+    HttpEncoding m_encoding;
+    int m_level;
+};
+
+class HttpCompressor : private boost::noncopyable
+{
+public:
+    HttpCompressor();
+
+    void SetOptions(const HttpCompression &options);
+    const HttpCompression & GetOptions() const;
+
+    // Best encoding the request accepts, identity when disabled
+    HttpEncoding GetAccepted(const HttpRequester &req) const;
+
+    // Picks the encoding for this response out of the accepted one and
+    // sets Vary. Bodies that are small, already compressed, bodyless by
+    // status or not compressible by the responser stay identity.
+    // Content-Encoding is only set once the body is actually compressed.
+    HttpEncoding Negotiate(HttpEncoding accepted, HttpResponser &resp) const;
+
+    // Replaces the body of resp with its compressed form and sets
+    // Content-Encoding, false leaves resp as it was
+    bool Compress(HttpEncoding encoding, HttpResponser &resp) const;
+
+    static HttpEncoding ParseAcceptEncoding(const char *acceptEncoding);
+    static bool IsCompressibleType(const char *contentType);
+    static const char * GetEncodingName(HttpEncoding encoding);
+
+private:
+    struct CacheKey
+    {
+        uint64_t hash;
+        size_t size;
+        int encoding;
+        int level;
+
+        bool operator<(const CacheKey &other) const;
+    };
+
+    // The original body is kept to rule out hash collisions
+    struct CacheEntry
+    {
+        CacheKey key;
+        Buffer original;
+        Buffer compressed;
+    };
+
+    typedef std::list<CacheEntry> CacheList;
+    typedef std::map<CacheKey, CacheList::iterator> CacheMap;
+
+    typedef std::vector<std::pair<const char *, size_t> > BodyPieces;
+
+    bool FindCached(const CacheKey &key, const BodyPieces &pieces,
+                    Buffer &compressed) const;
+    void AddCached(const CacheKey &key, const Buffer &original,
+                   const Buffer &compressed) const;
+
+    HttpCompression m_options;
+
+    // Shared by all sessions and threads of the server
+    mutable boost::mutex m_cacheMutex;
+    mutable CacheList m_cacheList;
+    mutable CacheMap m_cacheMap;
+    mutable size_t m_cacheSize;
+};
+
+#endif // HTTP_COMPRESSOR_H
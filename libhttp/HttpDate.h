@@ -0,0 +1,80 @@
+#ifndef HTTP_DATE_H
+#define HTTP_DATE_H
+
+#include "HttpFormat.h"
+#include "../CoarseClock.h"
+#include <string.h>
+#include <time.h>
+
+class HttpDate
+{
+public:
+    // Length of "Sun, 06 Nov 1994 08:49:37 GMT"
+    const static size_t kLength = 29;
+
+    // Writes the IMF-fixdate of t into buf (at least kLength bytes)
+    static size_t Format(char *buf, time_t t)
+    {
+        static const char kDays[] = "SunMonTueWedThuFriSat";
+        static const char kMonths[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+
+        struct tm tm;
+        gmtime_r(&t, &tm);
+
+        char *p = buf;
+        memcpy(p, kDays + tm.tm_wday * 3, 3);
+        p += 3;
+        *p++ = ',';
+        *p++ = ' ';
+        p = TwoDigits(p, tm.tm_mday);
+        *p++ = ' ';
+        memcpy(p, kMonths + tm.tm_mon * 3, 3);
+        p += 3;
+        *p++ = ' ';
+        p += FormatDecimal(p, tm.tm_year + 1900);
+        *p++ = ' ';
+        p = TwoDigits(p, tm.tm_hour);
+        *p++ = ':';
+        p = TwoDigits(p, tm.tm_min);
+        *p++ = ':';
+        p = TwoDigits(p, tm.tm_sec);
+        memcpy(p, " GMT", 4);
+        p += 4;
+        return p - buf;
+    }
+
+    // "Date: ...\r\n" for the current second. Each thread formats it at
+    // most once per second, every other call is a compare and a pointer.
+    static const char * GetHeaderLine(size_t *length)
+    {
+        static __thread time_t cachedSecond = 0;
+        static __thread size_t cachedLength = 0;
+        static __thread char cachedLine[64];
+
+        time_t now = CoarseClock::Now();
+        if (now != cachedSecond)
+        {
+            char *p = cachedLine;
+            memcpy(p, "Date: ", 6);
+            p += 6;
+            p += Format(p, now);
+            memcpy(p, "\r\n", 2);
+            p += 2;
+            cachedLength = p - cachedLine;
+            cachedSecond = now;
+        }
+
+        *length = cachedLength;
+        return cachedLine;
+    }
+
+private:
+    static char * TwoDigits(char *p, int value)
+    {
+        *p++ = static_cast<char>('0' + value / 10);
+        *p++ = static_cast<char>('0' + value % 10);
+        return p;
+    }
+};
+
+#endif // HTTP_DATE_H
@@ -1,56 +1,636 @@
 #include "HttpDispatch.h"
 #include <boost/bind.hpp>
+#include <boost/atomic.hpp>
+#include <boost/enable_shared_from_this.hpp>
 #include <iostream>
+#include <strings.h>
+#include <string.h>
 
 #define RSP_OK "{\"code\": 0, \"message\": \"\"}\n"
 #define RSP_ERROR "{\"code\": 1, \"message\": \"Bad Method\"}\n"
 #define RSP_NOTFOUND "{\"code\": 1, \"message\": \"Not Found\"}\n"
 
+namespace
+{
+    HttpStaticResponsePtr MakeResponse(HttpResponser::StatusCode code,
+                                       const char *body)
+    {
+        HttpResponser resp(false);
+        resp.SetStatusCode(code);
+        resp.SetBody(body);
+        return HttpStaticResponsePtr(new HttpStaticResponse(resp));
+    }
+
+    // Set-Cookie, or Cache-Control private or no-store, mark a response
+    // as meant only for the client that asked
+    bool IsPrivate(const HttpResponser &resp)
+    {
+        if (*resp.GetHeader("Set-Cookie"))
+            return true;
+
+        const char *p = resp.GetHeader("Cache-Control");
+        while (*p)
+        {
+            while (*p == ' ' || *p == '\t' || *p == ',')
+                ++p;
+            size_t len = strcspn(p, ",");
+            if ((len >= 7 && strncasecmp(p, "private", 7) == 0) ||
+                (len >= 8 && strncasecmp(p, "no-store", 8) == 0))
+                return true;
+            p += len;
+        }
+        return false;
+    }
+
+    HttpAsyncResponsePtr LockResponse(
+        const boost::weak_ptr<HttpAsyncResponse> &async)
+    {
+        return async.lock();
+    }
+}
+
+// Stands in for the response of the request that runs the handler of a
+// single flight route, completing it answers the waiting ones as well
+class HttpFlight : public HttpAsyncResponse,
+                   public boost::enable_shared_from_this<HttpFlight>
+{
+public:
+    HttpFlight(HttpDispatch &dispatch, const std::string &key,
+               const HttpAsyncResponsePtr &leader)
+        : m_dispatch(dispatch),
+          m_key(key),
+          m_leader(leader),
+          m_completed(false)
+    { }
+
+    virtual ~HttpFlight();
+
+    virtual const HttpRequester & Requester() const;
+    virtual HttpResponser & Responser();
+    virtual void Complete();
+    virtual bool IsCancelled() const;
+    virtual void OnCancel(const CancelCallback &callback);
+
+    // Bound as the defer callback of the leader's responser, so the
+    // route's handler defers into the flight
+    static HttpAsyncResponsePtr Lock(const boost::weak_ptr<HttpFlight> &flight);
+
+private:
+    friend class HttpDispatch;
+
+    bool HasWaiters() const;
+    static void OnLeaderCancel(const boost::weak_ptr<HttpFlight> &flight,
+                               const CancelCallback &callback);
+
+    HttpDispatch &m_dispatch;
+    std::string m_key;
+    HttpAsyncResponsePtr m_leader;
+    boost::atomic<bool> m_completed;
+    // Guarded by the dispatch's flight mutex
+    std::vector<HttpAsyncResponsePtr> m_waiters;
+};
+
+HttpFlight::~HttpFlight()
+{
+    // Dropped without Complete, everybody gets the 500 of their own
+    // abandoned response
+    if (!m_completed)
+    {
+        std::vector<HttpAsyncResponsePtr> waiters;
+        m_dispatch.EndFlight(*this, waiters);
+    }
+}
+
+const HttpRequester & HttpFlight::Requester() const
+{
+    return m_leader->Requester();
+}
+
+HttpResponser & HttpFlight::Responser()
+{
+    return m_leader->Responser();
+}
+
+void HttpFlight::Complete()
+{
+    if (m_completed.exchange(true))
+        return;
+
+    std::vector<HttpAsyncResponsePtr> waiters;
+    m_dispatch.EndFlight(*this, waiters);
+
+    HttpResponser &resp = m_leader->Responser();
+    if (!waiters.empty() && !resp.IsStreaming())
+    {
+        // Somebody else's cookie or private page is not theirs to get,
+        // they run the route themselves instead
+        bool alone = IsPrivate(resp);
+        if (!alone)
+            resp.ShareBody();
+        for (size_t i = 0; i < waiters.size(); ++i)
+        {
+            if (alone)
+            {
+                m_dispatch.RunAlone(waiters[i]);
+                continue;
+            }
+            waiters[i]->Responser().CopyResponse(resp);
+            waiters[i]->Complete();
+        }
+    }
+    m_leader->Complete();
+}
+
+// The work is only abandoned if nobody else waits for it
+bool HttpFlight::IsCancelled() const
+{
+    return m_leader->IsCancelled() && !HasWaiters();
+}
+
+void HttpFlight::OnCancel(const CancelCallback &callback)
+{
+    m_leader->OnCancel(boost::bind(&HttpFlight::OnLeaderCancel,
+                                   boost::weak_ptr<HttpFlight>(
+                                       shared_from_this()), callback));
+}
+
+HttpAsyncResponsePtr HttpFlight::Lock(const boost::weak_ptr<HttpFlight> &flight)
+{
+    return flight.lock();
+}
+
+bool HttpFlight::HasWaiters() const
+{
+    boost::mutex::scoped_lock lock(m_dispatch.m_flightMutex);
+    return !m_waiters.empty();
+}
+
+void HttpFlight::OnLeaderCancel(const boost::weak_ptr<HttpFlight> &flight,
+                                const CancelCallback &callback)
+{
+    boost::shared_ptr<HttpFlight> self = flight.lock();
+    if (self && !self->HasWaiters() && callback)
+        callback();
+}
+
 HttpDispatch::HttpDispatch(unsigned short port,
                            boost::asio::io_service &service)
-    : m_server(port, service, boost::bind(
+    : m_ok(MakeResponse(HttpResponser::StatusCode_200Ok, RSP_OK)),
+      m_error(MakeResponse(HttpResponser::StatusCode_400BadRequest,
+                           RSP_ERROR)),
+      m_notFound(MakeResponse(HttpResponser::StatusCode_404NotFound,
+                              RSP_NOTFOUND)),
+      m_routeLimits(false),
+      m_cacheEnabled(false),
+      m_metricsEnabled(false),
+      m_server(port, service, boost::bind(
         &HttpDispatch::OnRequest, this,
         _1, _2))
-{ }
+{
+    m_server.SetLimitsCallback(boost::bind(
+        &HttpDispatch::OnLimits, this, _1, _2));
+}
 
-void HttpDispatch::Go()
+bool HttpDispatch::Go()
 {
+    if (m_accessLog)
+    {
+        std::vector<std::string> names(m_routes.size() + 1, "(none)");
+        for (RouteNames::const_iterator it = m_routeNames.begin();
+             it != m_routeNames.end(); ++it)
+            names[it->second + 1] = it->first;
+        m_accessLog->SetRouteNames(names);
+        if (!m_accessLog->Start())
+        {
+            std::cerr << "access log not started, not serving" << std::endl;
+            return false;
+        }
+    }
     m_server.Go();
+    return true;
+}
+
+bool HttpDispatch::AddHandler(const std::string &url,
+                              const HttpHandler &handler)
+{
+    return AddRoute(url, handler, 0);
+}
+
+bool HttpDispatch::AddHandler(const std::string &url,
+                              const HttpHandler &handler,
+                              const HttpLimits &limits)
+{
+    return AddRoute(url, handler, &limits);
+}
+
+bool HttpDispatch::AddRoute(const std::string &url,
+                            const HttpHandler &handler,
+                            const HttpLimits *limits)
+{
+    int method;
+    std::string pattern;
+    if (!HttpRouter::ParseRoute(url, &method, &pattern) ||
+        !m_router.Add(method, pattern, m_routes.size()))
+    {
+        std::cerr << "bad route: " << url << std::endl;
+        return false;
+    }
+
+    m_routeNames[url] = m_routes.size();
+    m_metrics.AddRoute(url);
+    m_routes.push_back(Route());
+    Route &route = m_routes.back();
+    route.handler = handler;
+    const HttpHandlerFunction *function =
+        handler.target<HttpHandlerFunction>();
+    if (function)
+        route.function = *function;
+    if (limits)
+    {
+        route.limits = *limits;
+        route.hasLimits = true;
+        m_routeLimits = true;
+    }
+    return true;
+}
+
+bool HttpDispatch::AddAsyncHandler(const std::string &url,
+                                   const HttpAsyncHandler &handler)
+{
+    return AddHandler(url, boost::bind(&HttpDispatch::RunAsync, handler, _1, _2));
+}
+
+bool HttpDispatch::AddAsyncHandler(const std::string &url,
+                                   const HttpAsyncHandler &handler,
+                                   const HttpLimits &limits)
+{
+    return AddHandler(url, boost::bind(&HttpDispatch::RunAsync, handler, _1, _2),
+               limits);
+}
+
+bool HttpDispatch::AddProxyHandler(const std::string &url, HttpProxy &proxy)
+{
+    return AddAsyncHandler(url, boost::bind(&HttpProxy::Forward, &proxy,
+                                            _1, _2));
+}
+
+bool HttpDispatch::AddProxyHandler(const std::string &url, HttpProxy &proxy,
+                                   const HttpLimits &limits)
+{
+    return AddAsyncHandler(url, boost::bind(&HttpProxy::Forward, &proxy,
+                                            _1, _2), limits);
+}
+
+bool HttpDispatch::AddStaticHandler(const std::string &url,
+                                    const HttpStaticResponsePtr &response)
+{
+    return AddHandler(url, boost::bind(&HttpDispatch::RunStatic, response,
+                                       _1, _2));
+}
+
+bool HttpDispatch::AddWorkerHandler(const std::string &url,
+                                    const HttpHandler &handler)
+{
+    GetWorkers();
+    return AddHandler(url, boost::bind(&HttpDispatch::RunOnWorker, this,
+                                handler, _1, _2));
+}
+
+bool HttpDispatch::AddWorkerHandler(const std::string &url,
+                                    const HttpHandler &handler,
+                                    const HttpLimits &limits)
+{
+    GetWorkers();
+    return AddHandler(url, boost::bind(&HttpDispatch::RunOnWorker, this,
+                                handler, _1, _2), limits);
+}
+
+bool HttpDispatch::SetSingleFlight(const std::string &url)
+{
+    RouteNames::const_iterator it = m_routeNames.find(url);
+    if (it == m_routeNames.end())
+        return false;
+
+    m_routes[it->second].singleFlight = true;
+    return true;
+}
+
+void HttpDispatch::EnableMetrics()
+{
+    m_metricsEnabled = true;
+    m_server.SetAccessCallback(boost::bind(&HttpDispatch::OnAccess, this, _1));
+}
+
+bool HttpDispatch::AddStatusHandler(const std::string &url)
+{
+    EnableMetrics();
+    return AddHandler(url, boost::bind(&HttpDispatch::OnStatus, this, _1, _2));
+}
+
+void HttpDispatch::GetMetrics(std::vector<HttpRouteMetrics> &routes) const
+{
+    m_metrics.GetSnapshot(routes);
+}
+
+void HttpDispatch::EnableAccessLog(const HttpAccessLogOptions &options)
+{
+    m_accessLog.reset(new HttpAccessLog(options));
+    m_server.SetAccessCallback(boost::bind(&HttpDispatch::OnAccess, this, _1));
+}
+
+const HttpAccessLog * HttpDispatch::GetAccessLog() const
+{
+    return m_accessLog.get();
+}
+
+void HttpDispatch::Freeze()
+{
+    m_router.Freeze();
 }
 
-void HttpDispatch::AddHandler(const std::string &url,
-                             const HttpHandler &handler)
+void HttpDispatch::SetWorkerThreads(size_t threads)
 {
-    m_handlers[url] = handler;
+    m_workers.reset(new HttpWorkerPool(threads));
+}
+
+HttpWorkerPool::Stats HttpDispatch::GetWorkerStats() const
+{
+    if (m_workers)
+        return m_workers->GetStats();
+
+    HttpWorkerPool::Stats stats = HttpWorkerPool::Stats();
+    return stats;
+}
+
+void HttpDispatch::SetLimits(const HttpLimits &limits)
+{
+    m_server.SetLimits(limits);
+}
+
+void HttpDispatch::SetCompression(const HttpCompression &compression)
+{
+    m_server.SetCompression(compression);
+}
+
+bool HttpDispatch::SetCache(const HttpCacheOptions &cache)
+{
+    if (cache.enabled && m_pipeline)
+        return false;
+
+    m_server.SetCache(cache);
+    m_cacheEnabled = cache.enabled;
+    return true;
+}
+
+void HttpDispatch::ClearCache()
+{
+    m_server.ClearCache();
 }
 
 void HttpDispatch::ResponseOk(HttpResponser &resp)
 {
-    resp.SetStatusCode(HttpResponser::StatusCode_200Ok);
-    resp.SetBody(RSP_OK);
+    resp.SetStaticResponse(m_ok);
 }
 
 void HttpDispatch::ResponseError(HttpResponser &resp)
 {
-    resp.SetStatusCode(HttpResponser::StatusCode_400BadRequest);
-    resp.SetBody(RSP_ERROR);
+    resp.SetStaticResponse(m_error);
     resp.SetCloseConnection(true);
 }
 
+bool HttpDispatch::SetPipeline(const HttpHandler &pipeline)
+{
+    if (pipeline && m_cacheEnabled)
+        return false;
+
+    m_pipeline = pipeline;
+    return true;
+}
+
+HttpDispatch::Endpoint HttpDispatch::GetEndpoint()
+{
+    return Endpoint(*this);
+}
+
 void HttpDispatch::OnRequest(const HttpRequester &req,
                              HttpResponser &resp)
 {
+    if (m_pipeline)
+    {
+        m_pipeline(req, resp);
+        return;
+    }
+
     std::cerr << req.ToString();
-    HanderMap::iterator it = m_handlers.find(req.GetUrl().c_str());
-    if (it == m_handlers.end())
+    RouteRequest(req, resp);
+}
+
+void HttpDispatch::RouteRequest(const HttpRequester &req,
+                                HttpResponser &resp)
+{
+    // OnLimits may have found the route already
+    size_t index = 0;
+    HttpRouter::Result result = HttpRouter::Result_Found;
+    if (req.GetRouteId() > 0)
+        index = req.GetRouteId() - 1;
+    else
+        result = FindRoute(req, &index);
+
+    if (result == HttpRouter::Result_Found)
+    {
+        const Route &route = m_routes[index];
+        if (route.singleFlight)
+            RunSingleFlight(route, req, resp);
+        else
+            RunRoute(route, req, resp);
+    }
+    else if (result == HttpRouter::Result_MethodNotAllowed)
     {
-        resp.SetStatusCode(HttpResponser::StatusCode_404NotFound);
-        resp.SetBody(RSP_NOTFOUND);
+        resp.SetStatusCode(HttpResponser::StatusCode_405MethodNotAllowed);
+        resp.AddHeader("Allow", m_router.GetAllowedMethods(req.GetPath()));
+        resp.SetBody(RSP_ERROR);
+    }
+    else
+    {
+        resp.SetStaticResponse(m_notFound);
         resp.SetCloseConnection(true);
     }
+}
+
+HttpRouter::Result HttpDispatch::FindRoute(const HttpRequester &req,
+                                           size_t *index)
+{
+    HttpPathParams params;
+    HttpRouter::Result result = m_router.Find(
+        req.GetHttpMethod(), req.GetPath(), index, params);
+    if (result == HttpRouter::Result_Found)
+    {
+        req.SetPathParams(params);
+        req.SetRouteId(static_cast<int>(*index) + 1);
+    }
+    return result;
+}
+
+void HttpDispatch::OnLimits(const HttpRequester &req, HttpLimits &limits)
+{
+    if (!m_routeLimits)
+        return;
+
+    size_t index;
+    if (FindRoute(req, &index) == HttpRouter::Result_Found &&
+        m_routes[index].hasLimits)
+        limits = m_routes[index].limits;
+}
+
+void HttpDispatch::RunStatic(const HttpStaticResponsePtr &response,
+                             const HttpRequester &req, HttpResponser &resp)
+{
+    resp.SetStaticResponse(response);
+}
+
+void HttpDispatch::RunAsync(const HttpAsyncHandler &handler,
+                            const HttpRequester &req, HttpResponser &resp)
+{
+    handler(req, resp.Defer());
+}
+
+// The request and response travel with the deferred response, the
+// connection keeps serving other requests meanwhile
+void HttpDispatch::RunOnWorker(const HttpHandler &handler,
+                               const HttpRequester &req, HttpResponser &resp)
+{
+    HttpAsyncResponsePtr async = resp.Defer();
+    if (!async)
+    {
+        handler(req, resp);
+        return;
+    }
+
+    m_workers->Submit(boost::bind(&HttpDispatch::RunWorkerTask,
+                                  handler, async));
+}
+
+void HttpDispatch::RunWorkerTask(const HttpHandler &handler,
+                                 const HttpAsyncResponsePtr &async)
+{
+    if (!async->IsCancelled())
+        handler(async->Requester(), async->Responser());
+    async->Complete();
+}
+
+void HttpDispatch::RunRoute(const Route &route, const HttpRequester &req,
+                            HttpResponser &resp)
+{
+    if (route.function)
+        route.function(req, resp);
     else
+        route.handler(req, resp);
+}
+
+// The first request for a url runs the route into an HttpFlight, those
+// coming in before it completes only wait on it
+void HttpDispatch::RunSingleFlight(const Route &route,
+                                   const HttpRequester &req,
+                                   HttpResponser &resp)
+{
+    // Credentials may make the answer one for this client only
+    HttpMethod method = req.GetHttpMethod();
+    if ((method != HTTP_GET && method != HTTP_HEAD) ||
+        *req.GetHeader("Authorization") || *req.GetHeader("Cookie"))
+    {
+        RunRoute(route, req, resp);
+        return;
+    }
+
+    std::string key = req.GetMethod();
+    key.push_back(' ');
+    key.append(req.GetUrl());
+
+    HttpAsyncResponsePtr async = resp.Defer();
+    if (!async)
     {
-        it->second(req, resp);
+        RunRoute(route, req, resp);
+        return;
     }
+
+    boost::shared_ptr<HttpFlight> flight;
+    {
+        boost::mutex::scoped_lock lock(m_flightMutex);
+        boost::weak_ptr<HttpFlight> &running = m_flights[key];
+        flight = running.lock();
+        if (flight)
+        {
+            flight->m_waiters.push_back(async);
+            return;
+        }
+
+        flight.reset(new HttpFlight(*this, key, async));
+        running = flight;
+    }
+
+    HttpResponser &leader = async->Responser();
+    leader.SetDeferCallback(boost::bind(&HttpFlight::Lock,
+                                        boost::weak_ptr<HttpFlight>(flight)));
+    RunRoute(route, async->Requester(), leader);
+    if (!leader.IsDeferred())
+        flight->Complete();
+}
+
+// For a waiter of a flight whose response is private, runs the route
+// the request was routed to into its own response
+void HttpDispatch::RunAlone(const HttpAsyncResponsePtr &async)
+{
+    const HttpRequester &req = async->Requester();
+    HttpResponser &resp = async->Responser();
+    resp.SetDeferCallback(boost::bind(
+        &LockResponse, boost::weak_ptr<HttpAsyncResponse>(async)));
+    RunRoute(m_routes[req.GetRouteId() - 1], req, resp);
+    if (!resp.IsDeferred())
+        async->Complete();
+}
+
+void HttpDispatch::EndFlight(HttpFlight &flight,
+                             std::vector<HttpAsyncResponsePtr> &waiters)
+{
+    boost::mutex::scoped_lock lock(m_flightMutex);
+    Flights::iterator it = m_flights.find(flight.m_key);
+    if (it != m_flights.end() &&
+        (it->second.expired() || it->second.lock().get() == &flight))
+        m_flights.erase(it);
+    waiters.swap(flight.m_waiters);
+}
+
+void HttpDispatch::OnAccess(const HttpAccess &access)
+{
+    if (m_metricsEnabled)
+        m_metrics.Record(access.route, access.status, access.requestBytes,
+                         access.responseBytes, access.latencyUs);
+    if (m_accessLog)
+        m_accessLog->Write(access);
 }
 
+void HttpDispatch::OnStatus(const HttpRequester &req, HttpResponser &resp)
+{
+    std::vector<HttpRouteMetrics> routes;
+    m_metrics.GetSnapshot(routes);
+
+    resp.SetStatusCode(HttpResponser::StatusCode_200Ok);
+    resp.AddHeader("Cache-Control", "no-store");
+    if (req.GetQuery("format") == "text")
+    {
+        resp.SetContentType("text/plain");
+        resp.SetBody(HttpMetrics::ToText(routes));
+    }
+    else
+    {
+        resp.SetContentType("application/json");
+        resp.SetBody(HttpMetrics::ToJson(routes));
+    }
+}
+
+HttpWorkerPool & HttpDispatch::GetWorkers()
+{
+    if (!m_workers)
+        m_workers.reset(new HttpWorkerPool(0));
+    return *m_workers;
+}
@@ -2,32 +2,205 @@
 #define HTTP_DISPATCH_H
 
 #include "HttpServer.h"
+#include "HttpWorkerPool.h"
+#include "HttpRouter.h"
+#include "HttpMiddleware.h"
+#include "HttpMetrics.h"
+#include "HttpAccessLog.h"
+#include "HttpProxy.h"
 #include <boost/function.hpp>
-#include <string>
+#include <boost/scoped_ptr.hpp>
+#include <boost/weak_ptr.hpp>
+#include <boost/thread/mutex.hpp>
 #include <map>
+#include <string>
+#include <vector>
+
+class HttpFlight;
 
 class HttpDispatch : private boost::noncopyable
 {
 public:
     typedef boost::function< void(const HttpRequester &,
                              HttpResponser &) > HttpHandler;
+    typedef void (*HttpHandlerFunction)(const HttpRequester &,
+                                        HttpResponser &);
+
+    // Answers later through the response, which also keeps the request
+    typedef boost::function< void(const HttpRequester &,
+                             const HttpAsyncResponsePtr &) > HttpAsyncHandler;
+
+    // Last stage of a pipeline, routes to the handlers added here
+    class Endpoint
+    {
+    public:
+        explicit Endpoint(HttpDispatch &dispatch)
+            : m_dispatch(&dispatch)
+        { }
+
+        void operator()(const HttpRequester &req, HttpResponser &resp) const
+        {
+            m_dispatch->RouteRequest(req, resp);
+        }
+
+    private:
+        HttpDispatch *m_dispatch;
+    };
 
     HttpDispatch(unsigned short port,
                  boost::asio::io_service &service);
 
-    void Go();
-    void AddHandler(const std::string &url, const HttpHandler &handler);
+    // Starts serving, false without doing so if the access log could not
+    // be started
+    bool Go();
+
+    // url is a router pattern such as "/users/:id" or "/static/*path",
+    // optionally led by a method: "POST /users". Without one the route
+    // takes every method. False if the pattern is malformed.
+    bool AddHandler(const std::string &url, const HttpHandler &handler);
+    bool AddHandler(const std::string &url, const HttpHandler &handler,
+                    const HttpLimits &limits);
+    bool AddAsyncHandler(const std::string &url,
+                         const HttpAsyncHandler &handler);
+    bool AddAsyncHandler(const std::string &url,
+                         const HttpAsyncHandler &handler,
+                         const HttpLimits &limits);
+
+    // The handler runs on the worker pool, for CPU heavy routes that
+    // would stall every other connection on the io_service
+    bool AddWorkerHandler(const std::string &url, const HttpHandler &handler);
+    bool AddWorkerHandler(const std::string &url, const HttpHandler &handler,
+                          const HttpLimits &limits);
+
+    // Forwards what the route matches to the upstreams of proxy, url as
+    // for Add*Handler. Request bodies are read whole first, give the
+    // route larger limits for big uploads.
+    bool AddProxyHandler(const std::string &url, HttpProxy &proxy);
+    bool AddProxyHandler(const std::string &url, HttpProxy &proxy,
+                         const HttpLimits &limits);
+
+    // Answers what the route matches with response, url as for
+    // Add*Handler
+    bool AddStaticHandler(const std::string &url,
+                          const HttpStaticResponsePtr &response);
+
+    // Identical GETs (same url) that come in while one is being answered
+    // wait for it and get the same response, so an expensive handler
+    // runs once however many clients ask. url is as given to Add*Handler,
+    // false if no route was added with it. A streamed response cannot be
+    // shared, the requests waiting for it are answered with 500.
+    // Requests with Authorization or Cookie never wait on another. A
+    // response with Set-Cookie or Cache-Control private or no-store is
+    // not shared, every waiter runs the handler for itself.
+    bool SetSingleFlight(const std::string &url);
+
+    // Every request goes through pipeline, usually an HttpPipeline ending
+    // in GetEndpoint(), instead of being logged and routed. Cached
+    // responses are answered before any handler runs, so they would skip
+    // the stages: false while the cache is enabled.
+    bool SetPipeline(const HttpHandler &pipeline);
+    Endpoint GetEndpoint();
+    void RouteRequest(const HttpRequester &req, HttpResponser &resp);
+
+    // Counts, bytes and latency histograms per route, off until enabled.
+    // The status handler serves them as JSON, or text with ?format=text.
+    void EnableMetrics();
+    bool AddStatusHandler(const std::string &url);
+    void GetMetrics(std::vector<HttpRouteMetrics> &routes) const;
+
+    // Every response as a binary record, written from Go on with the
+    // route names in each file. Decode with http_access_log_decode.
+    void EnableAccessLog(const HttpAccessLogOptions &options);
+    const HttpAccessLog * GetAccessLog() const;
+
+    // For a route set fixed at startup: no more handlers can be added,
+    // exact paths are then found through a perfect hash
+    void Freeze();
+
+    // Before the first worker handler, 0 threads picks one per core
+    void SetWorkerThreads(size_t threads);
+    HttpWorkerPool::Stats GetWorkerStats() const;
+
+    void SetLimits(const HttpLimits &limits);
+    void SetCompression(const HttpCompression &compression);
+
+    // GET responses a handler marks with Cache-Control: max-age (or all
+    // of them with a default ttl) are answered without calling it again.
+    // False when enabling it while a pipeline is set, see SetPipeline.
+    bool SetCache(const HttpCacheOptions &cache);
+    void ClearCache();
+    // Rendered once, every call only refers to them
     void ResponseOk(HttpResponser &resp);
     void ResponseError(HttpResponser &resp);
 
 private:
-    typedef std::map<std::string, HttpHandler> HanderMap;
+    struct Route
+    {
+        Route()
+            : function(0),
+              hasLimits(false),
+              singleFlight(false)
+        { }
+
+        HttpHandler handler;
+        // Called directly when the handler is a plain function
+        HttpHandlerFunction function;
+        HttpLimits limits;
+        bool hasLimits;
+        bool singleFlight;
+    };
 
+    typedef std::vector<Route> Routes;
+    typedef std::map<std::string, size_t> RouteNames;
+    typedef std::map<std::string, boost::weak_ptr<HttpFlight> > Flights;
+
+    friend class HttpFlight;
+
+    bool AddRoute(const std::string &url, const HttpHandler &handler,
+                  const HttpLimits *limits);
     void OnRequest(const HttpRequester &req,
                    HttpResponser &resp);
+    // Sets the path params and route id of req when a route is found
+    HttpRouter::Result FindRoute(const HttpRequester &req, size_t *index);
+    void OnLimits(const HttpRequester &req, HttpLimits &limits);
+    static void RunStatic(const HttpStaticResponsePtr &response,
+                          const HttpRequester &req, HttpResponser &resp);
+    static void RunAsync(const HttpAsyncHandler &handler,
+                         const HttpRequester &req, HttpResponser &resp);
+    void RunOnWorker(const HttpHandler &handler,
+                     const HttpRequester &req, HttpResponser &resp);
+    static void RunWorkerTask(const HttpHandler &handler,
+                              const HttpAsyncResponsePtr &async);
+    HttpWorkerPool & GetWorkers();
+    static void RunRoute(const Route &route, const HttpRequester &req,
+                         HttpResponser &resp);
+    void RunSingleFlight(const Route &route, const HttpRequester &req,
+                         HttpResponser &resp);
+    void RunAlone(const HttpAsyncResponsePtr &async);
+    void EndFlight(HttpFlight &flight,
+                   std::vector<HttpAsyncResponsePtr> &waiters);
+    void OnAccess(const HttpAccess &access);
+    void OnStatus(const HttpRequester &req, HttpResponser &resp);
 
-    HanderMap m_handlers;
+    HttpStaticResponsePtr m_ok;
+    HttpStaticResponsePtr m_error;
+    HttpStaticResponsePtr m_notFound;
+    Routes m_routes;
+    RouteNames m_routeNames;
+    // Some route has limits of its own, looked up once the headers are in
+    bool m_routeLimits;
+    HttpHandler m_pipeline;
+    bool m_cacheEnabled;
+    HttpMetrics m_metrics;
+    bool m_metricsEnabled;
+    boost::scoped_ptr<HttpAccessLog> m_accessLog;
+    HttpRouter m_router;
     HttpServer m_server;
+    boost::scoped_ptr<HttpWorkerPool> m_workers;
+
+    // Requests being answered for single flight routes, by method and url
+    boost::mutex m_flightMutex;
+    Flights m_flights;
 };
 
 #endif // HTTP_DISPATCH_H
@@ -0,0 +1,68 @@
+#ifndef HTTP_FORMAT_H
+#define HTTP_FORMAT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// Integer formatting for the response path without snprintf.
+// Both write into buf (at least 20 bytes) and return the length.
+
+inline size_t FormatDecimal(char *buf, uint64_t value)
+{
+    static const char kDigits[] =
+        "00010203040506070809"
+        "10111213141516171819"
+        "20212223242526272829"
+        "30313233343536373839"
+        "40414243444546474849"
+        "50515253545556575859"
+        "60616263646566676869"
+        "70717273747576777879"
+        "80818283848586878889"
+        "90919293949596979899";
+
+    char tmp[20];
+    char *p = tmp + sizeof tmp;
+    while (value >= 100)
+    {
+        const char *pair = kDigits + (value % 100) * 2;
+        value /= 100;
+        *--p = pair[1];
+        *--p = pair[0];
+    }
+
+    if (value >= 10)
+    {
+        const char *pair = kDigits + value * 2;
+        *--p = pair[1];
+        *--p = pair[0];
+    }
+    else
+    {
+        *--p = static_cast<char>('0' + value);
+    }
+
+    size_t length = tmp + sizeof tmp - p;
+    memcpy(buf, p, length);
+    return length;
+}
+
+inline size_t FormatHex(char *buf, uint64_t value)
+{
+    static const char kHex[] = "0123456789abcdef";
+
+    char tmp[16];
+    char *p = tmp + sizeof tmp;
+    do
+    {
+        *--p = kHex[value & 0xf];
+        value >>= 4;
+    } while (value);
+
+    size_t length = tmp + sizeof tmp - p;
+    memcpy(buf, p, length);
+    return length;
+}
+
+#endif // HTTP_FORMAT_H
@@ -0,0 +1,115 @@
+#ifndef HTTP_HEADER_MAP_H
+#define HTTP_HEADER_MAP_H
+
+#include <strings.h>
+#include <string>
+#include <vector>
+#include <utility>
+
+// Flat header list for the per-connection request and response objects.
+// clear() only forgets the entries, their strings keep the capacity
+// for the next message, so steady keep-alive traffic does not allocate.
+// Names are matched ignoring case, as HTTP wants, and kept as first set.
+class HttpHeaderMap
+{
+public:
+    typedef std::pair<std::string, std::string> value_type;
+    typedef std::vector<value_type>::const_iterator const_iterator;
+
+    HttpHeaderMap()
+        : m_size(0)
+    { }
+
+    const_iterator begin() const
+    {
+        return m_entries.begin();
+    }
+
+    const_iterator end() const
+    {
+        return m_entries.begin() + m_size;
+    }
+
+    size_t size() const
+    {
+        return m_size;
+    }
+
+    bool empty() const
+    {
+        return m_size == 0;
+    }
+
+    const_iterator find(const std::string &name) const
+    {
+        const_iterator it = begin();
+        for (; it != end(); ++it)
+        {
+            if (NameEquals(it->first, name.data(), name.size()))
+                break;
+        }
+        return it;
+    }
+
+    std::string & operator[](const std::string &name)
+    {
+        return Slot(name.data(), name.size());
+    }
+
+    void Set(const std::string &name, const std::string &value)
+    {
+        Slot(name.data(), name.size()) = value;
+    }
+
+    void clear()
+    {
+        m_size = 0;
+    }
+
+    // Releases cleared entries whose storage grew above threshold
+    void Shrink(size_t threshold)
+    {
+        for (size_t i = m_size; i < m_entries.size(); ++i)
+        {
+            ShrinkString(m_entries[i].first, threshold);
+            ShrinkString(m_entries[i].second, threshold);
+        }
+    }
+
+    // Only for strings whose content is no longer needed
+    static void ShrinkString(std::string &s, size_t threshold)
+    {
+        if (s.capacity() > threshold)
+            std::string().swap(s);
+    }
+
+    static bool NameEquals(const std::string &name, const char *other,
+                           size_t length)
+    {
+        return name.size() == length &&
+            strncasecmp(name.data(), other, length) == 0;
+    }
+
+private:
+    std::string & Slot(const char *name, size_t length)
+    {
+        for (size_t i = 0; i < m_size; ++i)
+        {
+            if (NameEquals(m_entries[i].first, name, length))
+                return m_entries[i].second;
+        }
+
+        if (m_size == m_entries.size())
+            m_entries.push_back(value_type());
+
+        value_type &entry = m_entries[m_size++];
+        entry.first.assign(name, length);
+        entry.second.clear();
+        return entry.second;
+    }
+
+    std::vector<value_type> m_entries;
+    size_t m_size;
+};
+
+#endif // HTTP_HEADER_MAP_H
@@ -0,0 +1,749 @@
+// Load generator on the library's parser:
+//   http_load [-t threads] [-c connections] [-d seconds] [-w seconds]
+//             [-r rate] [-p depth] [-k | -C] [-m method] [-H header]...
+//             [-b body] [-o file] url
+// Without -r it runs closed loop: every connection keeps -p requests in
+// flight and sends the next one as soon as an answer comes back. With
+// -r requests are due at a constant total rate whatever the server does,
+// and a latency is taken from when its request was due rather than when
+// it went out, so a stall is charged to every request it held up. The
+// closed loop results get the same correction after the fact.
+// Connections are kept alive, -k asks for that as with ab, and -C closes
+// the connection after every request instead. Results are printed as
+// JSON.
+
+#include "HttpParser.h"
+#include "../CoarseClock.h"
+#include "../HdrHistogram.h"
+#include <boost/asio.hpp>
+#include <boost/asio/spawn.hpp>
+#include <boost/bind.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/thread.hpp>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <deque>
+#include <string>
+#include <vector>
+
+namespace
+{
+    struct LoadConfig
+    {
+        LoadConfig()
+            : threads(1),
+              connections(10),
+              duration(10),
+              warmup(0),
+              rate(0),
+              depth(1),
+              keepAlive(true),
+              method("GET")
+        { }
+
+        size_t threads;
+        size_t connections;
+        double duration;
+        double warmup;
+        // Requests per second over all connections, 0 for closed loop
+        double rate;
+        size_t depth;
+        bool keepAlive;
+        std::string method;
+        std::vector<std::string> headers;
+        std::string body;
+        std::string output;
+        std::string url;
+
+        // Filled in by main
+        std::string request;
+        boost::asio::ip::tcp::endpoint endpoint;
+        uint64_t startUs;
+        uint64_t measureUs;
+        uint64_t endUs;
+    };
+
+    struct LoadStats
+    {
+        LoadStats()
+            : requests(0),
+              errors(0),
+              connects(0),
+              outstanding(0),
+              bytes(0)
+        {
+            memset(status, 0, sizeof(status));
+        }
+
+        void Add(const LoadStats &other)
+        {
+            latency.Add(other.latency);
+            requests += other.requests;
+            errors += other.errors;
+            connects += other.connects;
+            outstanding += other.outstanding;
+            bytes += other.bytes;
+            for (size_t i = 0; i < sizeof(status) / sizeof(status[0]); ++i)
+                status[i] += other.status[i];
+        }
+
+        HdrHistogram latency;
+        // Answered after the warmup
+        uint64_t requests;
+        // Requests lost to a failed connection, and failed connects
+        uint64_t errors;
+        uint64_t connects;
+        // Sent, or due in open loop, but not answered when the run ended
+        uint64_t outstanding;
+        uint64_t bytes;
+        // By class, [0] for anything outside 1xx..5xx
+        uint64_t status[6];
+    };
+
+    class LoadWorker;
+
+    // One connection with a coroutine sending and one reading, the
+    // reader matches answers to the times kept by the sender
+    class LoadConnection
+        : public boost::enable_shared_from_this<LoadConnection>,
+          private boost::noncopyable
+    {
+    public:
+        LoadConnection(LoadWorker &worker, size_t index);
+
+        void Start();
+        void Stop();
+        // Sent or due by now, but not answered
+        uint64_t GetOutstanding(uint64_t now) const
+        {
+            uint64_t outstanding = m_sent.size();
+            if (m_interval > 0 && m_next <= now)
+                outstanding += static_cast<uint64_t>(
+                    (now - m_next) / m_interval) + 1;
+            return outstanding;
+        }
+
+    private:
+        void Send(boost::asio::yield_context yield);
+        void Receive(unsigned int generation,
+                     boost::asio::yield_context yield);
+        bool Connect(boost::asio::yield_context yield);
+        void Disconnect(bool failed);
+        bool OnResponse();
+        bool OnBody(const char *data, size_t len);
+
+        void Wait(boost::asio::yield_context yield);
+        void Signal();
+
+        LoadWorker &m_worker;
+        const LoadConfig &m_config;
+        LoadStats &m_stats;
+        size_t m_index;
+        boost::asio::ip::tcp::socket m_socket;
+        boost::asio::deadline_timer m_timer;
+        boost::asio::deadline_timer m_event;
+        HttpParser m_parser;
+        std::vector<char> m_readBuffer;
+        // When each request in flight was due, oldest first
+        std::deque<uint64_t> m_sent;
+        // Open loop schedule in microseconds, the interval is 0 without
+        double m_interval;
+        double m_next;
+        unsigned int m_generation;
+        bool m_connected;
+        bool m_stopped;
+    };
+
+    typedef boost::shared_ptr<LoadConnection> LoadConnectionPtr;
+
+    // One thread with its own io_service and statistics
+    class LoadWorker : private boost::noncopyable
+    {
+    public:
+        explicit LoadWorker(const LoadConfig &config)
+            : m_config(config),
+              m_timer(m_service)
+        { }
+
+        void AddConnection(size_t index)
+        {
+            m_connections.push_back(
+                LoadConnectionPtr(new LoadConnection(*this, index)));
+        }
+
+        void Run()
+        {
+            for (size_t i = 0; i < m_connections.size(); ++i)
+                m_connections[i]->Start();
+
+            uint64_t now = CoarseClock::NowUs();
+            uint64_t left = m_config.endUs > now ? m_config.endUs - now : 0;
+            m_timer.expires_from_now(boost::posix_time::microseconds(left));
+            m_timer.async_wait(boost::bind(&LoadWorker::OnEnd, this, _1));
+            m_service.run();
+        }
+
+        boost::asio::io_service & GetService()
+        {
+            return m_service;
+        }
+
+        const LoadConfig & GetConfig() const
+        {
+            return m_config;
+        }
+
+        LoadStats & GetStats()
+        {
+            return m_stats;
+        }
+
+    private:
+        void OnEnd(const boost::system::error_code &error)
+        {
+            uint64_t now = CoarseClock::NowUs();
+            for (size_t i = 0; i < m_connections.size(); ++i)
+            {
+                m_stats.outstanding += m_connections[i]->GetOutstanding(now);
+                m_connections[i]->Stop();
+            }
+        }
+
+        const LoadConfig &m_config;
+        boost::asio::io_service m_service;
+        boost::asio::deadline_timer m_timer;
+        std::vector<LoadConnectionPtr> m_connections;
+        LoadStats m_stats;
+    };
+
+    LoadConnection::LoadConnection(LoadWorker &worker, size_t index)
+        : m_worker(worker),
+          m_config(worker.GetConfig()),
+          m_stats(worker.GetStats()),
+          m_index(index),
+          m_socket(worker.GetService()),
+          m_timer(worker.GetService()),
+          m_event(worker.GetService()),
+          m_readBuffer(64 * 1024),
+          m_interval(0),
+          m_next(0),
+          m_generation(0),
+          m_connected(false),
+          m_stopped(false)
+    {
+        HttpLimits limits;
+        limits.maxUrlLength = 0;
+        limits.maxBodySize = 0;
+        m_parser.SetLimits(limits);
+        m_parser.SetBodyCallback(
+            boost::bind(&LoadConnection::OnBody, this, _1, _2));
+    }
+
+    void LoadConnection::Start()
+    {
+        boost::asio::spawn(m_worker.GetService(), boost::bind(
+            &LoadConnection::Send, shared_from_this(), _1));
+    }
+
+    void LoadConnection::Stop()
+    {
+        m_stopped = true;
+        boost::system::error_code ignored;
+        m_socket.close(ignored);
+        m_timer.cancel();
+        m_event.cancel();
+    }
+
+    void LoadConnection::Send(boost::asio::yield_context yield)
+    {
+        // Open loop: connection i of n sends at start + (i + k * n) / rate,
+        // so together they are evenly spread
+        m_next = m_config.startUs;
+        if (m_config.rate > 0)
+        {
+            m_interval = 1e6 * m_config.connections / m_config.rate;
+            m_next += m_index * 1e6 / m_config.rate;
+        }
+
+        boost::system::error_code error;
+        while (!m_stopped)
+        {
+            if (!m_connected && !Connect(yield))
+            {
+                if (m_stopped)
+                    break;
+                m_timer.expires_from_now(boost::posix_time::milliseconds(100));
+                m_timer.async_wait(yield[error]);
+                continue;
+            }
+
+            uint64_t now = CoarseClock::NowUs();
+            if (m_interval > 0 && m_next > now)
+            {
+                m_timer.expires_from_now(boost::posix_time::microseconds(
+                    static_cast<uint64_t>(m_next) - now));
+                m_timer.async_wait(yield[error]);
+                continue;
+            }
+
+            if (m_sent.size() >= m_config.depth)
+            {
+                Wait(yield);
+                continue;
+            }
+
+            // Closed loop requests are due when they can be sent
+            m_sent.push_back(m_interval > 0 ?
+                             static_cast<uint64_t>(m_next) : now);
+            if (m_interval > 0)
+                m_next += m_interval;
+
+            boost::asio::async_write(
+                m_socket, boost::asio::buffer(m_config.request), yield[error]);
+            if (error)
+                Disconnect(true);
+        }
+    }
+
+    void LoadConnection::Receive(unsigned int generation,
+                                 boost::asio::yield_context yield)
+    {
+        boost::system::error_code error;
+        while (generation == m_generation)
+        {
+            size_t len = m_socket.async_read_some(
+                boost::asio::buffer(m_readBuffer), yield[error]);
+            if (generation != m_generation)
+                return;
+
+            if (CoarseClock::NowUs() >= m_config.measureUs)
+                m_stats.bytes += len;
+
+            if (error)
+            {
+                // A response without length ends here
+                if (error == boost::asio::error::eof &&
+                    m_parser.IsHeaderComplete() && m_parser.Parse(0, 0) &&
+                    m_parser.IsComplete())
+                    OnResponse();
+                Disconnect(!m_sent.empty());
+                return;
+            }
+
+            const char *data = &m_readBuffer[0];
+            while (len > 0)
+            {
+                size_t parsed = 0;
+                if (!m_parser.Parse(data, len, &parsed))
+                {
+                    Disconnect(true);
+                    return;
+                }
+                data += parsed;
+                len -= parsed;
+
+                if (!m_parser.IsComplete())
+                    break;
+                if (!OnResponse())
+                    return;
+            }
+        }
+    }
+
+    bool LoadConnection::Connect(boost::asio::yield_context yield)
+    {
+        boost::system::error_code error;
+        m_socket.async_connect(m_config.endpoint, yield[error]);
+        if (m_stopped)
+            return false;
+        if (error)
+        {
+            ++m_stats.errors;
+            m_socket.close(error);
+            return false;
+        }
+
+        m_socket.set_option(boost::asio::ip::tcp::no_delay(true), error);
+        ++m_stats.connects;
+        m_connected = true;
+        m_parser.Reset();
+        m_parser.SetSkipBody(m_config.method == "HEAD");
+        boost::asio::spawn(m_worker.GetService(), boost::bind(
+            &LoadConnection::Receive, shared_from_this(), m_generation, _1));
+        return true;
+    }
+
+    void LoadConnection::Disconnect(bool failed)
+    {
+        if (!m_connected)
+            return;
+
+        // The reader of this socket quits on the new generation
+        ++m_generation;
+        m_connected = false;
+        boost::system::error_code ignored;
+        m_socket.close(ignored);
+
+        if (failed && !m_stopped)
+            m_stats.errors += m_sent.empty() ? 1 : m_sent.size();
+        m_sent.clear();
+        Signal();
+    }
+
+    // False when the connection was closed
+    bool LoadConnection::OnResponse()
+    {
+        uint64_t now = CoarseClock::NowUs();
+        if (!m_sent.empty())
+        {
+            uint64_t due = m_sent.front();
+            m_sent.pop_front();
+            if (due >= m_config.measureUs)
+            {
+                m_stats.latency.Record(now > due ? now - due : 0);
+                ++m_stats.requests;
+                int status = m_parser.GetStatusCode() / 100;
+                ++m_stats.status[status >= 1 && status <= 5 ? status : 0];
+            }
+        }
+
+        bool keepAlive = m_config.keepAlive && m_parser.ShouldKeepAlive();
+        m_parser.Reset();
+        m_parser.SetSkipBody(m_config.method == "HEAD");
+        Signal();
+
+        if (!keepAlive)
+        {
+            Disconnect(!m_sent.empty());
+            return false;
+        }
+        return true;
+    }
+
+    bool LoadConnection::OnBody(const char *data, size_t len)
+    {
+        return true;
+    }
+
+    void LoadConnection::Wait(boost::asio::yield_context yield)
+    {
+        boost::system::error_code error;
+        m_event.expires_from_now(boost::posix_time::seconds(1));
+        m_event.async_wait(yield[error]);
+    }
+
+    void LoadConnection::Signal()
+    {
+        m_event.cancel();
+    }
+
+    bool ParseUrl(LoadConfig &config, std::string &host, std::string &port)
+    {
+        const std::string &url = config.url;
+        struct http_parser_url parts;
+        http_parser_url_init(&parts);
+        if (http_parser_parse_url(url.data(), url.size(), 0, &parts) ||
+            !(parts.field_set & (1 << UF_SCHEMA)) ||
+            !(parts.field_set & (1 << UF_HOST)) ||
+            parts.field_data[UF_SCHEMA].len != 4 ||
+            strncasecmp(url.data() + parts.field_data[UF_SCHEMA].off,
+                        "http", 4))
+            return false;
+
+        host = url.substr(parts.field_data[UF_HOST].off,
+                          parts.field_data[UF_HOST].len);
+        port = "80";
+        if (parts.field_set & (1 << UF_PORT))
+            port = url.substr(parts.field_data[UF_PORT].off,
+                              parts.field_data[UF_PORT].len);
+
+        size_t begin = url.size();
+        if (parts.field_set & (1 << UF_PATH))
+            begin = parts.field_data[UF_PATH].off;
+        else if (parts.field_set & (1 << UF_QUERY))
+            begin = parts.field_data[UF_QUERY].off - 1;
+        size_t end = url.size();
+        if (parts.field_set & (1 << UF_FRAGMENT))
+            end = parts.field_data[UF_FRAGMENT].off - 1;
+
+        std::string &request = config.request;
+        request = config.method + " ";
+        if (begin < end && url[begin] != '/')
+            request.append("/");
+        request.append(url, begin, end - begin);
+        if (begin >= end)
+            request.append("/");
+        request.append(" HTTP/1.1\r\nHost: ");
+        request.append(host);
+        if (port != "80")
+            request.append(":").append(port);
+        request.append("\r\n");
+        for (size_t i = 0; i < config.headers.size(); ++i)
+            request.append(config.headers[i]).append("\r\n");
+        if (!config.keepAlive)
+            request.append("Connection: close\r\n");
+        if (!config.body.empty() || config.method == "POST" ||
+            config.method == "PUT")
+        {
+            char length[32];
+            snprintf(length, sizeof(length), "Content-Length: %zu\r\n",
+                     config.body.size());
+            request.append(length);
+        }
+        request.append("\r\n");
+        request.append(config.body);
+        return true;
+    }
+
+    void PrintLatency(FILE *file, const char *name, const HdrHistogram &h)
+    {
+        static const double kQuantiles[] =
+            { 0.5, 0.75, 0.9, 0.99, 0.999, 0.9999 };
+        static const char *kNames[] =
+            { "p50", "p75", "p90", "p99", "p999", "p9999" };
+
+        fprintf(file, "  \"%s\": {\"count\": %llu, \"min\": %llu, "
+                "\"mean\": %.1f", name,
+                static_cast<unsigned long long>(h.GetCount()),
+                static_cast<unsigned long long>(h.GetMin()), h.GetMean());
+        for (size_t i = 0; i < sizeof(kQuantiles) / sizeof(kQuantiles[0]); ++i)
+            fprintf(file, ", \"%s\": %llu", kNames[i],
+                    static_cast<unsigned long long>(
+                        h.GetPercentile(kQuantiles[i])));
+        fprintf(file, ", \"max\": %llu},\n",
+                static_cast<unsigned long long>(h.GetMax()));
+    }
+
+    std::string Quote(const std::string &text)
+    {
+        std::string quoted("\"");
+        for (size_t i = 0; i < text.size(); ++i)
+        {
+            unsigned char c = text[i];
+            if (c == '"' || c == '\\')
+            {
+                quoted.push_back('\\');
+                quoted.push_back(c);
+            }
+            else if (c < 0x20)
+            {
+                char escaped[8];
+                snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+                quoted.append(escaped);
+            }
+            else
+            {
+                quoted.push_back(c);
+            }
+        }
+        quoted.push_back('"');
+        return quoted;
+    }
+
+    void PrintResults(FILE *file, const LoadConfig &config,
+                      const LoadStats &stats)
+    {
+        double seconds = config.duration - config.warmup;
+
+        fprintf(file, "{\n");
+        fprintf(file, "  \"url\": %s,\n", Quote(config.url).c_str());
+        fprintf(file, "  \"method\": %s,\n", Quote(config.method).c_str());
+        fprintf(file, "  \"mode\": \"%s\",\n",
+                config.rate > 0 ? "open" : "closed");
+        fprintf(file, "  \"rate\": %.1f,\n", config.rate);
+        fprintf(file, "  \"threads\": %zu,\n", config.threads);
+        fprintf(file, "  \"connections\": %zu,\n", config.connections);
+        fprintf(file, "  \"depth\": %zu,\n", config.depth);
+        fprintf(file, "  \"keepAlive\": %s,\n",
+                config.keepAlive ? "true" : "false");
+        fprintf(file, "  \"durationSec\": %.3f,\n", config.duration);
+        fprintf(file, "  \"warmupSec\": %.3f,\n", config.warmup);
+        fprintf(file, "  \"requests\": %llu,\n",
+                static_cast<unsigned long long>(stats.requests));
+        fprintf(file, "  \"errors\": %llu,\n",
+                static_cast<unsigned long long>(stats.errors));
+        fprintf(file, "  \"connects\": %llu,\n",
+                static_cast<unsigned long long>(stats.connects));
+        fprintf(file, "  \"outstanding\": %llu,\n",
+                static_cast<unsigned long long>(stats.outstanding));
+        fprintf(file, "  \"status\": {\"1xx\": %llu, \"2xx\": %llu, "
+                "\"3xx\": %llu, \"4xx\": %llu, \"5xx\": %llu, "
+                "\"other\": %llu},\n",
+                static_cast<unsigned long long>(stats.status[1]),
+                static_cast<unsigned long long>(stats.status[2]),
+                static_cast<unsigned long long>(stats.status[3]),
+                static_cast<unsigned long long>(stats.status[4]),
+                static_cast<unsigned long long>(stats.status[5]),
+                static_cast<unsigned long long>(stats.status[0]));
+        fprintf(file, "  \"bytes\": %llu,\n",
+                static_cast<unsigned long long>(stats.bytes));
+        fprintf(file, "  \"requestsPerSec\": %.1f,\n",
+                seconds > 0 ? stats.requests / seconds : 0);
+        fprintf(file, "  \"bytesPerSec\": %.1f,\n",
+                seconds > 0 ? stats.bytes / seconds : 0);
+
+        PrintLatency(file, "latencyUs", stats.latency);
+
+        // Closed loop: each connection waited for its answers, so a slow
+        // one hid the requests an open client would have sent meanwhile.
+        // They are added back at the median interval.
+        if (config.rate <= 0)
+        {
+            uint64_t interval = stats.latency.GetPercentile(0.5);
+            HdrHistogram corrected;
+            corrected.AddCorrected(stats.latency, interval);
+            fprintf(file, "  \"expectedIntervalUs\": %llu,\n",
+                    static_cast<unsigned long long>(interval));
+            PrintLatency(file, "correctedLatencyUs", corrected);
+        }
+
+        // Non-empty buckets as [highest value, count]
+        fprintf(file, "  \"histogram\": [");
+        bool first = true;
+        for (size_t i = 0; i < HdrHistogram::kBuckets; ++i)
+        {
+            uint64_t count = stats.latency.GetBucketCount(i);
+            if (!count)
+                continue;
+            fprintf(file, "%s[%llu, %llu]", first ? "" : ", ",
+                    static_cast<unsigned long long>(
+                        HdrHistogram::Buckets::GetHighest(i)),
+                    static_cast<unsigned long long>(count));
+            first = false;
+        }
+        fprintf(file, "]\n}\n");
+    }
+
+    void Usage(const char *name)
+    {
+        fprintf(stderr,
+                "usage: %s [-t threads] [-c connections] [-d seconds] "
+                "[-w seconds] [-r rate] [-p depth] [-k | -C] [-m method] "
+                "[-H header]... [-b body] [-o file] url\n", name);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    LoadConfig config;
+    for (int i = 1; i < argc; ++i)
+    {
+        const char *arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (strcmp(arg, "-k") == 0)
+            config.keepAlive = true;
+        else if (strcmp(arg, "-C") == 0)
+            config.keepAlive = false;
+        else if (strcmp(arg, "-t") == 0 && hasValue)
+            config.threads = strtoul(argv[++i], 0, 10);
+        else if (strcmp(arg, "-c") == 0 && hasValue)
+            config.connections = strtoul(argv[++i], 0, 10);
+        else if (strcmp(arg, "-d") == 0 && hasValue)
+            config.duration = strtod(argv[++i], 0);
+        else if (strcmp(arg, "-w") == 0 && hasValue)
+            config.warmup = strtod(argv[++i], 0);
+        else if (strcmp(arg, "-r") == 0 && hasValue)
+            config.rate = strtod(argv[++i], 0);
+        else if (strcmp(arg, "-p") == 0 && hasValue)
+            config.depth = strtoul(argv[++i], 0, 10);
+        else if (strcmp(arg, "-m") == 0 && hasValue)
+            config.method = argv[++i];
+        else if (strcmp(arg, "-H") == 0 && hasValue)
+            config.headers.push_back(argv[++i]);
+        else if (strcmp(arg, "-b") == 0 && hasValue)
+            config.body = argv[++i];
+        else if (strcmp(arg, "-o") == 0 && hasValue)
+            config.output = argv[++i];
+        else if (arg[0] != '-' && config.url.empty())
+            config.url = arg;
+        else
+        {
+            Usage(argv[0]);
+            return 2;
+        }
+    }
+
+    if (config.url.empty() || !config.threads || !config.connections ||
+        !config.depth || config.duration <= 0 ||
+        config.warmup >= config.duration)
+    {
+        Usage(argv[0]);
+        return 2;
+    }
+    if (config.threads > config.connections)
+        config.threads = config.connections;
+    // Nothing to pipeline on a connection that closes after each answer
+    if (!config.keepAlive)
+        config.depth = 1;
+
+    std::string host;
+    std::string port;
+    if (!ParseUrl(config, host, port))
+    {
+        fprintf(stderr, "%s: not an http url\n", config.url.c_str());
+        return 2;
+    }
+
+    try
+    {
+        boost::asio::io_service service;
+        boost::asio::ip::tcp::resolver resolver(service);
+        boost::asio::ip::tcp::resolver::query query(host, port);
+        config.endpoint = *resolver.resolve(query);
+    }
+    catch (const std::exception &e)
+    {
+        fprintf(stderr, "%s: %s\n", host.c_str(), e.what());
+        return 1;
+    }
+
+    std::vector< boost::shared_ptr<LoadWorker> > workers;
+    for (size_t i = 0; i < config.threads; ++i)
+        workers.push_back(boost::shared_ptr<LoadWorker>(new LoadWorker(config)));
+    for (size_t i = 0; i < config.connections; ++i)
+        workers[i % config.threads]->AddConnection(i);
+
+    // Give every thread the same schedule, shortly ahead
+    config.startUs = CoarseClock::NowUs() + 10000;
+    config.measureUs = config.startUs +
+        static_cast<uint64_t>(config.warmup * 1e6);
+    config.endUs = config.startUs +
+        static_cast<uint64_t>(config.duration * 1e6);
+
+    boost::thread_group threads;
+    for (size_t i = 0; i < workers.size(); ++i)
+        threads.create_thread(boost::bind(&LoadWorker::Run, workers[i].get()));
+    threads.join_all();
+
+    LoadStats stats;
+    for (size_t i = 0; i < workers.size(); ++i)
+        stats.Add(workers[i]->GetStats());
+
+    FILE *file = stdout;
+    if (!config.output.empty())
+    {
+        file = fopen(config.output.c_str(), "w");
+        if (!file)
+        {
+            perror(config.output.c_str());
+            return 1;
+        }
+    }
+    PrintResults(file, config, stats);
+    if (file != stdout)
+        fclose(file);
+
+    fprintf(stderr, "%llu requests, %llu errors, %.1f req/s, "
+            "p50 %lluus p99 %lluus max %lluus\n",
+            static_cast<unsigned long long>(stats.requests),
+            static_cast<unsigned long long>(stats.errors),
+            stats.requests / (config.duration - config.warmup),
+            static_cast<unsigned long long>(stats.latency.GetPercentile(0.5)),
+            static_cast<unsigned long long>(stats.latency.GetPercentile(0.99)),
+            static_cast<unsigned long long>(stats.latency.GetMax()));
+    return 0;
+}
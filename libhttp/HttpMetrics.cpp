@@ -0,0 +1,211 @@
+#include "HttpMetrics.h"
+#include <iomanip>
+#include <sstream>
+
+namespace
+{
+    std::string EscapeJson(const std::string &s)
+    {
+        std::string escaped;
+        for (size_t i = 0; i < s.size(); ++i)
+        {
+            if (s[i] == '"' || s[i] == '\\')
+                escaped.push_back('\\');
+            escaped.push_back(s[i]);
+        }
+        return escaped;
+    }
+
+    const char *kStatusClassNames[6] =
+    {
+        "other", "1xx", "2xx", "3xx", "4xx", "5xx"
+    };
+}
+
+HttpRouteMetrics::HttpRouteMetrics()
+    : requests(0),
+      requestBytes(0),
+      responseBytes(0),
+      totalLatencyUs(0),
+      maxLatencyUs(0),
+      histogram(HttpMetrics::kBuckets)
+{
+    for (size_t i = 0; i < 6; ++i)
+        statusClasses[i] = 0;
+}
+
+uint64_t HttpRouteMetrics::GetPercentile(double q) const
+{
+    return HttpMetrics::Buckets::GetPercentile(histogram, q, maxLatencyUs);
+}
+
+HttpMetrics::Shard::Shard(size_t slots)
+    : size(slots),
+      slots(new Slot[slots])
+{
+    // Atomics start out indeterminate
+    for (size_t i = 0; i < size; ++i)
+    {
+        Slot &slot = this->slots[i];
+        slot.requests.store(0);
+        for (size_t j = 0; j < 6; ++j)
+            slot.statusClasses[j].store(0);
+        slot.requestBytes.store(0);
+        slot.responseBytes.store(0);
+        slot.totalLatencyUs.store(0);
+        slot.maxLatencyUs.store(0);
+        for (size_t j = 0; j < kBuckets; ++j)
+            slot.histogram[j].store(0);
+    }
+}
+
+HttpMetrics::Shard::~Shard()
+{
+    delete [] slots;
+}
+
+HttpMetrics::HttpMetrics()
+    : m_local(&HttpMetrics::KeepShard)
+{
+    m_names.push_back("(none)");
+}
+
+HttpMetrics::~HttpMetrics()
+{
+    for (size_t i = 0; i < m_shards.size(); ++i)
+        delete m_shards[i];
+}
+
+int HttpMetrics::AddRoute(const std::string &name)
+{
+    m_names.push_back(name);
+    return static_cast<int>(m_names.size() - 1);
+}
+
+void HttpMetrics::Record(int route, int status, uint64_t requestBytes,
+                         uint64_t responseBytes, uint64_t latencyUs)
+{
+    Shard &shard = GetShard();
+    size_t index = route > 0 && static_cast<size_t>(route) < shard.size ?
+        route : 0;
+    Slot &slot = shard.slots[index];
+
+    int statusClass = status / 100;
+    if (statusClass < 1 || statusClass > 5)
+        statusClass = 0;
+
+    Add(slot.requests, 1);
+    Add(slot.statusClasses[statusClass], 1);
+    Add(slot.requestBytes, requestBytes);
+    Add(slot.responseBytes, responseBytes);
+    Add(slot.totalLatencyUs, latencyUs);
+    if (latencyUs > slot.maxLatencyUs.load(boost::memory_order_relaxed))
+        slot.maxLatencyUs.store(latencyUs, boost::memory_order_relaxed);
+    Add(slot.histogram[Buckets::GetIndex(latencyUs)], 1);
+}
+
+void HttpMetrics::GetSnapshot(std::vector<HttpRouteMetrics> &routes) const
+{
+    routes.clear();
+    routes.resize(m_names.size());
+    for (size_t i = 0; i < routes.size(); ++i)
+        routes[i].name = m_names[i];
+
+    boost::mutex::scoped_lock lock(m_mutex);
+    for (size_t s = 0; s < m_shards.size(); ++s)
+    {
+        const Shard &shard = *m_shards[s];
+        for (size_t i = 0; i < shard.size && i < routes.size(); ++i)
+        {
+            const Slot &slot = shard.slots[i];
+            HttpRouteMetrics &route = routes[i];
+            route.requests += slot.requests.load(boost::memory_order_relaxed);
+            for (size_t j = 0; j < 6; ++j)
+                route.statusClasses[j] +=
+                    slot.statusClasses[j].load(boost::memory_order_relaxed);
+            route.requestBytes +=
+                slot.requestBytes.load(boost::memory_order_relaxed);
+            route.responseBytes +=
+                slot.responseBytes.load(boost::memory_order_relaxed);
+            route.totalLatencyUs +=
+                slot.totalLatencyUs.load(boost::memory_order_relaxed);
+            uint64_t max = slot.maxLatencyUs.load(boost::memory_order_relaxed);
+            if (max > route.maxLatencyUs)
+                route.maxLatencyUs = max;
+            for (size_t j = 0; j < kBuckets; ++j)
+                route.histogram[j] +=
+                    slot.histogram[j].load(boost::memory_order_relaxed);
+        }
+    }
+}
+
+std::string HttpMetrics::ToJson(const std::vector<HttpRouteMetrics> &routes)
+{
+    std::ostringstream oss;
+    oss << "{\"routes\": [";
+    for (size_t i = 0; i < routes.size(); ++i)
+    {
+        const HttpRouteMetrics &route = routes[i];
+        oss << (i ? ",\n" : "\n")
+            << "  {\"route\": \"" << EscapeJson(route.name) << "\""
+            << ", \"requests\": " << route.requests
+            << ", \"status\": {";
+        for (size_t j = 1; j <= 6; ++j)
+        {
+            size_t c = j % 6;
+            oss << (j > 1 ? ", " : "") << "\"" << kStatusClassNames[c]
+                << "\": " << route.statusClasses[c];
+        }
+        oss << "}, \"requestBytes\": " << route.requestBytes
+            << ", \"responseBytes\": " << route.responseBytes
+            << ", \"latencyUs\": {\"mean\": "
+            << (route.requests ? route.totalLatencyUs / route.requests : 0)
+            << ", \"p50\": " << route.GetPercentile(0.5)
+            << ", \"p90\": " << route.GetPercentile(0.9)
+            << ", \"p99\": " << route.GetPercentile(0.99)
+            << ", \"p999\": " << route.GetPercentile(0.999)
+            << ", \"max\": " << route.maxLatencyUs << "}}";
+    }
+    oss << "\n]}\n";
+    return oss.str();
+}
+
+std::string HttpMetrics::ToText(const std::vector<HttpRouteMetrics> &routes)
+{
+    std::ostringstream oss;
+    oss << std::left << std::setw(32) << "route" << std::right
+        << std::setw(10) << "requests" << std::setw(8) << "2xx"
+        << std::setw(8) << "3xx" << std::setw(8) << "4xx"
+        << std::setw(8) << "5xx" << std::setw(12) << "bytes out"
+        << std::setw(10) << "p50 us" << std::setw(10) << "p99 us"
+        << std::setw(10) << "max us" << "\n";
+    for (size_t i = 0; i < routes.size(); ++i)
+    {
+        const HttpRouteMetrics &route = routes[i];
+        oss << std::left << std::setw(32) << route.name << std::right
+            << std::setw(10) << route.requests
+            << std::setw(8) << route.statusClasses[2]
+            << std::setw(8) << route.statusClasses[3]
+            << std::setw(8) << route.statusClasses[4]
+            << std::setw(8) << route.statusClasses[5]
+            << std::setw(12) << route.responseBytes
+            << std::setw(10) << route.GetPercentile(0.5)
+            << std::setw(10) << route.GetPercentile(0.99)
+            << std::setw(10) << route.maxLatencyUs << "\n";
+    }
+    return oss.str();
+}
+
+HttpMetrics::Shard & HttpMetrics::GetShard()
+{
+    Shard *shard = m_local.get();
+    if (!shard)
+    {
+        // Kept after the thread exits, its counts still add up
+        shard = new Shard(m_names.size());
+        m_local.reset(shard);
+        boost::mutex::scoped_lock lock(m_mutex);
+        m_shards.push_back(shard);
+    }
+    return *shard;
+}
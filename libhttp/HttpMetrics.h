@@ -0,0 +1,102 @@
+#ifndef HTTP_METRICS_H
+#define HTTP_METRICS_H
+
+#include "../HdrHistogram.h"
+#include <boost/noncopyable.hpp>
+#include <boost/atomic.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/tss.hpp>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// Counters of one route, summed over the threads
+struct HttpRouteMetrics
+{
+    HttpRouteMetrics();
+
+    // Latency in microseconds below which a fraction q (0..1) of the
+    // requests were answered, within the histogram's ~6% precision
+    uint64_t GetPercentile(double q) const;
+
+    std::string name;
+    uint64_t requests;
+    // By status class, [1] for 1xx up to [5] for 5xx, [0] for the rest
+    uint64_t statusClasses[6];
+    uint64_t requestBytes;
+    uint64_t responseBytes;
+    uint64_t totalLatencyUs;
+    uint64_t maxLatencyUs;
+    // Counts per latency bucket, see HttpMetrics::Buckets
+    std::vector<uint64_t> histogram;
+};
+
+// Per route request counts, bytes and latency histograms. Each thread
+// records into a shard of its own with plain relaxed stores, the shards
+// are only summed when read.
+class HttpMetrics : private boost::noncopyable
+{
+public:
+    // Log-linear buckets: 16 per power of two, the first 32 exact
+    typedef HdrBuckets<5, 36> Buckets;
+    const static size_t kBuckets = Buckets::kBuckets;
+
+    HttpMetrics();
+    ~HttpMetrics();
+
+    // Before any request is recorded, ids are given out from 1 up. 0
+    // takes whatever no route answered, and the requests of routes added
+    // after a thread's first record.
+    int AddRoute(const std::string &name);
+
+    void Record(int route, int status, uint64_t requestBytes,
+                uint64_t responseBytes, uint64_t latencyUs);
+
+    // Slot 0 first, then the routes in the order they were added
+    void GetSnapshot(std::vector<HttpRouteMetrics> &routes) const;
+
+    static std::string ToJson(const std::vector<HttpRouteMetrics> &routes);
+    static std::string ToText(const std::vector<HttpRouteMetrics> &routes);
+
+private:
+    typedef boost::atomic<uint64_t> Counter;
+
+    struct Slot
+    {
+        Counter requests;
+        Counter statusClasses[6];
+        Counter requestBytes;
+        Counter responseBytes;
+        Counter totalLatencyUs;
+        Counter maxLatencyUs;
+        Counter histogram[kBuckets];
+    };
+
+    struct Shard
+    {
+        explicit Shard(size_t slots);
+        ~Shard();
+
+        size_t size;
+        Slot *slots;
+    };
+
+    // Only the owning thread writes, so no read-modify-write is needed
+    static void Add(Counter &counter, uint64_t value)
+    {
+        counter.store(counter.load(boost::memory_order_relaxed) + value,
+                      boost::memory_order_relaxed);
+    }
+
+    static void KeepShard(Shard *shard)
+    { }
+
+    Shard & GetShard();
+
+    std::vector<std::string> m_names;
+    boost::thread_specific_ptr<Shard> m_local;
+    mutable boost::mutex m_mutex;
+    std::vector<Shard *> m_shards;
+};
+
+#endif // HTTP_METRICS_H
@@ -0,0 +1,241 @@
+#ifndef HTTP_MIDDLEWARE_H
+#define HTTP_MIDDLEWARE_H
+
+#include "HttpRequester.h"
+#include "HttpResponser.h"
+#include <boost/bind.hpp>
+#include <iostream>
+#include <string>
+
+// Middleware composed at compile time. A stage has Before, which returns
+// false to answer the request itself and stop the chain there, and
+// After, which runs on the way back out. Each chain link knows the exact
+// type of the next one, so the whole pipeline inlines into one call.
+//
+// Stages share a Context chosen by the pipeline, created on the stack
+// for each request. Stages are templates on it or take it concretely.
+//
+// After sees what the handler left in the responser. For a deferred
+// response it runs once that is complete instead, on the connection's
+// thread and with a copy of the context.
+//
+// The response cache answers before any handler runs, so it would skip
+// the stages, HttpDispatch refuses to enable both.
+//
+//   struct Context { std::string user; };
+//   dispatch.SetPipeline(HttpMakePipeline<Context>(HttpMakeChain(
+//       HttpLogStage(), Auth(), HttpCorsStage("*"),
+//       dispatch.GetEndpoint())));
+
+// Base with stages that do nothing, a stage hides the one it needs
+struct HttpStage
+{
+    template <class Context>
+    bool Before(const HttpRequester &req, HttpResponser &resp,
+                Context &context) const
+    {
+        return true;
+    }
+
+    template <class Context>
+    void After(const HttpRequester &req, HttpResponser &resp,
+               Context &context) const
+    { }
+};
+
+template <class Stage, class Next>
+class HttpChain
+{
+public:
+    HttpChain(const Stage &stage, const Next &next)
+        : m_stage(stage),
+          m_next(next)
+    { }
+
+    template <class Context>
+    void operator()(const HttpRequester &req, HttpResponser &resp,
+                    Context &context) const
+    {
+        if (m_stage.Before(req, resp, context))
+            m_next(req, resp, context);
+        if (!resp.IsDeferred())
+        {
+            m_stage.After(req, resp, context);
+            return;
+        }
+
+        HttpAsyncResponsePtr async = resp.Defer();
+        if (async)
+            async->Responser().AddFinishCallback(boost::bind(
+                &HttpChain::template AfterDeferred<Context>,
+                m_stage, context, _1, _2));
+    }
+
+private:
+    template <class Context>
+    static void AfterDeferred(const Stage &stage, const Context &context,
+                              const HttpRequester &req, HttpResponser &resp)
+    {
+        Context copy(context);
+        stage.After(req, resp, copy);
+    }
+
+    Stage m_stage;
+    Next m_next;
+};
+
+// Ends a chain with a plain (req, resp) handler
+template <class Handler>
+class HttpChainEnd
+{
+public:
+    explicit HttpChainEnd(const Handler &handler)
+        : m_handler(handler)
+    { }
+
+    template <class Context>
+    void operator()(const HttpRequester &req, HttpResponser &resp,
+                    Context &context) const
+    {
+        m_handler(req, resp);
+    }
+
+private:
+    Handler m_handler;
+};
+
+// The chain as an ordinary handler, one Context per request
+template <class Context, class Chain>
+class HttpPipeline
+{
+public:
+    explicit HttpPipeline(const Chain &chain)
+        : m_chain(chain)
+    { }
+
+    void operator()(const HttpRequester &req, HttpResponser &resp) const
+    {
+        Context context = Context();
+        m_chain(req, resp, context);
+    }
+
+private:
+    Chain m_chain;
+};
+
+template <class Context, class Chain>
+HttpPipeline<Context, Chain> HttpMakePipeline(const Chain &chain)
+{
+    return HttpPipeline<Context, Chain>(chain);
+}
+
+// Chains of up to five stages in front of handler
+template <class S1, class H>
+HttpChain<S1, HttpChainEnd<H> >
+HttpMakeChain(const S1 &s1, const H &handler)
+{
+    return HttpChain<S1, HttpChainEnd<H> >(s1, HttpChainEnd<H>(handler));
+}
+
+template <class S1, class S2, class H>
+HttpChain<S1, HttpChain<S2, HttpChainEnd<H> > >
+HttpMakeChain(const S1 &s1, const S2 &s2, const H &handler)
+{
+    return HttpChain<S1, HttpChain<S2, HttpChainEnd<H> > >(
+        s1, HttpMakeChain(s2, handler));
+}
+
+template <class S1, class S2, class S3, class H>
+HttpChain<S1, HttpChain<S2, HttpChain<S3, HttpChainEnd<H> > > >
+HttpMakeChain(const S1 &s1, const S2 &s2, const S3 &s3, const H &handler)
+{
+    return HttpChain<S1, HttpChain<S2, HttpChain<S3, HttpChainEnd<H> > > >(
+        s1, HttpMakeChain(s2, s3, handler));
+}
+
+template <class S1, class S2, class S3, class S4, class H>
+HttpChain<S1, HttpChain<S2, HttpChain<S3, HttpChain<S4,
+    HttpChainEnd<H> > > > >
+HttpMakeChain(const S1 &s1, const S2 &s2, const S3 &s3, const S4 &s4,
+              const H &handler)
+{
+    return HttpChain<S1, HttpChain<S2, HttpChain<S3, HttpChain<S4,
+        HttpChainEnd<H> > > > >(s1, HttpMakeChain(s2, s3, s4, handler));
+}
+
+template <class S1, class S2, class S3, class S4, class S5, class H>
+HttpChain<S1, HttpChain<S2, HttpChain<S3, HttpChain<S4, HttpChain<S5,
+    HttpChainEnd<H> > > > > >
+HttpMakeChain(const S1 &s1, const S2 &s2, const S3 &s3, const S4 &s4,
+              const S5 &s5, const H &handler)
+{
+    return HttpChain<S1, HttpChain<S2, HttpChain<S3, HttpChain<S4,
+        HttpChain<S5, HttpChainEnd<H> > > > > >(
+            s1, HttpMakeChain(s2, s3, s4, s5, handler));
+}
+
+// What HttpDispatch logs when it has no pipeline
+struct HttpLogStage : public HttpStage
+{
+    template <class Context>
+    bool Before(const HttpRequester &req, HttpResponser &resp,
+                Context &context) const
+    {
+        std::cerr << req.ToString();
+        return true;
+    }
+};
+
+// Lets browsers on origin call the routes, preflights are answered here
+class HttpCorsStage : public HttpStage
+{
+public:
+    explicit HttpCorsStage(const std::string &origin,
+                           const std::string &methods =
+                               "GET, POST, PUT, DELETE, OPTIONS",
+                           const std::string &headers = "Content-Type")
+        : m_origin(origin),
+          m_methods(methods),
+          m_headers(headers)
+    { }
+
+    template <class Context>
+    bool Before(const HttpRequester &req, HttpResponser &resp,
+                Context &context) const
+    {
+        if (req.GetHttpMethod() != HTTP_OPTIONS ||
+            !*req.GetHeader("Access-Control-Request-Method"))
+            return true;
+
+        resp.SetStatusCode(HttpResponser::StatusCode_204NoContent);
+        resp.AddHeader("Access-Control-Allow-Methods", m_methods);
+        resp.AddHeader("Access-Control-Allow-Headers", m_headers);
+        resp.AddHeader("Access-Control-Max-Age", "600");
+        return false;
+    }
+
+    template <class Context>
+    void After(const HttpRequester &req, HttpResponser &resp,
+               Context &context) const
+    {
+        if (!*req.GetHeader("Origin"))
+            return;
+
+        resp.AddHeader("Access-Control-Allow-Origin", m_origin);
+        if (m_origin == "*")
+            return;
+
+        std::string vary = resp.GetHeader("Vary");
+        if (vary.empty())
+            resp.AddHeader("Vary", "Origin");
+        else if (vary.find("Origin") == std::string::npos)
+            resp.AddHeader("Vary", vary + ", Origin");
+    }
+
+private:
+    std::string m_origin;
+    std::string m_methods;
+    std::string m_headers;
+};
+
+#endif // HTTP_MIDDLEWARE_H
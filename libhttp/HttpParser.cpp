@@ -1,5 +1,7 @@
 #include "HttpParser.h"
+#include "HttpResponser.h"
 #include <sstream>
+#include <climits>
 
 http_parser_settings HttpParser::m_settings =
 {
@@ -8,7 +10,7 @@ http_parser_settings HttpParser::m_settings =
     0,
     &HttpParser::OnHeaderName,
     &HttpParser::OnHeaderValue,
-    0,
+    &HttpParser::OnHeadersComplete,
     &HttpParser::OnBody,
     &HttpParser::OnComplete,
     0,
@@ -16,16 +18,32 @@ http_parser_settings HttpParser::m_settings =
 };
 
 HttpParser::HttpParser()
-    : m_headerState(HeaderState_None),
-      m_complete(false)
+    : m_urlSplit(false),
+      m_queryIndexed(false),
+      m_routeId(-1),
+      m_headerState(HeaderState_None),
+      m_headerComplete(false),
+      m_complete(false),
+      m_skipBody(false),
+      m_contentLength(ULLONG_MAX),
+      m_headerBytes(0),
+      m_limitStatus(0)
 {
     http_parser_init(&m_httpParser, HTTP_BOTH);
     m_httpParser.data = this;
 }
 
-bool HttpParser::Parse(const char *data, size_t len)
+bool HttpParser::Parse(const char *data, size_t len, size_t *parsed)
 {
-    http_parser_execute(&m_httpParser, &m_settings, data, len);
+    size_t n = http_parser_execute(&m_httpParser, &m_settings, data, len);
+    if (parsed)
+        *parsed = n;
+
+    if (HTTP_PARSER_ERRNO(&m_httpParser) == HPE_PAUSED)
+    {
+        http_parser_pause(&m_httpParser, 0);
+        return true;
+    }
     return HTTP_PARSER_ERRNO(&m_httpParser) == HPE_OK;
 }
 
@@ -34,33 +52,179 @@ bool HttpParser::IsComplete() const
     return m_complete;
 }
 
+bool HttpParser::IsHeaderComplete() const
+{
+    return m_headerComplete;
+}
+
 void HttpParser::Reset()
 {
     http_parser_init(&m_httpParser, HTTP_BOTH);
     m_httpParser.data = this;
+    m_headerComplete = false;
     m_complete = false;
+    m_skipBody = false;
+    m_contentLength = ULLONG_MAX;
     m_headerState = HeaderState_None;
+    m_limits = m_defaultLimits;
+    m_headerBytes = 0;
+    m_limitStatus = 0;
     m_url.clear();
-    m_method.clear();
+    m_urlSplit = false;
+    m_path.clear();
+    m_queryString.clear();
+    m_fragment.clear();
+    m_queryIndexed = false;
+    m_queryDecoded.clear();
+    m_queryParams.clear();
+    m_pathParams.Clear();
+    m_routeId = -1;
     m_headerName.clear();
     m_headerValue.clear();
     m_headers.clear();
     m_body.clear();
 }
 
+void HttpParser::Shrink(size_t threshold)
+{
+    HttpHeaderMap::ShrinkString(m_url, threshold);
+    HttpHeaderMap::ShrinkString(m_queryDecoded, threshold);
+    HttpHeaderMap::ShrinkString(m_headerName, threshold);
+    HttpHeaderMap::ShrinkString(m_headerValue, threshold);
+    HttpHeaderMap::ShrinkString(m_body, threshold);
+    m_headers.Shrink(threshold);
+    if (m_queryParams.capacity() * sizeof(QueryParam) > threshold)
+        QueryParams().swap(m_queryParams);
+}
+
 const char * HttpParser::GetErrorDetail() const
 {
     return http_errno_description(HTTP_PARSER_ERRNO(&m_httpParser));
 }
 
+void HttpParser::SetLimits(const HttpLimits &limits)
+{
+    m_limits = limits;
+    m_defaultLimits = limits;
+}
+
+const HttpLimits & HttpParser::GetLimits() const
+{
+    return m_limits;
+}
+
+void HttpParser::SetHeadersCallback(const HeadersCallback &callback)
+{
+    m_headersCallback = callback;
+}
+
+void HttpParser::SetBodyCallback(const BodyCallback &callback)
+{
+    m_bodyCallback = callback;
+}
+
+void HttpParser::SetSkipBody(bool skip)
+{
+    m_skipBody = skip;
+}
+
+int HttpParser::GetLimitStatus() const
+{
+    return m_limitStatus;
+}
+
 const std::string & HttpParser::GetUrl() const
 {
     return m_url;
 }
 
+boost::string_ref HttpParser::GetPath() const
+{
+    SplitUrl();
+    return m_path;
+}
+
+boost::string_ref HttpParser::GetQueryString() const
+{
+    SplitUrl();
+    return m_queryString;
+}
+
+boost::string_ref HttpParser::GetFragment() const
+{
+    SplitUrl();
+    return m_fragment;
+}
+
+boost::string_ref HttpParser::GetQuery(const boost::string_ref &key) const
+{
+    const QueryParam *param = FindQuery(key);
+    if (!param)
+        return boost::string_ref();
+    return boost::string_ref(m_queryDecoded.data() + param->valueOffset,
+                             param->valueLength);
+}
+
+bool HttpParser::HasQuery(const boost::string_ref &key) const
+{
+    return FindQuery(key) != 0;
+}
+
+void HttpParser::SetPathParams(const HttpPathParams &params) const
+{
+    m_pathParams = params;
+}
+
+const HttpPathParams & HttpParser::GetPathParams() const
+{
+    return m_pathParams;
+}
+
+boost::string_ref HttpParser::GetPathParam(const boost::string_ref &name) const
+{
+    return m_pathParams.Get(name);
+}
+
+void HttpParser::SetRouteId(int id) const
+{
+    m_routeId = id;
+}
+
+int HttpParser::GetRouteId() const
+{
+    return m_routeId;
+}
+
+HttpMethod HttpParser::GetHttpMethod() const
+{
+    return static_cast<HttpMethod>(m_httpParser.method);
+}
+
+int HttpParser::GetStatusCode() const
+{
+    return m_httpParser.status_code;
+}
+
+unsigned long long HttpParser::GetContentLength() const
+{
+    return m_contentLength;
+}
+
+bool HttpParser::ShouldKeepAlive() const
+{
+    return http_should_keep_alive(&m_httpParser) != 0;
+}
+
 const std::string & HttpParser::GetMethod() const
 {
-    return m_method;
+    static const std::string kMethods[] =
+    {
+#define XX(num, name, string) #string,
+        HTTP_METHOD_MAP(XX)
+#undef XX
+    };
+
+    return kMethods[m_httpParser.method];
 }
 
 const std::string & HttpParser::GetBody() const
@@ -97,6 +261,146 @@ bool HttpParser::HeaderReady() const
     return m_headerState == HeaderState_HasAll;
 }
 
+void HttpParser::SplitUrl() const
+{
+    if (m_urlSplit)
+        return;
+    m_urlSplit = true;
+
+    struct http_parser_url url;
+    http_parser_url_init(&url);
+    if (http_parser_parse_url(m_url.data(), m_url.size(),
+                              m_httpParser.method == HTTP_CONNECT, &url))
+    {
+        // e.g. "OPTIONS *", keep the whole thing as the path
+        m_path = m_url;
+        return;
+    }
+
+    const char *data = m_url.data();
+    if (url.field_set & (1 << UF_PATH))
+        m_path = boost::string_ref(data + url.field_data[UF_PATH].off,
+                                   url.field_data[UF_PATH].len);
+    if (url.field_set & (1 << UF_QUERY))
+        m_queryString = boost::string_ref(data + url.field_data[UF_QUERY].off,
+                                          url.field_data[UF_QUERY].len);
+    if (url.field_set & (1 << UF_FRAGMENT))
+        m_fragment = boost::string_ref(data + url.field_data[UF_FRAGMENT].off,
+                                       url.field_data[UF_FRAGMENT].len);
+}
+
+// Decodes every key and value in place inside one copy of the query
+// string, both the copy and the index keep their capacity across Reset.
+void HttpParser::IndexQuery() const
+{
+    if (m_queryIndexed)
+        return;
+    m_queryIndexed = true;
+
+    SplitUrl();
+    m_queryDecoded.assign(m_queryString.data(), m_queryString.size());
+
+    char *data = &m_queryDecoded[0];
+    size_t size = m_queryDecoded.size();
+    size_t begin = 0;
+    while (begin < size)
+    {
+        size_t end = begin;
+        size_t equal = size;
+        while (end < size && data[end] != '&')
+        {
+            if (equal == size && data[end] == '=')
+                equal = end;
+            ++end;
+        }
+
+        if (end > begin)
+        {
+            QueryParam param;
+            param.keyOffset = begin;
+            if (equal < end)
+            {
+                param.keyLength = DecodeComponent(data + begin, equal - begin);
+                param.valueOffset = equal + 1;
+                param.valueLength = DecodeComponent(data + equal + 1,
+                                                    end - equal - 1);
+            }
+            else
+            {
+                param.keyLength = DecodeComponent(data + begin, end - begin);
+                param.valueOffset = end;
+                param.valueLength = 0;
+            }
+            m_queryParams.push_back(param);
+        }
+
+        begin = end + 1;
+    }
+}
+
+const HttpParser::QueryParam *
+HttpParser::FindQuery(const boost::string_ref &key) const
+{
+    IndexQuery();
+    for (QueryParams::const_iterator it = m_queryParams.begin();
+         it != m_queryParams.end(); ++it)
+    {
+        if (key == boost::string_ref(m_queryDecoded.data() + it->keyOffset,
+                                     it->keyLength))
+            return &*it;
+    }
+    return 0;
+}
+
+namespace
+{
+    int HexValue(char c)
+    {
+        if (c >= '0' && c <= '9')
+            return c - '0';
+        if (c >= 'a' && c <= 'f')
+            return c - 'a' + 10;
+        if (c >= 'A' && c <= 'F')
+            return c - 'A' + 10;
+        return -1;
+    }
+}
+
+size_t HttpParser::DecodeComponent(char *data, size_t length)
+{
+    size_t out = 0;
+    for (size_t in = 0; in < length; ++in)
+    {
+        char c = data[in];
+        if (c == '+')
+        {
+            c = ' ';
+        }
+        else if (c == '%' && in + 2 < length)
+        {
+            int high = HexValue(data[in + 1]);
+            int low = HexValue(data[in + 2]);
+            if (high >= 0 && low >= 0)
+            {
+                c = static_cast<char>((high << 4) | low);
+                in += 2;
+            }
+        }
+        data[out++] = c;
+    }
+    return out;
+}
+
+bool HttpParser::CheckHeaderLimits()
+{
+    if (m_limits.maxUrlLength && m_url.size() > m_limits.maxUrlLength)
+        m_limitStatus = HttpResponser::StatusCode_414URITooLong;
+    else if (m_limits.maxHeaderBytes && m_headerBytes > m_limits.maxHeaderBytes)
+        m_limitStatus = HttpResponser::StatusCode_431RequestHeaderFieldsTooLarge;
+
+    return m_limitStatus == 0;
+}
+
 int HttpParser::OnUrl(http_parser * parser, const char * at, size_t length)
 {
     if (length <= 0)
@@ -104,10 +408,9 @@ int HttpParser::OnUrl(http_parser * parser, const char * at, size_t length)
 
     HttpParser *httpParser = (HttpParser *)(parser->data);
     httpParser->m_url.append(at, length);
-    httpParser->m_method = http_method_str(
-        static_cast<enum http_method>(parser->method));
+    httpParser->m_headerBytes += length;
 
-    return 0;
+    return httpParser->CheckHeaderLimits() ? 0 : -1;
 }
 
 int HttpParser::OnHeaderName(http_parser * parser, const char * at, size_t length)
@@ -119,6 +422,10 @@ int HttpParser::OnHeaderName(http_parser * parser, const char * at, size_t lengt
 
     httpParser->m_headerName = "";
     httpParser->m_headerName.append(at, length);
+    httpParser->m_headerBytes += length;
+    if (!httpParser->CheckHeaderLimits())
+        return -1;
+
     httpParser->m_headerState =
         HeaderState(httpParser->m_headerState | HeaderState_HasName);
     if (httpParser->m_headerState == HeaderState_HasAll)
@@ -139,6 +446,10 @@ int HttpParser::OnHeaderValue(http_parser * parser, const char * at, size_t leng
 
     httpParser->m_headerValue = "";
     httpParser->m_headerValue.append(at, length);
+    httpParser->m_headerBytes += length;
+    if (!httpParser->CheckHeaderLimits())
+        return -1;
+
     httpParser->m_headerState =
         HeaderState(httpParser->m_headerState | HeaderState_HasVaule);
     if (httpParser->m_headerState == HeaderState_HasAll)
@@ -151,12 +462,47 @@ int HttpParser::OnHeaderValue(http_parser * parser, const char * at, size_t leng
     return 0;
 }
 
+int HttpParser::OnHeadersComplete(http_parser * parser)
+{
+    HttpParser *httpParser = (HttpParser *)(parser->data);
+    if (httpParser->m_headersCallback)
+        httpParser->m_headersCallback(httpParser->m_limits);
+
+    // The callback may have narrowed the limits, so check everything again
+    if (!httpParser->CheckHeaderLimits())
+        return -1;
+
+    size_t maxBodySize = httpParser->m_limits.maxBodySize;
+    if (maxBodySize && parser->content_length != ULLONG_MAX &&
+        parser->content_length > maxBodySize)
+    {
+        httpParser->m_limitStatus = HttpResponser::StatusCode_413PayloadTooLarge;
+        return -1;
+    }
+
+    // Counted down by http_parser as the body comes in
+    httpParser->m_contentLength = parser->content_length;
+    httpParser->m_headerComplete = true;
+
+    return httpParser->m_skipBody ? 1 : 0;
+}
+
 int HttpParser::OnBody(http_parser * parser, const char * at, size_t length)
 {
     if (length <= 0)
         return 0;
 
     HttpParser *httpParser = (HttpParser *)(parser->data);
+    if (httpParser->m_bodyCallback)
+        return httpParser->m_bodyCallback(at, length) ? 0 : -1;
+
+    // Chunked bodies carry no Content-Length, so check as they grow
+    size_t maxBodySize = httpParser->m_limits.maxBodySize;
+    if (maxBodySize && httpParser->m_body.size() + length > maxBodySize)
+    {
+        httpParser->m_limitStatus = HttpResponser::StatusCode_413PayloadTooLarge;
+        return -1;
+    }
     httpParser->m_body.append(at, length);
 
     return 0;
@@ -166,5 +512,8 @@ int HttpParser::OnComplete(http_parser * parser)
 {
     HttpParser *httpParser = (HttpParser *)(parser->data);
     httpParser->m_complete = true;
+
+    // Pipelined requests behind this one are left for after Reset
+    http_parser_pause(parser, 1);
     return 0;
 }
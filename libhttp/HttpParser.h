@@ -2,23 +2,163 @@
 #define HTTP_PARSER_H
 
 #include "../3rd/http-parser/http_parser.h"
+#include "HttpHeaderMap.h"
 #include <boost/noncopyable.hpp>
+#include <boost/function.hpp>
+#include <boost/utility/string_ref.hpp>
 #include <string>
-#include <map>
+#include <vector>
+
+// Size limits checked while a request streams in, 0 means unlimited.
+// Header bytes count the request line and all header names and values.
+struct HttpLimits
+{
+    HttpLimits()
+        : maxUrlLength(8 * 1024),
+          maxHeaderBytes(64 * 1024),
+          maxBodySize(16 * 1024 * 1024)
+    { }
+
+    size_t maxUrlLength;
+    size_t maxHeaderBytes;
+    size_t maxBodySize;
+};
+
+typedef enum http_method HttpMethod;
+
+// Named path segments set by the router that matched the request. The
+// refs point into the url and the route patterns, capacity is fixed so
+// matching never allocates.
+class HttpPathParams
+{
+public:
+    const static size_t kMaxParams = 8;
+
+    HttpPathParams()
+        : m_size(0)
+    { }
+
+    bool Add(const boost::string_ref &name, const boost::string_ref &value)
+    {
+        if (m_size == kMaxParams)
+            return false;
+        m_names[m_size] = name;
+        m_values[m_size] = value;
+        ++m_size;
+        return true;
+    }
+
+    void Pop()
+    {
+        if (m_size)
+            --m_size;
+    }
+
+    void Clear()
+    {
+        m_size = 0;
+    }
+
+    size_t Size() const
+    {
+        return m_size;
+    }
+
+    boost::string_ref GetName(size_t i) const
+    {
+        return m_names[i];
+    }
+
+    boost::string_ref GetValue(size_t i) const
+    {
+        return m_values[i];
+    }
+
+    // Empty if absent
+    boost::string_ref Get(const boost::string_ref &name) const
+    {
+        for (size_t i = 0; i < m_size; ++i)
+        {
+            if (m_names[i] == name)
+                return m_values[i];
+        }
+        return boost::string_ref();
+    }
+
+private:
+    boost::string_ref m_names[kMaxParams];
+    boost::string_ref m_values[kMaxParams];
+    size_t m_size;
+};
 
 class HttpParser : private boost::noncopyable
 {
 public:
-    typedef std::map<std::string, std::string> HeaderMap;
+    typedef HttpHeaderMap HeaderMap;
+
+    // Called once the headers are in, before any body byte is accepted.
+    // The callee may change the limits of the current message, e.g. per route.
+    typedef boost::function< void(HttpLimits &) > HeadersCallback;
+
+    // Takes the body piece by piece instead of GetBody, false stops the
+    // parse with an error
+    typedef boost::function< bool(const char *, size_t) > BodyCallback;
 
     HttpParser();
 
-    bool Parse(const char *data, size_t len);
+    // Stops after a complete message, parsed tells how much of data
+    // was used. The rest belongs to the next message.
+    // Messages that end with the connection (a response without length)
+    // are completed by a Parse of len 0 once it is closed.
+    bool Parse(const char *data, size_t len, size_t *parsed = 0);
     bool IsComplete() const;
+    bool IsHeaderComplete() const;
+    // Forgets the message but keeps the capacity of every buffer,
+    // Shrink releases the ones that grew above threshold bytes.
     void Reset();
+    void Shrink(size_t threshold);
     const char * GetErrorDetail() const;
 
+    void SetLimits(const HttpLimits &limits);
+    const HttpLimits & GetLimits() const;
+    void SetHeadersCallback(const HeadersCallback &callback);
+    void SetBodyCallback(const BodyCallback &callback);
+
+    // For the response to a HEAD request, which has no body whatever its
+    // headers say. Only for the current message, Reset clears it.
+    void SetSkipBody(bool skip);
+
+    // The http status to reject the request with when Parse failed
+    // because of a limit, 0 otherwise.
+    int GetLimitStatus() const;
+
     const std::string & GetUrl() const;
+
+    // Parts of the url, split on first use. The refs stay valid until Reset.
+    boost::string_ref GetPath() const;
+    boost::string_ref GetQueryString() const;
+    boost::string_ref GetFragment() const;
+
+    // Percent-decoded query parameter, empty if absent
+    boost::string_ref GetQuery(const boost::string_ref &key) const;
+    bool HasQuery(const boost::string_ref &key) const;
+
+    // Routing happens on the const request, like the lazy url parts
+    void SetPathParams(const HttpPathParams &params) const;
+    const HttpPathParams & GetPathParams() const;
+    boost::string_ref GetPathParam(const boost::string_ref &name) const;
+
+    // Which route took the request, -1 until one did
+    void SetRouteId(int id) const;
+    int GetRouteId() const;
+
+    HttpMethod GetHttpMethod() const;
+    // Of a response, 0 for a request
+    int GetStatusCode() const;
+    // As given by the headers, ULLONG_MAX if they did not
+    unsigned long long GetContentLength() const;
+    // Whether the connection may carry another message after this one
+    bool ShouldKeepAlive() const;
     const std::string & GetMethod() const;
     const std::string & GetBody() const;
     const HeaderMap & GetHeaders() const;
@@ -34,24 +174,58 @@ private:
         HeaderState_HasAll = 0x11,
     };
 
+    struct QueryParam
+    {
+        size_t keyOffset;
+        size_t keyLength;
+        size_t valueOffset;
+        size_t valueLength;
+    };
+
+    typedef std::vector<QueryParam> QueryParams;
+
     bool HeaderReady() const;
+    bool CheckHeaderLimits();
+    void SplitUrl() const;
+    void IndexQuery() const;
+    const QueryParam * FindQuery(const boost::string_ref &key) const;
+    static size_t DecodeComponent(char *data, size_t length);
 
     static int OnUrl(http_parser* parser, const char* at, size_t length);
     static int OnHeaderName(http_parser* parser, const char* at, size_t length);
     static int OnHeaderValue(http_parser* parser, const char* at, size_t length);
+    static int OnHeadersComplete(http_parser* parser);
     static int OnBody(http_parser* parser, const char* at, size_t length);
     static int OnComplete(http_parser* parser);
 
     static http_parser_settings m_settings;
 
     std::string m_url;
-    std::string m_method;
+    mutable bool m_urlSplit;
+    mutable boost::string_ref m_path;
+    mutable boost::string_ref m_queryString;
+    mutable boost::string_ref m_fragment;
+    mutable bool m_queryIndexed;
+    mutable std::string m_queryDecoded;
+    mutable QueryParams m_queryParams;
+    mutable HttpPathParams m_pathParams;
+    mutable int m_routeId;
     HeaderState m_headerState;
     std::string m_headerName;
     std::string m_headerValue;
     HeaderMap m_headers;
     std::string m_body;
+    bool m_headerComplete;
     bool m_complete;
+    bool m_skipBody;
+    unsigned long long m_contentLength;
+
+    HttpLimits m_limits;
+    HttpLimits m_defaultLimits;
+    HeadersCallback m_headersCallback;
+    BodyCallback m_bodyCallback;
+    size_t m_headerBytes;
+    int m_limitStatus;
 
     http_parser m_httpParser;
 };
@@ -0,0 +1,669 @@
+#include "HttpProxy.h"
+#include "../CoarseClock.h"
+#include <boost/array.hpp>
+#include <boost/asio/spawn.hpp>
+#include <boost/bind.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/weak_ptr.hpp>
+#include <climits>
+#include <errno.h>
+#include <stdio.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <iostream>
+
+namespace
+{
+    // Hop-by-hop, or written by the proxy itself
+    const char *kSkippedRequestHeaders[] =
+    {
+        "Connection", "Keep-Alive", "Proxy-Connection", "Proxy-Authorization",
+        "TE", "Trailer", "Transfer-Encoding", "Upgrade", "Content-Length",
+        "Expect", 0
+    };
+
+    const char *kSkippedResponseHeaders[] =
+    {
+        "Connection", "Keep-Alive", "Proxy-Connection", "Proxy-Authenticate",
+        "TE", "Trailer", "Transfer-Encoding", "Upgrade", "Content-Length", 0
+    };
+
+    bool IsListed(const std::string &name, const char **list)
+    {
+        for (; *list; ++list)
+        {
+            if (strcasecmp(name.c_str(), *list) == 0)
+                return true;
+        }
+        return false;
+    }
+
+    // Safe to send again when a pooled connection turns out closed
+    bool IsIdempotent(HttpMethod method)
+    {
+        return method == HTTP_GET || method == HTTP_HEAD ||
+            method == HTTP_PUT || method == HTTP_DELETE ||
+            method == HTTP_OPTIONS || method == HTTP_TRACE;
+    }
+
+    bool HasBody(const HttpRequester &req)
+    {
+        HttpMethod method = req.GetHttpMethod();
+        return !req.GetBody().empty() || method == HTTP_POST ||
+            method == HTTP_PUT || method == HTTP_PATCH;
+    }
+
+    const size_t kReadSize = 16 * 1024;
+    // The upstream is not read while more than this waits for the client
+    const size_t kStreamHighWatermark = 256 * 1024;
+    // Waits for the client look at it again at least this often
+    const unsigned int kWaitMs = 1000;
+}
+
+// One forwarded request, run as a coroutine on the proxy's io_service
+class HttpProxyCall : public boost::enable_shared_from_this<HttpProxyCall>,
+                      private boost::noncopyable
+{
+public:
+    HttpProxyCall(HttpProxy &proxy, const HttpAsyncResponsePtr &async)
+        : m_proxy(proxy),
+          m_async(async),
+          m_upstream(0),
+          m_deadline(proxy.m_service),
+          m_event(proxy.m_service),
+          m_timedOut(false),
+          m_cancelled(false),
+          m_received(false),
+          m_handedOver(false),
+          m_streaming(false),
+          m_failed(false),
+          m_readBuffer(kReadSize)
+    {
+        HttpLimits limits;
+        limits.maxUrlLength = 0;
+        limits.maxBodySize = 0;
+        m_parser.SetLimits(limits);
+        m_parser.SetBodyCallback(
+            boost::bind(&HttpProxyCall::OnBody, this, _1, _2));
+    }
+
+    void Start()
+    {
+        boost::weak_ptr<HttpProxyCall> self(shared_from_this());
+        m_async->OnCancel(boost::bind(&HttpProxyCall::OnCancel, self));
+        boost::asio::spawn(m_proxy.m_service,
+                           boost::bind(&HttpProxyCall::Run,
+                                       shared_from_this(), _1));
+    }
+
+private:
+    enum Result
+    {
+        Result_Done,
+        // Nothing came back on a pooled connection, it was closed meanwhile
+        Result_Stale,
+        Result_Failed,
+    };
+
+    void Run(boost::asio::yield_context yield)
+    {
+        if (m_proxy.m_upstreams.empty())
+        {
+            Fail(HttpResponser::StatusCode_503ServiceUnavailable);
+            m_async.reset();
+            return;
+        }
+
+        m_upstream = m_proxy.Pick();
+        BuildRequest();
+
+        Result result = Result_Failed;
+        for (int attempt = 0; attempt < 2 && !m_cancelled; ++attempt)
+        {
+            m_connection = m_proxy.TakeIdle(m_upstream);
+            bool pooled = m_connection.get() != 0;
+            if (!pooled && !Connect(yield))
+                break;
+
+            result = Exchange(yield);
+            if (result != Result_Stale || !pooled ||
+                !IsIdempotent(m_async->Requester().GetHttpMethod()))
+                break;
+
+            boost::system::error_code ignoreError;
+            m_connection->socket.close(ignoreError);
+            m_connection.reset();
+        }
+
+        bool done = result == Result_Done;
+        m_proxy.Release(m_upstream, m_connection,
+                        done && m_parser.ShouldKeepAlive(),
+                        !done && !m_cancelled);
+        m_connection.reset();
+        if (!done && !m_cancelled)
+            Fail(m_timedOut ? HttpResponser::StatusCode_504GatewayTimeout :
+                 HttpResponser::StatusCode_502BadGateway);
+
+        // The stream callback may still hold this call, the response must
+        // not hold it back
+        m_async.reset();
+    }
+
+    bool Connect(boost::asio::yield_context yield)
+    {
+        HttpProxy::Upstream &upstream = m_proxy.m_upstreams[m_upstream];
+        ++upstream.connects;
+        m_connection.reset(new HttpProxy::Connection(m_proxy.m_service));
+
+        boost::system::error_code error;
+        Arm(m_proxy.m_options.connectTimeoutMs);
+        m_connection->socket.async_connect(upstream.endpoint, yield[error]);
+        Disarm();
+        if (error)
+        {
+            m_error = error;
+            return false;
+        }
+
+        m_connection->socket.set_option(
+            boost::asio::ip::tcp::no_delay(true), error);
+        return true;
+    }
+
+    // Sends the request and forwards the response
+    Result Exchange(boost::asio::yield_context yield)
+    {
+        const HttpRequester &req = m_async->Requester();
+        m_parser.Reset();
+        m_parser.SetSkipBody(req.GetHttpMethod() == HTTP_HEAD);
+        m_body.Clear();
+        m_received = false;
+
+        // The body goes out from the request's own buffer
+        boost::array<boost::asio::const_buffer, 2> request =
+        {{
+            boost::asio::buffer(m_head),
+            boost::asio::buffer(req.GetBody())
+        }};
+
+        boost::system::error_code error;
+        Arm(m_proxy.m_options.ioTimeoutMs);
+        boost::asio::async_write(m_connection->socket, request, yield[error]);
+        Disarm();
+        if (error)
+        {
+            m_error = error;
+            return m_timedOut || m_cancelled ? Result_Failed : Result_Stale;
+        }
+
+        while (1)
+        {
+            Arm(m_proxy.m_options.ioTimeoutMs);
+            size_t n = m_connection->socket.async_read_some(
+                boost::asio::buffer(m_readBuffer), yield[error]);
+            Disarm();
+            if (m_cancelled || m_timedOut)
+                return Result_Failed;
+
+            if (error)
+            {
+                m_error = error;
+                if (!m_received)
+                    return Result_Stale;
+                // A response without length ends with the connection
+                if (error != boost::asio::error::eof ||
+                    !m_parser.Parse(0, 0) || !m_parser.IsComplete())
+                    return Result_Failed;
+            }
+            else
+            {
+                m_received = true;
+                if (!Feed(&m_readBuffer[0], n))
+                    return Result_Failed;
+            }
+
+            if (m_parser.IsHeaderComplete() && !m_handedOver &&
+                !StartResponse())
+                return Result_Done;
+
+            if (m_streaming && !Flush(yield))
+                return Result_Failed;
+
+            if (m_parser.IsComplete())
+            {
+                if (m_stream)
+                    m_stream->End();
+                return Result_Done;
+            }
+
+            if (error)
+                return Result_Failed;
+        }
+    }
+
+    // Interim 1xx responses are dropped, only the final one is forwarded
+    bool Feed(const char *data, size_t len)
+    {
+        while (1)
+        {
+            size_t parsed = 0;
+            if (!m_parser.Parse(data, len, &parsed))
+            {
+                m_error = boost::asio::error::invalid_argument;
+                return false;
+            }
+            data += parsed;
+            len -= parsed;
+
+            if (!m_parser.IsComplete() || m_parser.GetStatusCode() >= 200)
+                break;
+
+            m_parser.Reset();
+            m_parser.SetSkipBody(
+                m_async->Requester().GetHttpMethod() == HTTP_HEAD);
+            if (!len)
+                break;
+        }
+
+        // Bytes behind the response would be taken for the next one, the
+        // connection cannot be kept
+        if (len)
+        {
+            boost::system::error_code ignoreError;
+            m_connection->socket.close(ignoreError);
+        }
+        return true;
+    }
+
+    // Copies the upstream's headers over. A complete response, or one
+    // short enough to wait for, is answered once it is in. Otherwise it
+    // is handed to the client now and the body streams. False once the
+    // response is complete.
+    bool StartResponse()
+    {
+        unsigned long long length = m_parser.GetContentLength();
+        bool whole = m_parser.IsComplete() ||
+            (length != ULLONG_MAX && length <= m_proxy.m_options.bufferBytes);
+        if (whole && !m_parser.IsComplete())
+            return true;
+
+        HttpResponser &resp = m_async->Responser();
+        resp.SetStatusCode(static_cast<HttpResponser::StatusCode>(
+            m_parser.GetStatusCode()));
+        const HttpParser::HeaderMap &headers = m_parser.GetHeaders();
+        for (HttpParser::HeaderMap::const_iterator it = headers.begin();
+             it != headers.end(); ++it)
+        {
+            if (!IsListed(it->first, kSkippedResponseHeaders))
+                resp.AddHeader(it->first, it->second);
+        }
+        // Bytes of unknown type may well be compressed already
+        if (!*resp.GetHeader("Content-Type"))
+            resp.SetCompressible(false);
+
+        m_handedOver = true;
+        if (whole)
+        {
+            resp.SetBody(m_body);
+            m_body.Clear();
+            m_async->Complete();
+            return false;
+        }
+
+        m_streaming = true;
+        resp.SetStreamCallback(boost::bind(&HttpProxyCall::OnStream,
+                                           shared_from_this(), _1));
+        m_async->Complete();
+        return true;
+    }
+
+    // Passes the body read so far on, once the client's connection got
+    // to this response and has room for it
+    bool Flush(boost::asio::yield_context yield)
+    {
+        while (!m_stream)
+        {
+            if (m_cancelled || m_async->IsCancelled())
+                return false;
+            Wait(yield);
+        }
+
+        if (!m_body.Empty() && m_stream->Write(m_body))
+            m_body.Clear();
+
+        while (m_stream->PendingBytes() > kStreamHighWatermark &&
+               !m_stream->IsClosed())
+        {
+            m_stream->OnDrain(boost::bind(
+                &HttpProxyCall::Wake,
+                boost::weak_ptr<HttpProxyCall>(shared_from_this())));
+            Wait(yield);
+        }
+
+        // Not the upstream's fault, the client went away
+        if (m_stream->IsClosed())
+            m_cancelled = true;
+        return !m_cancelled;
+    }
+
+    void Fail(int status)
+    {
+        m_failed = true;
+        if (m_error)
+            std::cerr << "proxy: " << (m_proxy.m_upstreams.empty() ? "" :
+                m_proxy.m_upstreams[m_upstream].address) << ": "
+                      << m_error.message() << std::endl;
+
+        if (m_handedOver)
+        {
+            // The status is out already, the client sees the body cut
+            if (m_stream)
+                m_stream->Abort();
+            return;
+        }
+
+        const char *message =
+            status == HttpResponser::StatusCode_504GatewayTimeout ?
+            "Gateway Timeout" :
+            status == HttpResponser::StatusCode_503ServiceUnavailable ?
+            "Service Unavailable" : "Bad Gateway";
+        HttpResponser &resp = m_async->Responser();
+        resp.SetStatusCode(static_cast<HttpResponser::StatusCode>(status));
+        resp.SetBody(std::string("{\"code\": -1, \"message\": \"") +
+                     message + "\"}\n");
+        m_async->Complete();
+    }
+
+    void BuildRequest()
+    {
+        const HttpRequester &req = m_async->Requester();
+        const HttpProxy::Upstream &upstream = m_proxy.m_upstreams[m_upstream];
+        bool preserveHost = m_proxy.m_options.preserveHost;
+
+        m_head.clear();
+        m_head.append(req.GetMethod());
+        m_head.append(" ");
+        m_head.append(req.GetUrl());
+        m_head.append(" HTTP/1.1\r\n");
+
+        bool hasHost = false;
+        std::string forwardedFor;
+        const HttpParser::HeaderMap &headers = req.GetHeaders();
+        for (HttpParser::HeaderMap::const_iterator it = headers.begin();
+             it != headers.end(); ++it)
+        {
+            if (strcasecmp(it->first.c_str(), "Host") == 0)
+            {
+                hasHost = true;
+                if (!preserveHost)
+                    continue;
+            }
+            else if (strcasecmp(it->first.c_str(), "X-Forwarded-For") == 0)
+            {
+                forwardedFor = it->second + ", ";
+                continue;
+            }
+            else if (IsListed(it->first, kSkippedRequestHeaders))
+            {
+                continue;
+            }
+
+            m_head.append(it->first);
+            m_head.append(": ");
+            m_head.append(it->second);
+            m_head.append("\r\n");
+        }
+
+        if (!hasHost || !preserveHost)
+        {
+            m_head.append("Host: ");
+            m_head.append(upstream.host);
+            m_head.append("\r\n");
+        }
+
+        if (!req.GetPeerIp().empty())
+        {
+            m_head.append("X-Forwarded-For: ");
+            m_head.append(forwardedFor);
+            m_head.append(req.GetPeerIp());
+            m_head.append("\r\n");
+        }
+
+        if (HasBody(req))
+        {
+            char buf[32];
+            snprintf(buf, sizeof(buf), "%lu",
+                     static_cast<unsigned long>(req.GetBody().size()));
+            m_head.append("Content-Length: ");
+            m_head.append(buf);
+            m_head.append("\r\n");
+        }
+
+        m_head.append("Connection: keep-alive\r\n\r\n");
+    }
+
+    bool OnBody(const char *data, size_t len)
+    {
+        m_body.Append(data, len);
+        return true;
+    }
+
+    void Arm(unsigned int timeoutMs)
+    {
+        if (!timeoutMs)
+            return;
+        m_deadline.expires_from_now(boost::posix_time::milliseconds(timeoutMs));
+        m_deadline.async_wait(boost::bind(&HttpProxyCall::OnDeadline,
+                                          shared_from_this(), _1));
+    }
+
+    void Disarm()
+    {
+        boost::system::error_code ignoreError;
+        m_deadline.cancel(ignoreError);
+    }
+
+    void OnDeadline(const boost::system::error_code &error)
+    {
+        if (error || !m_connection ||
+            m_deadline.expires_at() >
+            boost::asio::deadline_timer::traits_type::now())
+            return;
+
+        m_timedOut = true;
+        m_error = boost::asio::error::timed_out;
+        boost::system::error_code ignoreError;
+        m_connection->socket.close(ignoreError);
+    }
+
+    // Until Wake, or kWaitMs at most
+    void Wait(boost::asio::yield_context yield)
+    {
+        boost::system::error_code ignoreError;
+        m_event.expires_from_now(boost::posix_time::milliseconds(kWaitMs));
+        m_event.async_wait(yield[ignoreError]);
+    }
+
+    static void Wake(const boost::weak_ptr<HttpProxyCall> &call)
+    {
+        boost::shared_ptr<HttpProxyCall> self = call.lock();
+        if (self)
+        {
+            boost::system::error_code ignoreError;
+            self->m_event.cancel(ignoreError);
+        }
+    }
+
+    void OnStream(const HttpStreamPtr &stream)
+    {
+        m_stream = stream;
+        if (m_failed)
+            m_stream->Abort();
+
+        boost::system::error_code ignoreError;
+        m_event.cancel(ignoreError);
+    }
+
+    // The client went away, so does the upstream connection
+    static void OnCancel(const boost::weak_ptr<HttpProxyCall> &call)
+    {
+        boost::shared_ptr<HttpProxyCall> self = call.lock();
+        if (!self)
+            return;
+
+        self->m_cancelled = true;
+        boost::system::error_code ignoreError;
+        if (self->m_connection)
+            self->m_connection->socket.close(ignoreError);
+        self->m_event.cancel(ignoreError);
+    }
+
+    HttpProxy &m_proxy;
+    HttpAsyncResponsePtr m_async;
+    size_t m_upstream;
+    HttpProxy::ConnectionPtr m_connection;
+    std::string m_head;
+    HttpParser m_parser;
+    Buffer m_body;
+    HttpStreamPtr m_stream;
+    boost::asio::deadline_timer m_deadline;
+    boost::asio::deadline_timer m_event;
+    boost::system::error_code m_error;
+    bool m_timedOut;
+    bool m_cancelled;
+    bool m_received;
+    bool m_handedOver;
+    bool m_streaming;
+    bool m_failed;
+    std::vector<char> m_readBuffer;
+};
+
+HttpProxy::HttpProxy(boost::asio::io_service &service,
+                     const HttpProxyOptions &options)
+    : m_service(service),
+      m_options(options),
+      m_next(0)
+{ }
+
+bool HttpProxy::AddUpstream(const std::string &address)
+{
+    size_t colon = address.rfind(':');
+    if (colon == std::string::npos || colon == 0)
+        return false;
+
+    boost::system::error_code error;
+    boost::asio::ip::tcp::resolver resolver(m_service);
+    boost::asio::ip::tcp::resolver::query query(address.substr(0, colon),
+                                                address.substr(colon + 1));
+    boost::asio::ip::tcp::resolver::iterator it =
+        resolver.resolve(query, error);
+    if (error || it == boost::asio::ip::tcp::resolver::iterator())
+    {
+        std::cerr << "proxy: cannot resolve " << address << std::endl;
+        return false;
+    }
+
+    m_upstreams.push_back(Upstream());
+    Upstream &upstream = m_upstreams.back();
+    upstream.address = address;
+    upstream.host = address;
+    upstream.endpoint = *it;
+    return true;
+}
+
+void HttpProxy::Forward(const HttpRequester &req,
+                        const HttpAsyncResponsePtr &async)
+{
+    if (!async)
+        return;
+
+    boost::shared_ptr<HttpProxyCall> call(new HttpProxyCall(*this, async));
+    call->Start();
+}
+
+void HttpProxy::GetStats(std::vector<UpstreamStats> &stats) const
+{
+    stats.resize(m_upstreams.size());
+    for (size_t i = 0; i < m_upstreams.size(); ++i)
+    {
+        const Upstream &upstream = m_upstreams[i];
+        stats[i].address = upstream.address;
+        stats[i].active = upstream.active;
+        stats[i].idle = upstream.idle.size();
+        stats[i].requests = upstream.requests;
+        stats[i].connects = upstream.connects;
+        stats[i].failures = upstream.failures;
+    }
+}
+
+size_t HttpProxy::Pick()
+{
+    size_t count = m_upstreams.size();
+    size_t best = m_next++ % count;
+    if (m_options.balance == HttpBalance_LeastConnections)
+    {
+        size_t start = best;
+        for (size_t i = 1; i < count; ++i)
+        {
+            size_t index = (start + i) % count;
+            if (m_upstreams[index].active < m_upstreams[best].active)
+                best = index;
+        }
+    }
+
+    ++m_upstreams[best].active;
+    ++m_upstreams[best].requests;
+    return best;
+}
+
+HttpProxy::ConnectionPtr HttpProxy::TakeIdle(size_t index)
+{
+    Upstream &upstream = m_upstreams[index];
+    uint64_t now = CoarseClock::NowMs();
+    boost::system::error_code ignoreError;
+    while (!upstream.idle.empty())
+    {
+        ConnectionPtr connection = upstream.idle.back();
+        upstream.idle.pop_back();
+        if (now - connection->idleSinceMs < m_options.idleTimeoutMs &&
+            IsAlive(*connection))
+            return connection;
+        connection->socket.close(ignoreError);
+    }
+    return ConnectionPtr();
+}
+
+void HttpProxy::Release(size_t index, const ConnectionPtr &connection,
+                        bool reusable, bool failed)
+{
+    Upstream &upstream = m_upstreams[index];
+    --upstream.active;
+    if (failed)
+        ++upstream.failures;
+    if (!connection)
+        return;
+
+    boost::system::error_code ignoreError;
+    if (!reusable || !m_options.maxIdle || !connection->socket.is_open())
+    {
+        connection->socket.close(ignoreError);
+        return;
+    }
+
+    if (upstream.idle.size() >= m_options.maxIdle)
+    {
+        upstream.idle.front()->socket.close(ignoreError);
+        upstream.idle.pop_front();
+    }
+    connection->idleSinceMs = CoarseClock::NowMs();
+    upstream.idle.push_back(connection);
+}
+
+// An idle connection has nothing to read, unless the upstream closed it
+bool HttpProxy::IsAlive(Connection &connection)
+{
+    char c;
+    ssize_t n = ::recv(connection.socket.native_handle(), &c, 1,
+                       MSG_PEEK | MSG_DONTWAIT);
+    return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
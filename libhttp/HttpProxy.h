@@ -0,0 +1,129 @@
+#ifndef HTTP_PROXY_H
+#define HTTP_PROXY_H
+
+#include "HttpRequester.h"
+#include "HttpResponser.h"
+#include <boost/asio.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <stdint.h>
+#include <deque>
+#include <string>
+#include <vector>
+
+class HttpProxyCall;
+
+enum HttpBalance
+{
+    // Each request goes to the next upstream in turn
+    HttpBalance_RoundRobin,
+    // To the upstream with the fewest requests in flight, ties in turn
+    HttpBalance_LeastConnections,
+};
+
+struct HttpProxyOptions
+{
+    HttpProxyOptions()
+        : balance(HttpBalance_RoundRobin),
+          connectTimeoutMs(3000),
+          ioTimeoutMs(30000),
+          maxIdle(32),
+          idleTimeoutMs(60000),
+          bufferBytes(64 * 1024),
+          preserveHost(true)
+    { }
+
+    HttpBalance balance;
+    // 502 when the connect fails, 504 when it takes longer than
+    // connectTimeoutMs or an upstream read or write longer than ioTimeoutMs
+    unsigned int connectTimeoutMs;
+    unsigned int ioTimeoutMs;
+    // Keep-alive connections kept open per upstream, and for how long
+    size_t maxIdle;
+    unsigned int idleTimeoutMs;
+    // Responses up to this Content-Length are forwarded whole, larger
+    // ones and those without a length are streamed as they come in
+    size_t bufferBytes;
+    // Keeps the client's Host header, otherwise the upstream's address
+    bool preserveHost;
+};
+
+// Forwards requests to a set of upstream servers over keep-alive
+// connections it pools per upstream. Bind Forward as an async handler,
+// see HttpDispatch::AddProxyHandler. The request body has been read by
+// the server and is sent from its buffer, the response body streams
+// through to the client with the client's pace holding the upstream back.
+// Must be used from the io_service thread and outlive the requests.
+class HttpProxy : private boost::noncopyable
+{
+public:
+    struct UpstreamStats
+    {
+        std::string address;
+        size_t active;
+        size_t idle;
+        uint64_t requests;
+        uint64_t connects;
+        uint64_t failures;
+    };
+
+    HttpProxy(boost::asio::io_service &service,
+              const HttpProxyOptions &options = HttpProxyOptions());
+
+    // "host:port", resolved once here. False if it cannot be.
+    bool AddUpstream(const std::string &address);
+
+    void Forward(const HttpRequester &req, const HttpAsyncResponsePtr &async);
+
+    void GetStats(std::vector<UpstreamStats> &stats) const;
+
+private:
+    friend class HttpProxyCall;
+
+    struct Connection
+    {
+        explicit Connection(boost::asio::io_service &service)
+            : socket(service),
+              idleSinceMs(0)
+        { }
+
+        boost::asio::ip::tcp::socket socket;
+        uint64_t idleSinceMs;
+    };
+
+    typedef boost::shared_ptr<Connection> ConnectionPtr;
+
+    struct Upstream
+    {
+        Upstream()
+            : active(0),
+              requests(0),
+              connects(0),
+              failures(0)
+        { }
+
+        std::string address;
+        std::string host;
+        boost::asio::ip::tcp::endpoint endpoint;
+        // Oldest first, taken from the back
+        std::deque<ConnectionPtr> idle;
+        size_t active;
+        uint64_t requests;
+        uint64_t connects;
+        uint64_t failures;
+    };
+
+    size_t Pick();
+    ConnectionPtr TakeIdle(size_t upstream);
+    // Keeps connection for the next request if reusable
+    void Release(size_t upstream, const ConnectionPtr &connection,
+                 bool reusable, bool failed);
+    static bool IsAlive(Connection &connection);
+
+    boost::asio::io_service &m_service;
+    HttpProxyOptions m_options;
+    std::vector<Upstream> m_upstreams;
+    size_t m_next;
+};
+
+#endif // HTTP_PROXY_H
@@ -2,19 +2,21 @@
 #define HTTP_REQUESTER_H
 
 #include "HttpParser.h"
+#include "HttpArena.h"
 
 class HttpRequester : private boost::noncopyable
 {
 public:
     HttpRequester()
+        : m_peerPort(0)
     { }
 
     ~HttpRequester()
     { }
 
-    bool Parse(const char *data, size_t len)
+    bool Parse(const char *data, size_t len, size_t *parsed = 0)
     {
-        return m_httpParser.Parse(data, len);
+        return m_httpParser.Parse(data, len, parsed);
     }
 
     bool IsComplete() const
@@ -25,6 +27,42 @@ public:
     void Reset()
     {
         m_httpParser.Reset();
+        m_arena.Reset();
+    }
+
+    void Shrink(size_t threshold)
+    {
+        m_httpParser.Shrink(threshold);
+        m_arena.Shrink(threshold);
+    }
+
+    // Scratch memory of the request, released at once when the connection
+    // moves on to the next one. It lasts until the response is serialized,
+    // for a deferred request until its response is complete. Streams must
+    // not keep any of it.
+    HttpMemoryResource & GetArena() const
+    {
+        return m_arena;
+    }
+
+    void SetLimits(const HttpLimits &limits)
+    {
+        m_httpParser.SetLimits(limits);
+    }
+
+    const HttpLimits & GetLimits() const
+    {
+        return m_httpParser.GetLimits();
+    }
+
+    void SetHeadersCallback(const HttpParser::HeadersCallback &callback)
+    {
+        m_httpParser.SetHeadersCallback(callback);
+    }
+
+    int GetLimitStatus() const
+    {
+        return m_httpParser.GetLimitStatus();
     }
 
     const std::string & GetUrl() const
@@ -32,6 +70,62 @@ public:
         return m_httpParser.GetUrl();
     }
 
+    boost::string_ref GetPath() const
+    {
+        return m_httpParser.GetPath();
+    }
+
+    boost::string_ref GetQueryString() const
+    {
+        return m_httpParser.GetQueryString();
+    }
+
+    boost::string_ref GetFragment() const
+    {
+        return m_httpParser.GetFragment();
+    }
+
+    boost::string_ref GetQuery(const boost::string_ref &key) const
+    {
+        return m_httpParser.GetQuery(key);
+    }
+
+    bool HasQuery(const boost::string_ref &key) const
+    {
+        return m_httpParser.HasQuery(key);
+    }
+
+    void SetPathParams(const HttpPathParams &params) const
+    {
+        m_httpParser.SetPathParams(params);
+    }
+
+    const HttpPathParams & GetPathParams() const
+    {
+        return m_httpParser.GetPathParams();
+    }
+
+    // e.g. "id" of a "/users/:id" route
+    boost::string_ref GetPathParam(const boost::string_ref &name) const
+    {
+        return m_httpParser.GetPathParam(name);
+    }
+
+    void SetRouteId(int id) const
+    {
+        m_httpParser.SetRouteId(id);
+    }
+
+    int GetRouteId() const
+    {
+        return m_httpParser.GetRouteId();
+    }
+
+    HttpMethod GetHttpMethod() const
+    {
+        return m_httpParser.GetHttpMethod();
+    }
+
     const std::string & GetMethod() const
     {
         return m_httpParser.GetMethod();
@@ -84,6 +178,7 @@ public:
 
 private:
     HttpParser m_httpParser;
+    mutable HttpArena m_arena;
     std::string m_peerIp;
     unsigned short m_peerPort;
 };
@@ -0,0 +1,313 @@
+#include "HttpResponseCache.h"
+#include "HttpBodyHash.h"
+#include "HttpFormat.h"
+#include "HttpDate.h"
+#include "../CoarseClock.h"
+#include <strings.h>
+#include <string.h>
+#include <stdlib.h>
+
+namespace
+{
+    // Fixed, so every process behind a balancer gives the same ETag
+    const uint64_t kEtagSeed = 0x6a09e667f3bcc908ULL;
+
+    // Table and list nodes on top of the bytes themselves
+    const size_t kEntryOverhead = 128;
+
+    void Trim(const char *&begin, const char *&end)
+    {
+        while (begin < end && (*begin == ' ' || *begin == '\t'))
+            ++begin;
+        while (end > begin && (end[-1] == ' ' || end[-1] == '\t'))
+            --end;
+    }
+
+    bool TokenIs(const char *begin, const char *end, const char *token)
+    {
+        size_t len = strlen(token);
+        return static_cast<size_t>(end - begin) == len &&
+            strncasecmp(begin, token, len) == 0;
+    }
+
+    // Value of "name=N" in [begin, end), -1 if it is something else
+    long ParseSeconds(const char *begin, const char *end, const char *name)
+    {
+        size_t len = strlen(name);
+        if (static_cast<size_t>(end - begin) <= len ||
+            strncasecmp(begin, name, len) != 0 || begin[len] != '=')
+            return -1;
+
+        long seconds = 0;
+        for (const char *p = begin + len + 1; p < end; ++p)
+        {
+            if (*p < '0' || *p > '9')
+                return -1;
+            if (seconds < 100000000)
+                seconds = seconds * 10 + (*p - '0');
+        }
+        return seconds;
+    }
+}
+
+HttpResponseCache::HttpResponseCache()
+    : m_size(0)
+{ }
+
+void HttpResponseCache::SetOptions(const HttpCacheOptions &options)
+{
+    m_options = options;
+    Clear();
+}
+
+const HttpCacheOptions & HttpResponseCache::GetOptions() const
+{
+    return m_options;
+}
+
+void HttpResponseCache::Clear() const
+{
+    boost::mutex::scoped_lock lock(m_mutex);
+    m_list.clear();
+    m_map.clear();
+    m_size = 0;
+}
+
+bool HttpResponseCache::MakeKey(const HttpRequester &req,
+                                HttpEncoding accepted,
+                                std::string &key) const
+{
+    if (!m_options.enabled || req.GetHttpMethod() != HTTP_GET)
+        return false;
+
+    // Answers for one user are not for everybody else
+    if (*req.GetHeader("Authorization"))
+        return false;
+
+    // The stored bytes are already compressed for one encoding
+    key.assign(req.GetUrl());
+    key.push_back('\0');
+    key.push_back(static_cast<char>('0' + accepted));
+    for (size_t i = 0; i < m_options.varyHeaders.size(); ++i)
+    {
+        key.push_back('\0');
+        key.append(req.GetHeader(m_options.varyHeaders[i]));
+    }
+    return true;
+}
+
+bool HttpResponseCache::Find(const std::string &key, Buffer &response,
+                             std::string &etag, int *route) const
+{
+    boost::mutex::scoped_lock lock(m_mutex);
+    EntryMap::iterator found = m_map.find(key);
+    if (found == m_map.end())
+        return false;
+
+    EntryList::iterator it = found->second;
+    if (it->expires <= CoarseClock::NowMs())
+    {
+        Erase(it);
+        return false;
+    }
+
+    m_list.splice(m_list.begin(), m_list, it);
+    response.Append(it->head);
+    size_t length;
+    const char *line = HttpDate::GetHeaderLine(&length);
+    response.Append(line, length);
+
+    char buf[32];
+    uint64_t now = CoarseClock::NowMs();
+    uint64_t age = now > it->stored ? (now - it->stored) / 1000 : 0;
+    response.Append("Age: ", 5);
+    response.Append(buf, FormatDecimal(buf, age));
+    response.Append("\r\n", 2);
+    response.Append(it->tail);
+    etag = it->etag;
+    *route = it->route;
+    return true;
+}
+
+unsigned int HttpResponseCache::GetTtl(const HttpResponser &resp) const
+{
+    // A closing response has no length, so it only fits its own request
+    if (resp.GetStatusCode() != HttpResponser::StatusCode_200Ok ||
+        resp.IsStreaming() || resp.CloseConnection() ||
+        resp.GetBodySize() > m_options.maxEntryBytes ||
+        *resp.GetHeader("Set-Cookie"))
+        return 0;
+
+    const char *p = resp.GetHeader("Cache-Control");
+    if (!*p)
+        return m_options.defaultTtl;
+
+    long maxAge = -1;
+    long sharedMaxAge = -1;
+    while (*p)
+    {
+        const char *end = strchr(p, ',');
+        if (!end)
+            end = p + strlen(p);
+
+        const char *token = p;
+        const char *tokenEnd = end;
+        Trim(token, tokenEnd);
+        if (TokenIs(token, tokenEnd, "no-store") ||
+            TokenIs(token, tokenEnd, "no-cache") ||
+            TokenIs(token, tokenEnd, "private"))
+            return 0;
+
+        long seconds = ParseSeconds(token, tokenEnd, "max-age");
+        if (seconds >= 0)
+            maxAge = seconds;
+        seconds = ParseSeconds(token, tokenEnd, "s-maxage");
+        if (seconds >= 0)
+            sharedMaxAge = seconds;
+
+        p = *end ? end + 1 : end;
+    }
+
+    if (sharedMaxAge >= 0)
+        return static_cast<unsigned int>(sharedMaxAge);
+    if (maxAge >= 0)
+        return static_cast<unsigned int>(maxAge);
+    return m_options.defaultTtl;
+}
+
+void HttpResponseCache::Store(const std::string &key, const Buffer &response,
+                              const std::string &etag, unsigned int ttl,
+                              int route) const
+{
+    size_t size = key.size() + response.Size() + etag.size() + kEntryOverhead;
+    if (!ttl || size > m_options.maxEntryBytes + kEntryOverhead ||
+        size > m_options.maxBytes)
+        return;
+
+    Entry split;
+    if (!SplitAtDate(response, split))
+        return;
+
+    boost::mutex::scoped_lock lock(m_mutex);
+    EntryMap::iterator found = m_map.find(key);
+    if (found != m_map.end())
+        Erase(found->second);
+
+    while (!m_list.empty() && m_size + size > m_options.maxBytes)
+        Erase(--m_list.end());
+
+    m_list.push_front(Entry());
+    Entry &entry = m_list.front();
+    entry.key = key;
+    entry.head.Append(split.head);
+    entry.tail.Append(split.tail);
+    entry.etag = etag;
+    entry.stored = CoarseClock::NowMs();
+    entry.expires = entry.stored + ttl * 1000ULL;
+    entry.size = size;
+    entry.route = route;
+    m_map[key] = m_list.begin();
+    m_size += size;
+}
+
+std::string HttpResponseCache::MakeEtag(const HttpResponser &resp,
+                                        HttpEncoding encoding)
+{
+    HttpBodyHash hash(kEtagSeed);
+    const std::string &body = resp.GetBody();
+    hash.Update(body.data(), body.size());
+    const Buffer &shared = resp.GetSharedBody();
+    for (size_t i = 0; i < shared.SegmentCount(); ++i)
+        hash.Update(shared.SegmentData(i), shared.SegmentSize(i));
+
+    char buf[32];
+    std::string etag("\"");
+    etag.append(buf, FormatHex(buf, hash.Final()));
+    if (encoding != HttpEncoding_Identity)
+    {
+        etag.push_back('-');
+        etag.append(HttpCompressor::GetEncodingName(encoding));
+    }
+    etag.push_back('"');
+    return etag;
+}
+
+bool HttpResponseCache::MatchesEtag(const char *ifNoneMatch,
+                                    const std::string &etag)
+{
+    // Weak comparison, as If-None-Match asks for
+    const char *tag = etag.c_str();
+    size_t tagLength = etag.size();
+    if (tagLength >= 2 && strncmp(tag, "W/", 2) == 0)
+    {
+        tag += 2;
+        tagLength -= 2;
+    }
+
+    const char *p = ifNoneMatch;
+    while (*p)
+    {
+        const char *end = strchr(p, ',');
+        if (!end)
+            end = p + strlen(p);
+
+        const char *token = p;
+        const char *tokenEnd = end;
+        Trim(token, tokenEnd);
+        if (tokenEnd - token >= 2 && strncmp(token, "W/", 2) == 0)
+            token += 2;
+
+        if ((tokenEnd - token == 1 && *token == '*') ||
+            (static_cast<size_t>(tokenEnd - token) == tagLength &&
+             strncmp(token, tag, tagLength) == 0))
+            return true;
+
+        p = *end ? end + 1 : end;
+    }
+    return false;
+}
+
+bool HttpResponseCache::SplitAtDate(const Buffer &response, Entry &entry)
+{
+    // Only the headers are copied to look at, the body stays shared
+    std::string headers;
+    size_t end = std::string::npos;
+    for (size_t i = 0; i < response.SegmentCount(); ++i)
+    {
+        size_t from = headers.size() < 3 ? 0 : headers.size() - 3;
+        headers.append(response.SegmentData(i), response.SegmentSize(i));
+        end = headers.find("\r\n\r\n", from);
+        if (end != std::string::npos)
+            break;
+    }
+    if (end == std::string::npos)
+        return false;
+
+    // Without a Date line the fresh one goes before the blank line
+    size_t cut = end + 2;
+    size_t skip = 0;
+    size_t line = headers.find("\r\n") + 2;
+    while (line < end + 2)
+    {
+        size_t next = headers.find("\r\n", line) + 2;
+        if (strncasecmp(headers.data() + line, "Date:", 5) == 0)
+        {
+            cut = line;
+            skip = next - line;
+            break;
+        }
+        line = next;
+    }
+
+    entry.head.Append(headers.data(), cut);
+    entry.tail.Append(response);
+    entry.tail.Consume(cut + skip);
+    return true;
+}
+
+void HttpResponseCache::Erase(EntryList::iterator it) const
+{
+    m_size -= it->size;
+    m_map.erase(it->key);
+    m_list.erase(it);
+}
@@ -0,0 +1,101 @@
+#ifndef HTTP_RESPONSE_CACHE_H
+#define HTTP_RESPONSE_CACHE_H
+
+#include "HttpRequester.h"
+#include "HttpResponser.h"
+#include "HttpCompressor.h"
+#include "../Buffer.h"
+#include <boost/noncopyable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/unordered_map.hpp>
+#include <stdint.h>
+#include <list>
+#include <string>
+#include <vector>
+
+struct HttpCacheOptions
+{
+    HttpCacheOptions()
+        : enabled(false),
+          maxBytes(64 * 1024 * 1024),
+          maxEntryBytes(1024 * 1024),
+          defaultTtl(0)
+    { }
+
+    bool enabled;
+    // Serialized responses are kept up to this many bytes, least
+    // recently used ones go first
+    size_t maxBytes;
+    size_t maxEntryBytes;
+    // Seconds for a response without max-age, 0 only keeps those a
+    // handler marked with Cache-Control
+    unsigned int defaultTtl;
+    // Request headers that select a different response for the same url
+    std::vector<std::string> varyHeaders;
+};
+
+// Fully serialized GET responses, after compression, so a hit skips the
+// handler and the serializer and only queues shared blocks
+class HttpResponseCache : private boost::noncopyable
+{
+public:
+    HttpResponseCache();
+
+    void SetOptions(const HttpCacheOptions &options);
+    const HttpCacheOptions & GetOptions() const;
+
+    // Drops every entry, for when the data behind them changed
+    void Clear() const;
+
+    // False if the request may neither be answered from the cache nor
+    // have its response stored
+    bool MakeKey(const HttpRequester &req, HttpEncoding accepted,
+                 std::string &key) const;
+
+    // A fresh keep-alive response, its ETag and the route that made it.
+    // The response is dated now and says its Age.
+    bool Find(const std::string &key, Buffer &response,
+              std::string &etag, int *route) const;
+
+    // Seconds resp may be kept for, 0 if it must not be stored
+    unsigned int GetTtl(const HttpResponser &resp) const;
+
+    void Store(const std::string &key, const Buffer &response,
+               const std::string &etag, unsigned int ttl, int route) const;
+
+    // Strong validator over the body as sent, each encoding gets its
+    // own as the bytes differ
+    static std::string MakeEtag(const HttpResponser &resp,
+                                HttpEncoding encoding);
+    static bool MatchesEtag(const char *ifNoneMatch, const std::string &etag);
+
+private:
+    // The response without its Date line, head is what came before it
+    struct Entry
+    {
+        std::string key;
+        Buffer head;
+        Buffer tail;
+        std::string etag;
+        uint64_t stored;
+        uint64_t expires;
+        size_t size;
+        int route;
+    };
+
+    typedef std::list<Entry> EntryList;
+    typedef boost::unordered_map<std::string, EntryList::iterator> EntryMap;
+
+    void Erase(EntryList::iterator it) const;
+    static bool SplitAtDate(const Buffer &response, Entry &entry);
+
+    HttpCacheOptions m_options;
+
+    // Front is the most recently used
+    mutable boost::mutex m_mutex;
+    mutable EntryList m_list;
+    mutable EntryMap m_map;
+    mutable size_t m_size;
+};
+
+#endif // HTTP_RESPONSE_CACHE_H
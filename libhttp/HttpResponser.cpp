@@ -0,0 +1,146 @@
+#include "HttpResponser.h"
+#include "HttpFormat.h"
+#include "HttpDate.h"
+
+#define APPEND_LITERAL(output, literal) \
+    AppendBytes(output, literal, sizeof(literal) - 1)
+
+namespace
+{
+    inline void AppendBytes(std::string &output, const char *data, size_t len)
+    {
+        output.append(data, len);
+    }
+
+    inline void AppendBytes(Buffer &output, const char *data, size_t len)
+    {
+        output.Append(data, len);
+    }
+
+    template <class Output>
+    inline void AppendBytes(Output &output, const std::string &data)
+    {
+        AppendBytes(output, data.data(), data.size());
+    }
+}
+
+bool HttpResponser::GetStatusLine(int code, const char **line,
+                                  size_t *length)
+{
+    switch (code)
+    {
+#define XX(num, name, string)                                   \
+    case num:                                                   \
+        *line = "HTTP/1.1 " #num " " string "\r\n";             \
+        *length = sizeof("HTTP/1.1 " #num " " string "\r\n") - 1; \
+        return true;
+    HTTP_STATUS_MAP(XX)
+#undef XX
+    default:
+        return false;
+    }
+}
+
+void HttpResponser::AppendToBuffer(std::string &output) const
+{
+    if (m_static)
+    {
+        m_static->AppendTo(output, m_closeConnection);
+        return;
+    }
+
+    output.reserve(output.size() + GetBodySize() + 256);
+    AppendHeaders(output);
+    if (IsStreaming())
+        return;
+
+    output.append(m_body);
+    m_sharedBody.AppendTo(output);
+}
+
+void HttpResponser::AppendToBuffer(Buffer &output)
+{
+    if (m_static)
+    {
+        m_static->AppendTo(output, m_closeConnection);
+        return;
+    }
+
+    SerializeHeaders(output);
+    if (IsStreaming())
+        return;
+
+    if (!m_sharedBody.Empty())
+        output.Append(m_sharedBody);
+    else if (m_body.size() <= kInlineBodySize)
+        output.Append(m_body);
+    else
+        output.Take(m_body);
+}
+
+void HttpResponser::AppendHeaders(std::string &output) const
+{
+    SerializeHeaders(output);
+}
+
+template <class Output>
+void HttpResponser::SerializeHeaders(Output &output) const
+{
+    const char *line;
+    size_t length;
+    char buf[32];
+    if (m_statusMessage.empty() && GetStatusLine(m_statusCode, &line, &length))
+    {
+        AppendBytes(output, line, length);
+    }
+    else
+    {
+        APPEND_LITERAL(output, "HTTP/1.1 ");
+        AppendBytes(output, buf, FormatDecimal(buf, m_statusCode));
+        APPEND_LITERAL(output, " ");
+        AppendBytes(output, m_statusMessage);
+        APPEND_LITERAL(output, "\r\n");
+    }
+
+    if (IsStreaming())
+    {
+        APPEND_LITERAL(output, "Transfer-Encoding: chunked\r\n");
+        if (m_closeConnection)
+            APPEND_LITERAL(output, "Connection: close\r\n");
+        else
+            APPEND_LITERAL(output, "Connection: Keep-Alive\r\n");
+    }
+    else if (m_closeConnection)
+    {
+        APPEND_LITERAL(output, "Connection: close\r\n");
+    }
+    else if (m_statusCode == StatusCode_304NotModified ||
+             m_statusCode == StatusCode_204NoContent)
+    {
+        // Never has a body, a length would describe the one not sent
+        APPEND_LITERAL(output, "Connection: Keep-Alive\r\n");
+    }
+    else
+    {
+        APPEND_LITERAL(output, "Content-Length: ");
+        AppendBytes(output, buf, FormatDecimal(buf, GetBodySize()));
+        APPEND_LITERAL(output, "\r\nConnection: Keep-Alive\r\n");
+    }
+
+    if (m_headers.find("Date") == m_headers.end())
+    {
+        line = HttpDate::GetHeaderLine(&length);
+        AppendBytes(output, line, length);
+    }
+
+    for (HttpHeaderMap::const_iterator it = m_headers.begin();
+         it != m_headers.end(); ++it)
+    {
+        AppendBytes(output, it->first);
+        APPEND_LITERAL(output, ": ");
+        AppendBytes(output, it->second);
+        APPEND_LITERAL(output, "\r\n");
+    }
+
+    APPEND_LITERAL(output, "\r\n");
+}
@@ -1,35 +1,144 @@
 #ifndef HTTP_RESPONSER_H
 #define HTTP_RESPONSER_H
 
+#include "HttpStream.h"
+#include "HttpAsyncResponse.h"
+#include "HttpHeaderMap.h"
+#include "HttpStaticResponse.h"
+#include "HttpArena.h"
+#include "../Buffer.h"
 #include <boost/noncopyable.hpp>
-#include <stdio.h>
+#include <boost/weak_ptr.hpp>
 #include <string>
-#include <map>
+#include <vector>
+
+// Standard status codes: number, enum suffix, reason phrase
+#define HTTP_STATUS_MAP(XX)                                                   \
+    XX(100, Continue, "Continue")                                             \
+    XX(101, SwitchingProtocols, "Switching Protocols")                        \
+    XX(102, Processing, "Processing")                                         \
+    XX(103, EarlyHints, "Early Hints")                                        \
+    XX(200, Ok, "OK")                                                         \
+    XX(201, Created, "Created")                                               \
+    XX(202, Accepted, "Accepted")                                             \
+    XX(203, NonAuthoritativeInformation, "Non-Authoritative Information")     \
+    XX(204, NoContent, "No Content")                                          \
+    XX(205, ResetContent, "Reset Content")                                    \
+    XX(206, PartialContent, "Partial Content")                                \
+    XX(207, MultiStatus, "Multi-Status")                                      \
+    XX(208, AlreadyReported, "Already Reported")                              \
+    XX(226, IMUsed, "IM Used")                                                \
+    XX(300, MultipleChoices, "Multiple Choices")                              \
+    XX(301, MovedPermanently, "Moved Permanently")                            \
+    XX(302, Found, "Found")                                                   \
+    XX(303, SeeOther, "See Other")                                            \
+    XX(304, NotModified, "Not Modified")                                      \
+    XX(305, UseProxy, "Use Proxy")                                            \
+    XX(307, TemporaryRedirect, "Temporary Redirect")                          \
+    XX(308, PermanentRedirect, "Permanent Redirect")                          \
+    XX(400, BadRequest, "Bad Request")                                        \
+    XX(401, Unauthorized, "Unauthorized")                                     \
+    XX(402, PaymentRequired, "Payment Required")                              \
+    XX(403, Forbidden, "Forbidden")                                           \
+    XX(404, NotFound, "Not Found")                                            \
+    XX(405, MethodNotAllowed, "Method Not Allowed")                           \
+    XX(406, NotAcceptable, "Not Acceptable")                                  \
+    XX(407, ProxyAuthenticationRequired, "Proxy Authentication Required")     \
+    XX(408, RequestTimeout, "Request Timeout")                                \
+    XX(409, Conflict, "Conflict")                                             \
+    XX(410, Gone, "Gone")                                                     \
+    XX(411, LengthRequired, "Length Required")                                \
+    XX(412, PreconditionFailed, "Precondition Failed")                        \
+    XX(413, PayloadTooLarge, "Payload Too Large")                             \
+    XX(414, URITooLong, "URI Too Long")                                       \
+    XX(415, UnsupportedMediaType, "Unsupported Media Type")                   \
+    XX(416, RangeNotSatisfiable, "Range Not Satisfiable")                     \
+    XX(417, ExpectationFailed, "Expectation Failed")                          \
+    XX(421, MisdirectedRequest, "Misdirected Request")                        \
+    XX(422, UnprocessableEntity, "Unprocessable Entity")                      \
+    XX(423, Locked, "Locked")                                                 \
+    XX(424, FailedDependency, "Failed Dependency")                            \
+    XX(425, TooEarly, "Too Early")                                            \
+    XX(426, UpgradeRequired, "Upgrade Required")                              \
+    XX(428, PreconditionRequired, "Precondition Required")                    \
+    XX(429, TooManyRequests, "Too Many Requests")                             \
+    XX(431, RequestHeaderFieldsTooLarge, "Request Header Fields Too Large")   \
+    XX(451, UnavailableForLegalReasons, "Unavailable For Legal Reasons")      \
+    XX(500, InternalServerError, "Internal Server Error")                     \
+    XX(501, NotImplemented, "Not Implemented")                                \
+    XX(502, BadGateway, "Bad Gateway")                                        \
+    XX(503, ServiceUnavailable, "Service Unavailable")                        \
+    XX(504, GatewayTimeout, "Gateway Timeout")                                \
+    XX(505, HttpVersionNotSupported, "HTTP Version Not Supported")            \
+    XX(506, VariantAlsoNegotiates, "Variant Also Negotiates")                 \
+    XX(507, InsufficientStorage, "Insufficient Storage")                      \
+    XX(508, LoopDetected, "Loop Detected")                                    \
+    XX(510, NotExtended, "Not Extended")                                      \
+    XX(511, NetworkAuthenticationRequired, "Network Authentication Required")
 
 class HttpResponser : private boost::noncopyable
 {
 public:
+    typedef boost::function< void(const HttpRequester &,
+                                  HttpResponser &) > FinishCallback;
+
     enum StatusCode
     {
         StatusCode_Unknown,
-        StatusCode_200Ok = 200,
-        StatusCode_301MovedPermanently = 301,
-        StatusCode_400BadRequest = 400,
-        StatusCode_404NotFound = 404,
+#define XX(num, name, string) StatusCode_##num##name = num,
+        HTTP_STATUS_MAP(XX)
+#undef XX
     };
 
+    // Pre-rendered "HTTP/1.1 NNN Reason\r\n", false for unknown codes
+    static bool GetStatusLine(int code, const char **line, size_t *length);
+
     explicit HttpResponser(bool close)
         : m_statusCode(StatusCode_Unknown),
-          m_closeConnection(close)
+          m_closeConnection(close),
+          m_compressible(true),
+          m_arena(0),
+          m_deferred(false)
     { }
 
+    // Prepares for the next response on the connection, keeping capacity
+    void Reset(bool close)
+    {
+        m_headers.clear();
+        m_statusCode = StatusCode_Unknown;
+        m_statusMessage.clear();
+        m_closeConnection = close;
+        m_body.clear();
+        m_sharedBody.Clear();
+        m_compressible = true;
+        m_streamCallback.clear();
+        m_static.reset();
+        m_deferred = false;
+        m_async.reset();
+        m_finishCallbacks.clear();
+    }
+
+    void Shrink(size_t threshold)
+    {
+        m_headers.Shrink(threshold);
+        HttpHeaderMap::ShrinkString(m_statusMessage, threshold);
+        HttpHeaderMap::ShrinkString(m_body, threshold);
+    }
+
     void SetStatusCode(StatusCode code)
     {
+        Thaw();
         m_statusCode = code;
     }
 
+    StatusCode GetStatusCode() const
+    {
+        return m_statusCode;
+    }
+
     void SetStatusMessage(const std::string &message)
     {
+        Thaw();
         m_statusMessage = message;
     }
 
@@ -50,53 +159,243 @@ public:
 
     void AddHeader(const std::string &key, const std::string &value)
     {
+        Thaw();
         m_headers[key] = value;
     }
 
+    const char * GetHeader(const std::string &key) const
+    {
+        if (m_static)
+            return m_static->GetSource().GetHeader(key);
+
+        HttpHeaderMap::const_iterator it = m_headers.find(key);
+        if (it != m_headers.end())
+            return it->second.c_str();
+        return "";
+    }
+
     void SetBody(const std::string &body)
     {
+        Thaw();
         m_body = body;
+        m_sharedBody.Clear();
     }
 
-    // FIXME: not only support string
-    void AppendToBuffer(std::string &output) const
+    // Takes the body over without copying it, body gets the old storage
+    void SwapBody(std::string &body)
     {
-        char buf[32];
-        snprintf(buf, sizeof buf, "HTTP/1.1 %d ", m_statusCode);
-        output.append(buf);
-        output.append(m_statusMessage);
-        output.append("\r\n");
+        Thaw();
+        m_body.swap(body);
+        m_sharedBody.Clear();
+    }
 
-        if (m_closeConnection)
-        {
-            output.append("Connection: close\r\n");
-        }
-        else
+    // Refers to the blocks of body, which are shared and never copied
+    void SetBody(const Buffer &body)
+    {
+        Thaw();
+        m_body.clear();
+        m_sharedBody.Clear();
+        m_sharedBody.Append(body);
+    }
+
+    // The body is either an owned string or shared blocks
+    const std::string & GetBody() const
+    {
+        return m_body;
+    }
+
+    const Buffer & GetSharedBody() const
+    {
+        return m_sharedBody;
+    }
+
+    // Moves an owned body into shared blocks, so copies of this
+    // response refer to it instead of copying it
+    void ShareBody()
+    {
+        if (!m_body.empty())
         {
-            snprintf(buf, sizeof buf, "Content-Length: %zd\r\n", m_body.size());
-            output.append(buf);
-            output.append("Connection: Keep-Alive\r\n");
+            Buffer body;
+            body.Take(m_body);
+            body.Append(m_sharedBody);
+            m_sharedBody.Clear();
+            m_sharedBody.Append(body);
+            m_body.clear();
         }
+    }
+
+    // Answers with response as it was rendered. Only the connection flag
+    // still counts, it picks the Connection header. Changing anything
+    // else turns it back into an ordinary response with the same status,
+    // headers and body, and so do headers or a status message set
+    // before, which are kept on top of it.
+    void SetStaticResponse(const HttpStaticResponsePtr &response)
+    {
+        m_static = response;
+        m_statusCode = static_cast<StatusCode>(response->GetStatusCode());
+        if (m_headers.empty() && m_statusMessage.empty())
+            return;
+
+        HttpHeaderMap headers(m_headers);
+        std::string message(m_statusMessage);
+        Thaw();
+        for (HttpHeaderMap::const_iterator it = headers.begin();
+             it != headers.end(); ++it)
+            m_headers[it->first] = it->second;
+        if (!message.empty())
+            m_statusMessage = message;
+    }
+
+    const HttpStaticResponsePtr & GetStaticResponse() const
+    {
+        return m_static;
+    }
+
+    // Status, headers and body of other, the connection flag stays
+    void CopyResponse(const HttpResponser &other)
+    {
+        m_headers = other.m_headers;
+        m_statusCode = other.m_statusCode;
+        m_statusMessage = other.m_statusMessage;
+        m_body = other.m_body;
+        m_sharedBody.Clear();
+        m_sharedBody.Append(other.m_sharedBody);
+        m_compressible = other.m_compressible;
+        m_static = other.m_static;
+    }
+
+    // Off to send the body as it is, e.g. relayed bytes of unknown type
+    void SetCompressible(bool on)
+    {
+        m_compressible = on;
+    }
 
-        for (std::map<std::string, std::string>::const_iterator it = m_headers.begin();
-             it != m_headers.end(); ++it)
+    bool IsCompressible() const
+    {
+        return m_compressible;
+    }
+
+    size_t GetBodySize() const
+    {
+        if (m_static)
+            return m_static->GetBodySize();
+        return m_body.size() + m_sharedBody.Size();
+    }
+
+    // Sends the body with chunked transfer-encoding instead of SetBody,
+    // callback gets the stream once the headers are queued.
+    void SetStreamCallback(const HttpStreamCallback &callback)
+    {
+        Thaw();
+        m_streamCallback = callback;
+    }
+
+    bool IsStreaming() const
+    {
+        return !m_streamCallback.empty();
+    }
+
+    const HttpStreamCallback & GetStreamCallback() const
+    {
+        return m_streamCallback;
+    }
+
+    // The arena of the request being answered, kept across Reset
+    void SetArena(HttpMemoryResource *arena)
+    {
+        m_arena = arena;
+    }
+
+    // See HttpRequester::GetArena, the default resource without a request
+    HttpMemoryResource & GetArena() const
+    {
+        return m_arena ? *m_arena : *HttpMemoryResource::Default();
+    }
+
+    // Set by the connection once, kept across Reset
+    void SetDeferCallback(const HttpDeferCallback &callback)
+    {
+        m_deferCallback = callback;
+    }
+
+    // Lets the handler return before the response is ready, whatever is
+    // set on this responser afterwards is ignored. Calling it again for
+    // the same request gives the same response, null if the responser
+    // does not belong to a connection.
+    HttpAsyncResponsePtr Defer()
+    {
+        HttpAsyncResponsePtr async = m_async.lock();
+        if (!m_deferred && m_deferCallback)
         {
-            output.append(it->first);
-            output.append(": ");
-            output.append(it->second);
-            output.append("\r\n");
+            async = m_deferCallback();
+            m_async = async;
+            m_deferred = true;
         }
+        return async;
+    }
 
-        output.append("\r\n");
-        output.append(m_body);
+    bool IsDeferred() const
+    {
+        return m_deferred;
+    }
+
+    // For the responser of a deferred response: callback runs on the
+    // connection's thread once it is complete, before it is sent
+    void AddFinishCallback(const FinishCallback &callback)
+    {
+        m_finishCallbacks.push_back(callback);
+    }
+
+    // Runs the finish callbacks in the order they were added
+    void Finish(const HttpRequester &req)
+    {
+        std::vector<FinishCallback> callbacks;
+        callbacks.swap(m_finishCallbacks);
+        for (size_t i = 0; i < callbacks.size(); ++i)
+            callbacks[i](req, *this);
     }
 
+    // Copies the whole response into output
+    void AppendToBuffer(std::string &output) const;
+
+    // Status line and headers only
+    void AppendHeaders(std::string &output) const;
+
+    // Headers are copied into pooled blocks of output, the body is
+    // appended by reference. A large owned body is taken over, so the
+    // responser is left without one.
+    void AppendToBuffer(Buffer &output);
+
 private:
-    std::map<std::string, std::string> m_headers;
+    const static size_t kInlineBodySize = 512;
+
+    void Thaw()
+    {
+        if (m_static)
+        {
+            HttpStaticResponsePtr response;
+            response.swap(m_static);
+            CopyResponse(response->GetSource());
+        }
+    }
+
+    template <class Output>
+    void SerializeHeaders(Output &output) const;
+
+    HttpHeaderMap m_headers;
     StatusCode m_statusCode;
     std::string m_statusMessage;
     bool m_closeConnection;
     std::string m_body;
+    Buffer m_sharedBody;
+    bool m_compressible;
+    HttpStreamCallback m_streamCallback;
+    HttpStaticResponsePtr m_static;
+    HttpMemoryResource *m_arena;
+    HttpDeferCallback m_deferCallback;
+    bool m_deferred;
+    boost::weak_ptr<HttpAsyncResponse> m_async;
+    std::vector<FinishCallback> m_finishCallbacks;
 };
 
 #endif // HTTP_RESPONSER_H
@@ -0,0 +1,470 @@
+#include "HttpRouter.h"
+#include <algorithm>
+#include <string.h>
+
+namespace
+{
+    enum
+    {
+#define XX(num, name, string) HttpMethodSlot_##name,
+        HTTP_METHOD_MAP(XX)
+#undef XX
+        kMethodCount
+    };
+
+    const size_t kNoRoute = static_cast<size_t>(-1);
+}
+
+struct HttpRouter::Node
+{
+    Node()
+        : param(0),
+          wildcard(0),
+          anyRoute(kNoRoute)
+    { }
+
+    ~Node()
+    {
+        for (size_t i = 0; i < children.size(); ++i)
+            delete children[i];
+        delete param;
+        delete wildcard;
+    }
+
+    bool HasRoute() const
+    {
+        return anyRoute != kNoRoute || !routes.empty();
+    }
+
+    size_t GetRoute(int method) const
+    {
+        if (!routes.empty() && routes[method] != kNoRoute)
+            return routes[method];
+        return anyRoute;
+    }
+
+    // Static bytes on the edge into this node, empty below a parameter
+    std::string label;
+    // First byte of each static child, scanned before the children
+    std::string indices;
+    std::vector<Node *> children;
+
+    Node *param;
+    std::string paramName;
+    Node *wildcard;
+    std::string wildcardName;
+
+    // By method, empty until a route names one
+    std::vector<size_t> routes;
+    size_t anyRoute;
+};
+
+namespace
+{
+    size_t CommonPrefix(const std::string &a, const char *b, size_t len)
+    {
+        size_t i = 0;
+        while (i < a.size() && i < len && a[i] == b[i])
+            ++i;
+        return i;
+    }
+}
+
+HttpRouter::HttpRouter()
+    : m_root(new Node),
+      m_hasPatterns(false),
+      m_frozen(false)
+{ }
+
+HttpRouter::~HttpRouter()
+{
+    delete m_root;
+}
+
+bool HttpRouter::Add(int method, const std::string &pattern, size_t route)
+{
+    if (m_frozen || pattern.empty() || pattern[0] != '/' ||
+        method < kAnyMethod || method >= kMethodCount)
+        return false;
+
+    Node *node = m_root;
+    const char *p = pattern.data();
+    const char *end = p + pattern.size();
+    while (p < end)
+    {
+        if (*p == ':' || *p == '*')
+        {
+            bool wildcard = *p == '*';
+            const char *nameEnd = p + 1;
+            while (nameEnd < end && *nameEnd != '/')
+                ++nameEnd;
+            std::string name(p + 1, nameEnd);
+            if (name.empty() || (wildcard && nameEnd != end))
+                return false;
+
+            Node *&child = wildcard ? node->wildcard : node->param;
+            std::string &childName =
+                wildcard ? node->wildcardName : node->paramName;
+            if (!child)
+            {
+                child = new Node;
+                childName = name;
+            }
+            else if (childName != name)
+            {
+                return false;
+            }
+
+            node = child;
+            p = nameEnd;
+            m_hasPatterns = true;
+            continue;
+        }
+
+        // Static run up to the next parameter
+        const char *runEnd = p;
+        while (runEnd < end && *runEnd != ':' && *runEnd != '*')
+            ++runEnd;
+
+        while (p < runEnd)
+        {
+            size_t len = runEnd - p;
+            const char *slot = static_cast<const char *>(
+                memchr(node->indices.data(), *p, node->indices.size()));
+            if (!slot)
+            {
+                Node *child = new Node;
+                child->label.assign(p, len);
+                node->indices.push_back(*p);
+                node->children.push_back(child);
+                node = child;
+                break;
+            }
+
+            size_t index = slot - node->indices.data();
+            Node *child = node->children[index];
+            size_t common = CommonPrefix(child->label, p, len);
+            if (common < child->label.size())
+            {
+                // Split the edge, the old child goes below the new one
+                Node *middle = new Node;
+                middle->label = child->label.substr(0, common);
+                child->label.erase(0, common);
+                middle->indices.push_back(child->label[0]);
+                middle->children.push_back(child);
+                node->children[index] = middle;
+                child = middle;
+            }
+
+            node = child;
+            p += common;
+        }
+        p = runEnd;
+    }
+
+    if (method == kAnyMethod)
+    {
+        node->anyRoute = route;
+    }
+    else
+    {
+        if (node->routes.empty())
+            node->routes.resize(kMethodCount, kNoRoute);
+        node->routes[method] = route;
+    }
+    return true;
+}
+
+HttpRouter::Result HttpRouter::Find(HttpMethod method,
+                                    const boost::string_ref &path,
+                                    size_t *route,
+                                    HttpPathParams &params) const
+{
+    params.Clear();
+    if (m_frozen)
+    {
+        // A static path wins over any pattern, so a hit is the answer.
+        // Without patterns the tree has nothing more to offer.
+        const Node *node = FindFrozen(path);
+        if (node)
+            return FindRoute(node, method, route);
+        if (!m_hasPatterns)
+            return Result_NotFound;
+    }
+
+    const Node *node = Match(path, params);
+    if (!node)
+        return Result_NotFound;
+    return FindRoute(node, method, route);
+}
+
+HttpRouter::Result HttpRouter::FindRoute(const Node *node, HttpMethod method,
+                                         size_t *route) const
+{
+    *route = node->GetRoute(method);
+    if (*route == kNoRoute && method == HTTP_HEAD)
+        *route = node->GetRoute(HTTP_GET);
+    return *route == kNoRoute ? Result_MethodNotAllowed : Result_Found;
+}
+
+void HttpRouter::Freeze()
+{
+    if (m_frozen)
+        return;
+
+    std::vector<FrozenEntry> entries;
+    std::string path;
+    CollectStatic(m_root, path, entries);
+
+    // About four keys per bucket, more buckets if the seeds run out
+    size_t bucketCount = entries.size() / 4 + 1;
+    while (!BuildHash(entries, bucketCount))
+        bucketCount *= 2;
+    m_frozen = true;
+}
+
+bool HttpRouter::IsFrozen() const
+{
+    return m_frozen;
+}
+
+void HttpRouter::CollectStatic(const Node *node, std::string &path,
+                               std::vector<FrozenEntry> &entries) const
+{
+    size_t length = path.size();
+    path += node->label;
+    if (node->HasRoute())
+    {
+        FrozenEntry entry;
+        entry.path = path;
+        entry.node = node;
+        entries.push_back(entry);
+    }
+
+    for (size_t i = 0; i < node->children.size(); ++i)
+        CollectStatic(node->children[i], path, entries);
+    path.resize(length);
+}
+
+// Hash and displace: keys are grouped into buckets by their hash, then
+// the biggest buckets first each get the smallest seed that moves all
+// of their keys to free slots. A table of exactly one slot per key.
+bool HttpRouter::BuildHash(std::vector<FrozenEntry> &entries,
+                           size_t bucketCount)
+{
+    const uint32_t kMaxSeed = 1 << 16;
+    size_t size = entries.size();
+
+    std::vector<uint64_t> hashes(size);
+    std::vector<std::vector<size_t> > buckets(bucketCount);
+    for (size_t i = 0; i < size; ++i)
+    {
+        hashes[i] = HashPath(entries[i].path.data(), entries[i].path.size());
+        buckets[Bucket(hashes[i], bucketCount)].push_back(i);
+    }
+
+    std::vector<std::pair<size_t, size_t> > order;
+    for (size_t b = 0; b < bucketCount; ++b)
+        order.push_back(std::make_pair(buckets[b].size(), b));
+    std::sort(order.rbegin(), order.rend());
+
+    std::vector<uint32_t> seeds(bucketCount, 0);
+    std::vector<bool> taken(size, false);
+    std::vector<size_t> slots;
+    for (size_t o = 0; o < order.size() && order[o].first; ++o)
+    {
+        const std::vector<size_t> &bucket = buckets[order[o].second];
+        uint32_t seed = 1;
+        for (; seed < kMaxSeed; ++seed)
+        {
+            slots.clear();
+            size_t k = 0;
+            for (; k < bucket.size(); ++k)
+            {
+                size_t slot = Slot(hashes[bucket[k]], seed, size);
+                if (taken[slot] ||
+                    std::find(slots.begin(), slots.end(), slot) != slots.end())
+                    break;
+                slots.push_back(slot);
+            }
+            if (k == bucket.size())
+                break;
+        }
+        if (seed == kMaxSeed)
+            return false;
+
+        seeds[order[o].second] = seed;
+        for (size_t k = 0; k < slots.size(); ++k)
+            taken[slots[k]] = true;
+    }
+
+    m_frozenEntries.resize(size);
+    for (size_t i = 0; i < size; ++i)
+    {
+        uint32_t seed = seeds[Bucket(hashes[i], bucketCount)];
+        m_frozenEntries[Slot(hashes[i], seed, size)] = entries[i];
+    }
+    m_seeds.swap(seeds);
+    return true;
+}
+
+const HttpRouter::Node * HttpRouter::FindFrozen(
+    const boost::string_ref &path) const
+{
+    if (m_frozenEntries.empty())
+        return 0;
+
+    uint64_t hash = HashPath(path.data(), path.size());
+    uint32_t seed = m_seeds[Bucket(hash, m_seeds.size())];
+    const FrozenEntry &entry =
+        m_frozenEntries[Slot(hash, seed, m_frozenEntries.size())];
+    if (entry.path.size() == path.size() &&
+        memcmp(entry.path.data(), path.data(), path.size()) == 0)
+        return entry.node;
+    return 0;
+}
+
+uint64_t HttpRouter::HashPath(const char *data, size_t len)
+{
+    uint64_t hash = 0x9e3779b97f4a7c15ULL ^ len;
+    while (len >= 8)
+    {
+        uint64_t word;
+        memcpy(&word, data, 8);
+        hash = (hash ^ word) * 0x87c37b91114253d5ULL;
+        hash ^= hash >> 29;
+        data += 8;
+        len -= 8;
+    }
+
+    uint64_t tail = 0;
+    for (size_t i = 0; i < len; ++i)
+        tail |= uint64_t(static_cast<unsigned char>(data[i])) << (8 * i);
+    hash = (hash ^ tail) * 0x87c37b91114253d5ULL;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+// Both map 32 bits of the hash onto [0, size) with a multiply, a
+// division would cost more than the rest of the lookup
+size_t HttpRouter::Bucket(uint64_t hash, size_t size)
+{
+    return ((hash & 0xffffffff) * size) >> 32;
+}
+
+size_t HttpRouter::Slot(uint64_t hash, uint32_t seed, size_t size)
+{
+    uint64_t h = hash ^ (seed * 0x9e3779b97f4a7c15ULL);
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    return ((h >> 32) * size) >> 32;
+}
+
+std::string HttpRouter::GetAllowedMethods(const boost::string_ref &path) const
+{
+    HttpPathParams params;
+    const Node *node = Match(path, params);
+    std::string allowed;
+    if (!node)
+        return allowed;
+
+    for (int method = 0; method < kMethodCount; ++method)
+    {
+        if (node->GetRoute(method) == kNoRoute)
+            continue;
+        if (!allowed.empty())
+            allowed += ", ";
+        allowed += http_method_str(static_cast<HttpMethod>(method));
+    }
+    return allowed;
+}
+
+bool HttpRouter::ParseRoute(const std::string &route, int *method,
+                            std::string *pattern)
+{
+    size_t space = route.find(' ');
+    if (space == std::string::npos)
+    {
+        *method = kAnyMethod;
+        *pattern = route;
+        return true;
+    }
+
+    // A method with nothing after it has no pattern to route
+    size_t start = route.find_first_not_of(' ', space);
+    if (start == std::string::npos)
+        return false;
+
+    std::string name = route.substr(0, space);
+    for (int i = 0; i < kMethodCount; ++i)
+    {
+        if (name == http_method_str(static_cast<HttpMethod>(i)))
+        {
+            *method = i;
+            *pattern = route.substr(start);
+            return true;
+        }
+    }
+    return false;
+}
+
+const HttpRouter::Node * HttpRouter::Match(const boost::string_ref &path,
+                                           HttpPathParams &params) const
+{
+    return MatchNode(m_root, path.data(), path.size(), params);
+}
+
+// Depth first, static children before the parameter before "*"
+const HttpRouter::Node * HttpRouter::MatchNode(const Node *node,
+                                               const char *p, size_t len,
+                                               HttpPathParams &params)
+{
+    if (len == 0 && node->HasRoute())
+        return node;
+
+    // Few children per node, a plain scan beats anything smarter
+    size_t index = 0;
+    size_t count = len ? node->indices.size() : 0;
+    const char *indices = node->indices.data();
+    while (index < count && indices[index] != *p)
+        ++index;
+    if (index < count)
+    {
+        const Node *child = node->children[index];
+        const char *label = child->label.data();
+        size_t labelLength = child->label.size();
+        size_t i = 1;
+        while (i < labelLength && i < len && label[i] == p[i])
+            ++i;
+        if (i == labelLength)
+        {
+            const Node *found = MatchNode(child, p + labelLength,
+                                          len - labelLength, params);
+            if (found)
+                return found;
+        }
+    }
+
+    if (node->param && len)
+    {
+        size_t segment = 0;
+        while (segment < len && p[segment] != '/')
+            ++segment;
+        if (segment && params.Add(node->paramName,
+                                  boost::string_ref(p, segment)))
+        {
+            const Node *found = MatchNode(node->param, p + segment,
+                                          len - segment, params);
+            if (found)
+                return found;
+            params.Pop();
+        }
+    }
+
+    // The rest of the path, possibly empty
+    if (node->wildcard && node->wildcard->HasRoute() &&
+        params.Add(node->wildcardName, boost::string_ref(p, len)))
+        return node->wildcard;
+
+    return 0;
+}
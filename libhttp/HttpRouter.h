@@ -0,0 +1,86 @@
+#ifndef HTTP_ROUTER_H
+#define HTTP_ROUTER_H
+
+#include "HttpParser.h"
+#include <boost/noncopyable.hpp>
+#include <boost/utility/string_ref.hpp>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// Compressed radix tree from path patterns to route numbers, one slot
+// per method. Patterns are static text with ":name" segments, matching
+// up to the next '/', and an optional trailing "*name" matching the
+// rest. Static text wins over a parameter, a parameter over "*".
+class HttpRouter : private boost::noncopyable
+{
+public:
+    enum Result
+    {
+        Result_Found,
+        Result_NotFound,
+        // The path matched but not for this method
+        Result_MethodNotAllowed,
+    };
+
+    // Method slot of routes that take every method
+    const static int kAnyMethod = -1;
+
+    HttpRouter();
+    ~HttpRouter();
+
+    // false for a malformed pattern, one that names a parameter
+    // differently than an earlier route at the same place, or once frozen
+    bool Add(int method, const std::string &pattern, size_t route);
+
+    // Ends registration. Paths without parameters go into a minimal
+    // perfect hash, so they match with one hash and one comparison
+    // before the tree is walked.
+    void Freeze();
+    bool IsFrozen() const;
+
+    // params refer into path and the patterns, HEAD falls back to GET
+    Result Find(HttpMethod method, const boost::string_ref &path,
+                size_t *route, HttpPathParams &params) const;
+
+    // For the Allow header of a 405, e.g. "GET, POST"
+    std::string GetAllowedMethods(const boost::string_ref &path) const;
+
+    // "POST /users/:id" gives the method and the pattern, a plain
+    // pattern gives kAnyMethod
+    static bool ParseRoute(const std::string &route, int *method,
+                           std::string *pattern);
+
+private:
+    struct Node;
+
+    struct FrozenEntry
+    {
+        std::string path;
+        const Node *node;
+    };
+
+    void CollectStatic(const Node *node, std::string &path,
+                       std::vector<FrozenEntry> &entries) const;
+    bool BuildHash(std::vector<FrozenEntry> &entries, size_t bucketCount);
+    const Node * FindFrozen(const boost::string_ref &path) const;
+    static uint64_t HashPath(const char *data, size_t len);
+    static size_t Bucket(uint64_t hash, size_t size);
+    static size_t Slot(uint64_t hash, uint32_t seed, size_t size);
+    Result FindRoute(const Node *node, HttpMethod method,
+                     size_t *route) const;
+
+    const Node * Match(const boost::string_ref &path,
+                       HttpPathParams &params) const;
+    static const Node * MatchNode(const Node *node, const char *p,
+                                  size_t len, HttpPathParams &params);
+
+    Node *m_root;
+    bool m_hasPatterns;
+
+    bool m_frozen;
+    std::vector<uint32_t> m_seeds;
+    std::vector<FrozenEntry> m_frozenEntries;
+};
+
+#endif // HTTP_ROUTER_H
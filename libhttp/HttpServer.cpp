@@ -1,82 +1,988 @@
 #include "HttpServer.h"
+#include "HttpFormat.h"
 
 #include <boost/bind.hpp>
 #include <boost/shared_ptr.hpp>
 #include <boost/enable_shared_from_this.hpp>
+#include <boost/weak_ptr.hpp>
+#include <boost/atomic.hpp>
+#include <boost/thread/mutex.hpp>
+#include <deque>
 #include <iostream>
 
+class HttpSession;
+typedef boost::shared_ptr<HttpSession> HttpSessionPtr;
+
+class HttpSessionStream : public HttpStream
+{
+public:
+    explicit HttpSessionStream(const HttpSessionPtr &session)
+        : m_session(session),
+          m_ended(false)
+    { }
+
+    virtual ~HttpSessionStream();
+
+    virtual bool Write(const char *data, size_t len);
+    virtual bool Write(const Buffer &chunk);
+    virtual void End();
+    virtual void Abort();
+    virtual size_t PendingBytes() const;
+    virtual void OnDrain(const DrainCallback &callback);
+    virtual bool IsClosed() const;
+
+private:
+    boost::weak_ptr<HttpSession> m_session;
+    bool m_ended;
+};
+
+class HttpSessionAsyncResponse : public HttpAsyncResponse
+{
+public:
+    HttpSessionAsyncResponse(const HttpSessionPtr &session,
+                             uint64_t sequence, bool close,
+                             const boost::shared_ptr<HttpRequester> &requester)
+        : m_session(session),
+          m_sequence(sequence),
+          m_requester(requester),
+          m_responser(new HttpResponser(close)),
+          m_completed(false),
+          m_cancelled(false)
+    {
+        m_responser->SetArena(&m_requester->GetArena());
+    }
+
+    virtual ~HttpSessionAsyncResponse();
+
+    virtual const HttpRequester & Requester() const;
+    virtual HttpResponser & Responser();
+    virtual void Complete();
+    virtual bool IsCancelled() const;
+    virtual void OnCancel(const CancelCallback &callback);
+
+    // From the connection's thread
+    void Cancel();
+
+private:
+    boost::weak_ptr<HttpSession> m_session;
+    uint64_t m_sequence;
+    boost::shared_ptr<HttpRequester> m_requester;
+    boost::shared_ptr<HttpResponser> m_responser;
+    boost::atomic<bool> m_completed;
+    boost::atomic<bool> m_cancelled;
+    boost::mutex m_cancelMutex;
+    CancelCallback m_cancelCallback;
+};
+
 class HttpSession : public Session
 {
 public:
     explicit HttpSession(boost::asio::io_service &service,
-                         const HttpCallback &httpCallback)
+                         const HttpServer &server)
         : Session(service),
-          m_httpCallback(httpCallback)
-    { }
+          m_server(server),
+          m_httpResponser(false),
+          m_peerKnown(false),
+          m_streaming(false),
+          m_streamClose(false),
+          m_readEnded(false),
+          m_nextSequence(0)
+    {
+        NewRequester();
+        m_httpResponser.SetDeferCallback(
+            boost::bind(&HttpSession::Defer, this));
+    }
 
-private:
-    virtual bool OnData(const char *buffer, std::size_t bufferLength)
+    bool StreamWrite(const char *data, size_t len)
     {
-        if (!m_httpRequester.Parse(buffer, bufferLength))
+        if (!IsOpen())
             return false;
 
-        if (m_httpRequester.IsComplete())
+        if (len == 0)
+            return true;
+
+        if (m_streamDeflater)
+        {
+            // Flushed per write, so the client can decode what it got
+            m_streamOutput.Clear();
+            if (!m_streamDeflater->Write(data, len, m_streamOutput, true))
+                return false;
+            WriteChunk(m_streamOutput);
+            m_streamOutput.Clear();
+            return true;
+        }
+
+        WriteChunkSize(len);
+        WriteResponse(data, len);
+        WriteResponse("\r\n", 2);
+        return true;
+    }
+
+    bool StreamWrite(const Buffer &data)
+    {
+        if (!IsOpen())
+            return false;
+
+        if (data.Empty())
+            return true;
+
+        if (m_streamDeflater)
+        {
+            m_streamOutput.Clear();
+            size_t count = data.SegmentCount();
+            for (size_t i = 0; i < count; ++i)
+            {
+                if (!m_streamDeflater->Write(data.SegmentData(i),
+                                             data.SegmentSize(i),
+                                             m_streamOutput, i + 1 == count))
+                    return false;
+            }
+            WriteChunk(m_streamOutput);
+            m_streamOutput.Clear();
+            return true;
+        }
+
+        WriteChunk(data);
+        return true;
+    }
+
+    void StreamEnd()
+    {
+        if (!m_streaming)
+            return;
+
+        m_streaming = false;
+        m_drainCallback.clear();
+        if (!IsOpen())
+            return;
+
+        if (m_streamDeflater)
+        {
+            m_streamOutput.Clear();
+            if (m_streamDeflater->Finish(m_streamOutput))
+                WriteChunk(m_streamOutput);
+            m_streamOutput.Clear();
+            m_spareDeflater.swap(m_streamDeflater);
+            m_streamDeflater.reset();
+        }
+
+        WriteResponse("0\r\n\r\n", 5);
+
+        if (m_streamClose)
+            DropPending();
+
+        // Responses of requests pipelined behind the stream
+        FlushPending();
+    }
+
+    void StreamAbort()
+    {
+        if (!m_streaming)
+            return;
+
+        m_streaming = false;
+        m_streamDeflater.reset();
+        m_drainCallback.clear();
+        m_readEnded = true;
+        DropPending();
+        CloseAfterWrite();
+    }
+
+    size_t StreamPendingBytes() const
+    {
+        return PendingBytes();
+    }
+
+    void StreamOnDrain(const HttpStream::DrainCallback &callback)
+    {
+        if (callback && PendingBytes() <= kStreamLowWatermark)
+        {
+            // Already drained, run it from the loop rather than recursing
+            // into the producer
+            Service().post(callback);
+            return;
+        }
+        m_drainCallback = callback;
+    }
+
+    bool StreamIsClosed() const
+    {
+        return !IsOpen();
+    }
+
+    // From any thread, runs completion on the connection's thread
+    void PostCompletion(const HttpCompletionQueue::Completion &completion)
+    {
+        m_server.m_completions.Post(completion);
+    }
+
+    void OnAsyncComplete(uint64_t sequence,
+                         const boost::shared_ptr<HttpRequester> &requester,
+                         const boost::shared_ptr<HttpResponser> &responser)
+    {
+        if (!IsOpen())
+            return;
+
+        PendingResponse *pending = FindPending(sequence);
+        if (!pending || pending->ready)
+            return;
+
+        responser->Finish(*requester);
+        Prepare(*responser, *pending);
+        FlushPending();
+    }
+
+private:
+    // A response in the order of its request, ready once serialized.
+    // Streams only have their headers in output and start at the front.
+    struct PendingResponse
+    {
+        PendingResponse()
+            : sequence(0),
+              ready(false),
+              close(false),
+              head(false),
+              accepted(HttpEncoding_Identity)
+        { }
+
+        uint64_t sequence;
+        bool ready;
+        bool close;
+        // Answers a HEAD request, the body is left out
+        bool head;
+        HttpEncoding accepted;
+        std::string cacheKey;
+        std::string ifNoneMatch;
+        HttpAccess access;
+        Buffer output;
+        HttpStreamCallback stream;
+        // Started when the stream headers say it is compressed
+        boost::shared_ptr<HttpDeflater> streamDeflater;
+        boost::weak_ptr<HttpSessionAsyncResponse> async;
+    };
+
+    virtual bool OnData(const char *buffer, std::size_t bufferLength)
+    {
+        // Several pipelined requests may come in one read
+        while (bufferLength)
         {
-            if (!OnRequest())
+            if (m_readEnded)
+                return false;
+
+            size_t parsed = 0;
+            if (!m_httpRequester->Parse(buffer, bufferLength, &parsed))
+            {
+                if (m_httpRequester->GetLimitStatus())
+                    OnReject(m_httpRequester->GetLimitStatus());
+                return false;
+            }
+            buffer += parsed;
+            bufferLength -= parsed;
+            m_access.requestBytes += parsed;
+
+            if (!m_httpRequester->IsComplete())
+                break;
+
+            bool keepReading = OnRequest();
+            m_access = HttpAccess();
+            m_httpRequester->Reset();
+            if (m_server.m_shrinkThreshold)
+                Shrink(m_server.m_shrinkThreshold);
+            if (!keepReading)
                 return false;
-            m_httpRequester.Reset();
         }
 
         return true;
     }
 
     virtual void OnClose()
-    { }
+    {
+        m_drainCallback.clear();
+        DropPending();
+    }
+
+    virtual void OnWritten(std::size_t pendingBytes)
+    {
+        if (m_drainCallback && pendingBytes <= kStreamLowWatermark)
+        {
+            HttpStream::DrainCallback callback;
+            callback.swap(m_drainCallback);
+            callback();
+        }
+    }
 
+    virtual void OnReadTimeout()
+    {
+        // An idle client is fine while its responses are being produced
+        if (m_streaming || !m_pending.empty())
+            m_readEnded = true;
+        else
+            Shutdown();
+    }
+
+    virtual void OnReadEnd(const boost::system::error_code &error)
+    {
+        m_readEnded = true;
+        if (error && error != boost::asio::error::eof)
+        {
+            // The client went away, what is still being produced for it
+            // is cancelled. After eof it only stopped sending, the
+            // responses still go out before the connection closes.
+            DropPending();
+            CloseAfterWrite();
+            return;
+        }
+        CloseIfDone();
+    }
+
+    void Shrink(size_t threshold)
+    {
+        m_httpRequester->Shrink(threshold);
+        m_httpResponser.Shrink(threshold);
+    }
+
+    void WriteChunkSize(size_t size)
+    {
+        char buf[32];
+        size_t length = FormatHex(buf, size);
+        buf[length++] = '\r';
+        buf[length++] = '\n';
+        WriteResponse(buf, length);
+    }
+
+    void WriteChunk(const Buffer &data)
+    {
+        if (data.Empty())
+            return;
+
+        WriteChunkSize(data.Size());
+        WriteResponse(data);
+        WriteResponse("\r\n", 2);
+    }
+
+    // Sent right away when nothing is ahead of it, otherwise it waits
+    // its turn serialized. The caller may reuse responser afterwards.
+    void Respond(HttpResponser &responser, HttpEncoding accepted,
+                 const std::string &cacheKey, const char *ifNoneMatch,
+                 bool head)
+    {
+        if (m_pending.empty() && !m_streaming)
+        {
+            m_output.Clear();
+            boost::shared_ptr<HttpDeflater> deflater;
+            Serialize(responser, accepted, cacheKey, ifNoneMatch, head,
+                      m_access, m_output, deflater);
+            WriteResponse(m_output);
+            m_output.Clear();
+            if (responser.IsStreaming() && !head)
+                StartStream(responser.GetStreamCallback(), deflater,
+                            responser.CloseConnection());
+            return;
+        }
+
+        m_pending.push_back(PendingResponse());
+        PendingResponse &pending = m_pending.back();
+        pending.sequence = m_nextSequence++;
+        pending.accepted = accepted;
+        pending.cacheKey = cacheKey;
+        pending.ifNoneMatch = ifNoneMatch;
+        pending.head = head;
+        pending.access = m_access;
+        Prepare(responser, pending);
+    }
+
+    // Same ordering for a response that is already serialized
+    void Respond(const Buffer &output, bool close)
+    {
+        if (m_pending.empty() && !m_streaming)
+        {
+            WriteResponse(output);
+            return;
+        }
+
+        m_pending.push_back(PendingResponse());
+        PendingResponse &pending = m_pending.back();
+        pending.sequence = m_nextSequence++;
+        pending.output.Append(output);
+        pending.close = close;
+        pending.ready = true;
+    }
+
+    // Compresses and serializes responser into output. A response the
+    // cache may keep gets an ETag and is stored as it is sent, the
+    // client is told 304 if it already has it. A compressed stream gets
+    // its deflater started in streamDeflater, it goes out identity if
+    // that fails. A HEAD request gets everything but the body.
+    void Serialize(HttpResponser &responser, HttpEncoding accepted,
+                   const std::string &cacheKey, const char *ifNoneMatch,
+                   bool head, HttpAccess &access, Buffer &output,
+                   boost::shared_ptr<HttpDeflater> &streamDeflater)
+    {
+        // Goes out as it was rendered, its blocks are only referred to
+        if (responser.GetStaticResponse())
+        {
+            responser.AppendToBuffer(output);
+            if (head)
+                DropBody(output, responser.GetBodySize());
+            Report(access, responser.GetStatusCode(), output.Size());
+            return;
+        }
+
+        const HttpCompressor &compressor = m_server.m_compressor;
+        HttpEncoding encoding = compressor.Negotiate(accepted, responser);
+        if (encoding != HttpEncoding_Identity && responser.IsStreaming())
+        {
+            streamDeflater = BeginStreamDeflater(encoding);
+            if (streamDeflater)
+                responser.AddHeader("Content-Encoding",
+                                    HttpCompressor::GetEncodingName(encoding));
+            else
+                encoding = HttpEncoding_Identity;
+        }
+        else if (encoding != HttpEncoding_Identity)
+        {
+            if (!compressor.Compress(encoding, responser))
+                encoding = HttpEncoding_Identity;
+        }
+
+        unsigned int ttl = cacheKey.empty() ? 0 :
+            m_server.m_cache.GetTtl(responser);
+
+        std::string etag;
+        if (ttl)
+        {
+            etag = responser.GetHeader("ETag");
+            if (etag.empty())
+            {
+                etag = HttpResponseCache::MakeEtag(responser, encoding);
+                responser.AddHeader("ETag", etag);
+            }
+        }
+
+        // Taken before serializing, a large body is moved into output
+        size_t bodySize = responser.IsStreaming() ? 0 :
+            responser.GetBodySize();
+        responser.AppendToBuffer(output);
+        if (head)
+            DropBody(output, bodySize);
+
+        int status = responser.GetStatusCode();
+        if (ttl)
+        {
+            m_server.m_cache.Store(cacheKey, output, etag, ttl, access.route);
+            if (HttpResponseCache::MatchesEtag(ifNoneMatch, etag))
+            {
+                output.Clear();
+                AppendNotModified(etag, responser.CloseConnection(), output);
+                status = HttpResponser::StatusCode_304NotModified;
+            }
+        }
+
+        Report(access, status, output.Size());
+    }
+
+    // Cuts the body of the serialized response in output, its
+    // Content-Length stays as it was
+    static void DropBody(Buffer &output, size_t bodySize)
+    {
+        Buffer headers;
+        output.Split(output.Size() - bodySize, headers);
+        output.Clear();
+        output.Append(headers);
+    }
+
+    void StartAccess()
+    {
+        if (!m_peerKnown)
+        {
+            boost::system::error_code error;
+            boost::asio::ip::address address =
+                Socket().remote_endpoint(error).address();
+            boost::asio::ip::address_v6::bytes_type bytes =
+                address.is_v4() ?
+                boost::asio::ip::address_v6::v4_mapped(
+                    address.to_v4()).to_bytes() :
+                address.to_v6().to_bytes();
+            memcpy(m_peer, bytes.data(), sizeof(m_peer));
+            m_peerKnown = true;
+        }
+
+        memcpy(m_access.peer, m_peer, sizeof(m_peer));
+        m_access.method = m_httpRequester->GetHttpMethod();
+        m_access.startUs = CoarseClock::NowUs();
+    }
+
+    void Report(HttpAccess &access, int status, size_t responseBytes)
+    {
+        if (!m_server.m_accessCallback)
+            return;
+
+        access.status = status;
+        access.responseBytes = responseBytes;
+        access.latencyUs = CoarseClock::NowUs() - access.startUs;
+        m_server.m_accessCallback(access);
+    }
+
+    // Answers from the cache, false on a miss
+    bool RespondCached(const char *ifNoneMatch, bool close)
+    {
+        m_cached.Clear();
+        if (!m_server.m_cache.Find(m_cacheKey, m_cached, m_cachedEtag,
+                                   &m_access.route))
+            return false;
+
+        int status = HttpResponser::StatusCode_200Ok;
+        if (HttpResponseCache::MatchesEtag(ifNoneMatch, m_cachedEtag))
+        {
+            m_cached.Clear();
+            AppendNotModified(m_cachedEtag, close, m_cached);
+            status = HttpResponser::StatusCode_304NotModified;
+        }
+        Report(m_access, status, m_cached.Size());
+
+        // The stored bytes say keep-alive, the connection is closed after
+        // them all the same
+        Respond(m_cached, close);
+        m_cached.Clear();
+        return true;
+    }
+
+    static void AppendNotModified(const std::string &etag, bool close,
+                                  Buffer &output)
+    {
+        HttpResponser responser(close);
+        responser.SetStatusCode(HttpResponser::StatusCode_304NotModified);
+        responser.AddHeader("ETag", etag);
+        responser.AppendToBuffer(output);
+    }
+
+    void Prepare(HttpResponser &responser, PendingResponse &pending)
+    {
+        Serialize(responser, pending.accepted, pending.cacheKey,
+                  pending.ifNoneMatch.c_str(), pending.head, pending.access,
+                  pending.output, pending.streamDeflater);
+        if (!pending.head)
+            pending.stream = responser.GetStreamCallback();
+        pending.close = responser.CloseConnection();
+        pending.ready = true;
+    }
+
+    // Writes out the ready responses at the front, up to a stream
+    void FlushPending()
+    {
+        while (!m_streaming && !m_pending.empty() && m_pending.front().ready)
+        {
+            PendingResponse &front = m_pending.front();
+            WriteResponse(front.output);
+
+            HttpStreamCallback stream;
+            stream.swap(front.stream);
+            boost::shared_ptr<HttpDeflater> deflater;
+            deflater.swap(front.streamDeflater);
+            bool close = front.close;
+            m_pending.pop_front();
+
+            if (stream)
+            {
+                StartStream(stream, deflater, close);
+            }
+            else if (close)
+            {
+                // Requests read behind it get no answer
+                m_readEnded = true;
+                DropPending();
+            }
+        }
+
+        CloseIfDone();
+    }
+
+    PendingResponse * FindPending(uint64_t sequence)
+    {
+        if (m_pending.empty() || sequence < m_pending.front().sequence)
+            return 0;
+
+        uint64_t index = sequence - m_pending.front().sequence;
+        if (index >= m_pending.size())
+            return 0;
+        return &m_pending[index];
+    }
+
+    void DropPending()
+    {
+        // Swapped out first, cancel callbacks may come back in here
+        std::deque<PendingResponse> pending;
+        pending.swap(m_pending);
+        for (size_t i = 0; i < pending.size(); ++i)
+        {
+            boost::shared_ptr<HttpSessionAsyncResponse> async =
+                pending[i].async.lock();
+            if (async)
+                async->Cancel();
+        }
+    }
+
+    void CloseIfDone()
+    {
+        if (m_readEnded && !m_streaming && m_pending.empty() && IsOpen())
+            CloseAfterWrite();
+    }
+
+    // deflater is null for an identity stream
+    void StartStream(const HttpStreamCallback &stream,
+                     const boost::shared_ptr<HttpDeflater> &deflater,
+                     bool close)
+    {
+        // Reading goes on, the connection is closed when the stream ends
+        m_streaming = true;
+        m_streamClose = close;
+        m_streamDeflater = deflater;
+
+        HttpSessionPtr self =
+            boost::static_pointer_cast<HttpSession>(shared_from_this());
+        stream(HttpStreamPtr(new HttpSessionStream(self)));
+    }
+
+    void NewRequester()
+    {
+        m_httpRequester.reset(new HttpRequester);
+        m_httpResponser.SetArena(&m_httpRequester->GetArena());
+        m_httpRequester->SetLimits(m_server.m_limits);
+        m_httpRequester->SetHeadersCallback(
+            boost::bind(&HttpSession::OnHeaders, this, _1));
+    }
+
+    // Bound as the defer callback of m_httpResponser, the response takes
+    // the place the current request gets in m_pending. It keeps the
+    // request too, the next one is parsed into a new requester.
+    HttpAsyncResponsePtr Defer()
+    {
+        HttpSessionPtr self =
+            boost::static_pointer_cast<HttpSession>(shared_from_this());
+        m_deferred.reset(new HttpSessionAsyncResponse(
+            self, m_nextSequence, m_httpResponser.CloseConnection(),
+            m_httpRequester));
+        NewRequester();
+        return m_deferred;
+    }
+
+    // Before the stream headers are serialized, so they only claim an
+    // encoding zlib could start. The deflater of the last stream is
+    // reused, a stream still running keeps its own.
+    boost::shared_ptr<HttpDeflater> BeginStreamDeflater(HttpEncoding encoding)
+    {
+        boost::shared_ptr<HttpDeflater> deflater;
+        deflater.swap(m_spareDeflater);
+        if (!deflater)
+            deflater.reset(new HttpDeflater);
+        if (!deflater->Begin(encoding,
+                             m_server.m_compressor.GetOptions().level))
+            return boost::shared_ptr<HttpDeflater>();
+        return deflater;
+    }
+
+    void OnHeaders(HttpLimits &limits)
+    {
+        if (m_server.m_limitsCallback)
+            m_server.m_limitsCallback(*m_httpRequester, limits);
+    }
+
+    // Answers a request that broke a limit without reading the rest of it,
+    // the connection is closed once the response is out. The client may
+    // still be sending, so the close lingers.
+    void OnReject(int statusCode)
+    {
+        SetLinger();
+        if (m_server.m_accessCallback)
+            StartAccess();
+
+        HttpResponser &responser = m_httpResponser;
+        responser.Reset(true);
+        responser.SetStatusCode(
+            static_cast<HttpResponser::StatusCode>(statusCode));
+
+        Respond(responser, HttpEncoding_Identity, std::string(), "", false);
+    }
+
+    // False once no more requests should be read
     bool OnRequest()
     {
-        bool close = m_httpRequester.GetHeader("Connection") ==
+        bool close = m_httpRequester->GetHeader("Connection") ==
             std::string("close");
+        bool head = m_httpRequester->GetHttpMethod() == HTTP_HEAD;
 
-        HttpResponser responser(close);
+        // Once per requester, it is kept across keep-alive requests
+        if (m_httpRequester->GetPeerIp().empty())
+            m_httpRequester->SetPeerIp(GetRemoteIpString());
 
-        if (m_httpCallback)
+        HttpEncoding accepted = m_server.m_compressor.GetAccepted(
+            *m_httpRequester);
+
+        if (m_server.m_accessCallback)
+            StartAccess();
+
+        // Stays valid while the handler runs, a deferred request keeps
+        // its requester alive until the place is taken below
+        const char *ifNoneMatch = m_httpRequester->GetHeader("If-None-Match");
+        if (!m_server.m_cache.MakeKey(*m_httpRequester, accepted, m_cacheKey))
+            m_cacheKey.clear();
+        else if (RespondCached(ifNoneMatch, close))
+            return !close;
+
+        HttpResponser &responser = m_httpResponser;
+        responser.Reset(close);
+
+        // m_httpRequester is replaced if the handler defers
+        if (m_server.m_httpCallback)
         {
-            m_httpCallback(m_httpRequester, responser);
+            m_server.m_httpCallback(*m_httpRequester, responser);
         }
         else
         {
-            responser.SetStatusCode(HttpResponser::StatusCode_404NotFound);
-            responser.SetBody("{\"code\": -1, \"message\": \"Not Found\"}\n");
+            responser.SetStaticResponse(m_server.m_notFound);
             responser.SetCloseConnection(true);
         }
 
-        std::string buff;
-        responser.AppendToBuffer(buff);
+        if (responser.IsDeferred())
+        {
+            m_access.route = m_deferred ?
+                m_deferred->Requester().GetRouteId() : -1;
+            // Holds the place until OnAsyncComplete fills it in
+            m_pending.push_back(PendingResponse());
+            PendingResponse &pending = m_pending.back();
+            pending.sequence = m_nextSequence++;
+            pending.accepted = accepted;
+            pending.cacheKey = m_cacheKey;
+            pending.ifNoneMatch = ifNoneMatch;
+            pending.head = head;
+            pending.access = m_access;
+            pending.async = m_deferred;
+            m_deferred.reset();
+            return !close;
+        }
 
-        WriteResponse(buff.data(), buff.size());
+        m_access.route = m_httpRequester->GetRouteId();
+        Respond(responser, accepted, m_cacheKey, ifNoneMatch, head);
         return !responser.CloseConnection();
     }
 
-    HttpRequester m_httpRequester;
-    HttpCallback m_httpCallback;
+    const static std::size_t kStreamLowWatermark = 64 * 1024;
+
+    const HttpServer &m_server;
+    boost::shared_ptr<HttpRequester> m_httpRequester;
+    HttpResponser m_httpResponser;
+    Buffer m_output;
+    std::string m_cacheKey;
+    Buffer m_cached;
+    std::string m_cachedEtag;
+    HttpAccess m_access;
+    unsigned char m_peer[16];
+    bool m_peerKnown;
+
+    bool m_streaming;
+    bool m_streamClose;
+    bool m_readEnded;
+    HttpStream::DrainCallback m_drainCallback;
+
+    std::deque<PendingResponse> m_pending;
+    uint64_t m_nextSequence;
+    boost::shared_ptr<HttpSessionAsyncResponse> m_deferred;
+    // Set while a compressed stream runs
+    boost::shared_ptr<HttpDeflater> m_streamDeflater;
+    boost::shared_ptr<HttpDeflater> m_spareDeflater;
+    Buffer m_streamOutput;
 };
 
+HttpSessionStream::~HttpSessionStream()
+{
+    // A producer that drops the stream without End still completes it
+    End();
+}
+
+bool HttpSessionStream::Write(const char *data, size_t len)
+{
+    HttpSessionPtr session = m_session.lock();
+    if (!session || m_ended)
+        return false;
+    return session->StreamWrite(data, len);
+}
+
+void HttpSessionStream::End()
+{
+    if (m_ended)
+        return;
+    m_ended = true;
+
+    HttpSessionPtr session = m_session.lock();
+    if (session)
+        session->StreamEnd();
+}
+
+void HttpSessionStream::Abort()
+{
+    if (m_ended)
+        return;
+    m_ended = true;
+
+    HttpSessionPtr session = m_session.lock();
+    if (session)
+        session->StreamAbort();
+}
+
+bool HttpSessionStream::Write(const Buffer &chunk)
+{
+    HttpSessionPtr session = m_session.lock();
+    if (!session || m_ended)
+        return false;
+    return session->StreamWrite(chunk);
+}
+
+size_t HttpSessionStream::PendingBytes() const
+{
+    HttpSessionPtr session = m_session.lock();
+    return session ? session->StreamPendingBytes() : 0;
+}
+
+void HttpSessionStream::OnDrain(const DrainCallback &callback)
+{
+    HttpSessionPtr session = m_session.lock();
+    if (session && !m_ended)
+        session->StreamOnDrain(callback);
+}
+
+bool HttpSessionStream::IsClosed() const
+{
+    HttpSessionPtr session = m_session.lock();
+    return !session || m_ended || session->StreamIsClosed();
+}
+
+HttpSessionAsyncResponse::~HttpSessionAsyncResponse()
+{
+    // A handler that gave up without answering still keeps the order
+    if (!m_completed)
+    {
+        m_responser->Reset(m_responser->CloseConnection());
+        m_responser->SetStatusCode(
+            HttpResponser::StatusCode_500InternalServerError);
+        Complete();
+    }
+}
+
+const HttpRequester & HttpSessionAsyncResponse::Requester() const
+{
+    return *m_requester;
+}
+
+HttpResponser & HttpSessionAsyncResponse::Responser()
+{
+    return *m_responser;
+}
+
+void HttpSessionAsyncResponse::Complete()
+{
+    if (m_completed.exchange(true))
+        return;
+
+    // The connection only ever changes on its own thread
+    HttpSessionPtr session = m_session.lock();
+    if (session)
+        session->PostCompletion(boost::bind(
+            &HttpSession::OnAsyncComplete, session, m_sequence,
+            m_requester, m_responser));
+}
+
+bool HttpSessionAsyncResponse::IsCancelled() const
+{
+    return m_cancelled;
+}
+
+void HttpSessionAsyncResponse::OnCancel(const CancelCallback &callback)
+{
+    {
+        boost::mutex::scoped_lock lock(m_cancelMutex);
+        if (!m_cancelled)
+        {
+            m_cancelCallback = callback;
+            return;
+        }
+    }
+
+    if (callback)
+        callback();
+}
+
+void HttpSessionAsyncResponse::Cancel()
+{
+    CancelCallback callback;
+    {
+        boost::mutex::scoped_lock lock(m_cancelMutex);
+        if (m_cancelled)
+            return;
+        m_cancelled = true;
+        callback.swap(m_cancelCallback);
+    }
+
+    if (callback)
+        callback();
+}
+
 HttpServer::HttpServer(unsigned short port,
                        boost::asio::io_service &service,
                        const HttpCallback &httpCallback)
     : m_service(service),
       m_httpCallback(httpCallback),
+      m_shrinkThreshold(64 * 1024),
+      m_completions(service),
       m_tcpServer(port, service, boost::bind(
           &HttpServer::NewSession, this))
-{ }
+{
+    HttpResponser notFound(true);
+    notFound.SetStatusCode(HttpResponser::StatusCode_404NotFound);
+    notFound.SetBody("{\"code\": -1, \"message\": \"Not Found\"}\n");
+    m_notFound.reset(new HttpStaticResponse(notFound));
+}
 
 void HttpServer::Go()
 {
     m_tcpServer.Go();
 }
 
+void HttpServer::SetLimits(const HttpLimits &limits)
+{
+    m_limits = limits;
+}
+
+void HttpServer::SetLimitsCallback(const HttpLimitsCallback &limitsCallback)
+{
+    m_limitsCallback = limitsCallback;
+}
+
+void HttpServer::SetShrinkThreshold(size_t threshold)
+{
+    m_shrinkThreshold = threshold;
+}
+
+void HttpServer::SetCompression(const HttpCompression &compression)
+{
+    m_compressor.SetOptions(compression);
+}
+
+void HttpServer::SetAccessCallback(const HttpAccessCallback &accessCallback)
+{
+    m_accessCallback = accessCallback;
+}
+
+void HttpServer::SetCache(const HttpCacheOptions &cache)
+{
+    m_cache.SetOptions(cache);
+}
+
+void HttpServer::ClearCache()
+{
+    m_cache.Clear();
+}
+
 SessionPtr HttpServer::NewSession()
 {
-    return SessionPtr(new HttpSession(m_service, m_httpCallback));
+    return SessionPtr(new HttpSession(m_service, *this));
 }
@@ -3,17 +3,59 @@
 
 #include "HttpRequester.h"
 #include "HttpResponser.h"
+#include "HttpCompressor.h"
+#include "HttpResponseCache.h"
+#include "HttpCompletionQueue.h"
 #include "../TcpServer.h"
 
 #include <boost/asio.hpp>
 #include <boost/asio/spawn.hpp>
 #include <boost/function.hpp>
 
+#include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 
 typedef boost::function<
     void(const HttpRequester &, HttpResponser &) > HttpCallback;
 
+// Called when the request headers are complete, lets the owner adjust
+// the limits of this request (e.g. a larger body for an upload route).
+typedef boost::function<
+    void(const HttpRequester &, HttpLimits &) > HttpLimitsCallback;
+
+// One answered request, reported once its response is serialized. For a
+// stream only the headers count as response bytes.
+struct HttpAccess
+{
+    HttpAccess()
+        : route(-1),
+          method(0),
+          status(0),
+          requestBytes(0),
+          responseBytes(0),
+          startUs(0),
+          latencyUs(0)
+    {
+        memset(peer, 0, sizeof(peer));
+    }
+
+    // IPv6 address of the client, IPv4 ones mapped as ::ffff:a.b.c.d
+    unsigned char peer[16];
+    // As set with HttpRequester::SetRouteId, -1 for none
+    int route;
+    int method;
+    int status;
+    uint64_t requestBytes;
+    uint64_t responseBytes;
+    // CoarseClock::NowUs when the request was complete
+    uint64_t startUs;
+    uint64_t latencyUs;
+};
+
+// Runs on the connection's thread, keep it short
+typedef boost::function< void(const HttpAccess &) > HttpAccessCallback;
+
 class HttpServer : private boost::noncopyable
 {
 public:
@@ -21,12 +63,40 @@ public:
                boost::asio::io_service &service,
                const HttpCallback &httpCallback);
     void Go();
+    void SetLimits(const HttpLimits &limits);
+    void SetLimitsCallback(const HttpLimitsCallback &limitsCallback);
+
+    // Per-connection request/response buffers are reused across
+    // keep-alive requests, those that grew above threshold bytes are
+    // released after the request. 0 never releases them.
+    void SetShrinkThreshold(size_t threshold);
+
+    // Off by default, see HttpCompression for what gets compressed
+    void SetCompression(const HttpCompression &compression);
+
+    // Off by default, see HttpCacheOptions for what gets stored
+    void SetCache(const HttpCacheOptions &cache);
+    void ClearCache();
+
+    // Told about every response, none by default
+    void SetAccessCallback(const HttpAccessCallback &accessCallback);
 
 private:
+    friend class HttpSession;
+
     SessionPtr NewSession();
 
     boost::asio::io_service &m_service;
     HttpCallback m_httpCallback;
+    HttpLimits m_limits;
+    HttpLimitsCallback m_limitsCallback;
+    HttpAccessCallback m_accessCallback;
+    size_t m_shrinkThreshold;
+    HttpCompressor m_compressor;
+    HttpResponseCache m_cache;
+    // For requests when there is no callback
+    HttpStaticResponsePtr m_notFound;
+    mutable HttpCompletionQueue m_completions;
     TcpServer m_tcpServer;
 };
 
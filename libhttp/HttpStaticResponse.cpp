@@ -0,0 +1,80 @@
+#include "HttpStaticResponse.h"
+#include "HttpResponser.h"
+#include "HttpDate.h"
+
+namespace
+{
+    // Stands in for the date while rendering, it is cut out again
+    const char kDateMarker[] = "\x01static-date\x01";
+}
+
+HttpStaticResponse::HttpStaticResponse(const HttpResponser &responser)
+    : m_statusCode(responser.GetStatusCode()),
+      m_bodySize(responser.GetBodySize()),
+      m_dated(*responser.GetHeader("Date") == '\0'),
+      m_source(new HttpResponser(false))
+{
+    m_source->CopyResponse(responser);
+    Render(responser, false, m_keepAlive);
+    Render(responser, true, m_close);
+}
+
+HttpStaticResponse::~HttpStaticResponse()
+{
+}
+
+void HttpStaticResponse::AppendTo(Buffer &output, bool close) const
+{
+    const Rendered &rendered = close ? m_close : m_keepAlive;
+    output.Append(rendered.head);
+    if (m_dated)
+    {
+        size_t length;
+        const char *line = HttpDate::GetHeaderLine(&length);
+        output.Append(line, length);
+    }
+    output.Append(rendered.tail);
+}
+
+void HttpStaticResponse::AppendTo(std::string &output, bool close) const
+{
+    const Rendered &rendered = close ? m_close : m_keepAlive;
+    rendered.head.AppendTo(output);
+    if (m_dated)
+    {
+        size_t length;
+        const char *line = HttpDate::GetHeaderLine(&length);
+        output.append(line, length);
+    }
+    rendered.tail.AppendTo(output);
+}
+
+void HttpStaticResponse::Render(const HttpResponser &responser, bool close,
+                                Rendered &rendered)
+{
+    HttpResponser copy(close);
+    copy.CopyResponse(responser);
+    if (m_dated)
+        copy.AddHeader("Date", kDateMarker);
+
+    std::string text;
+    copy.AppendToBuffer(text);
+
+    std::string head;
+    if (m_dated)
+    {
+        std::string line("Date: ");
+        line.append(kDateMarker).append("\r\n");
+        size_t pos = text.find("\r\n" + line);
+        if (pos != std::string::npos)
+        {
+            pos += 2;
+            head.assign(text, 0, pos);
+            text.erase(0, pos + line.size());
+        }
+    }
+
+    // Each part in one block of its own size
+    rendered.head.Take(head);
+    rendered.tail.Take(text);
+}
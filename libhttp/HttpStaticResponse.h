@@ -0,0 +1,64 @@
+#ifndef HTTP_STATIC_RESPONSE_H
+#define HTTP_STATIC_RESPONSE_H
+
+#include "../Buffer.h"
+#include <boost/noncopyable.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/shared_ptr.hpp>
+#include <string>
+
+class HttpResponser;
+
+// A reply that never changes, serialized once. Connections queue its
+// blocks by reference, only the Date line is put in fresh. Immutable,
+// so one can be shared by every connection and thread.
+class HttpStaticResponse : private boost::noncopyable
+{
+public:
+    // Status, headers and body of responser, which must not stream.
+    // Rendered both for a connection kept alive and one closed after it.
+    explicit HttpStaticResponse(const HttpResponser &responser);
+    ~HttpStaticResponse();
+
+    // A copy of the responser it was rendered from
+    const HttpResponser & GetSource() const
+    {
+        return *m_source;
+    }
+
+    int GetStatusCode() const
+    {
+        return m_statusCode;
+    }
+
+    size_t GetBodySize() const
+    {
+        return m_bodySize;
+    }
+
+    void AppendTo(Buffer &output, bool close) const;
+    void AppendTo(std::string &output, bool close) const;
+
+private:
+    // The bytes before and after the Date line, tail holds them all if
+    // the responser had a Date header of its own
+    struct Rendered
+    {
+        Buffer head;
+        Buffer tail;
+    };
+
+    void Render(const HttpResponser &responser, bool close,
+                Rendered &rendered);
+
+    int m_statusCode;
+    size_t m_bodySize;
+    bool m_dated;
+    boost::scoped_ptr<HttpResponser> m_source;
+    Rendered m_keepAlive;
+    Rendered m_close;
+};
+
+typedef boost::shared_ptr<const HttpStaticResponse> HttpStaticResponsePtr;
+
+#endif // HTTP_STATIC_RESPONSE_H
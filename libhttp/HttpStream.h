@@ -0,0 +1,46 @@
+#ifndef HTTP_STREAM_H
+#define HTTP_STREAM_H
+
+#include "../Buffer.h"
+#include <boost/noncopyable.hpp>
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+#include <stddef.h>
+
+// Body of a chunked response, written by the handler piece by piece
+// after the headers went out. Must be used from the io_service thread.
+class HttpStream : private boost::noncopyable
+{
+public:
+    typedef boost::function< void() > DrainCallback;
+
+    virtual ~HttpStream()
+    { }
+
+    // Sends data as one chunk, false once the connection is gone
+    virtual bool Write(const char *data, size_t len) = 0;
+
+    // Same, sharing the blocks of chunk instead of copying them
+    virtual bool Write(const Buffer &chunk) = 0;
+
+    // Sends the last chunk, the response is complete afterwards
+    virtual void End() = 0;
+
+    // Closes the connection without the last chunk, so the client can
+    // tell the body was cut short (e.g. its source failed midway)
+    virtual void Abort() = 0;
+
+    // Bytes queued on the connection but not yet written to the socket
+    virtual size_t PendingBytes() const = 0;
+
+    // Called once when the pending bytes drop to the low watermark,
+    // producers should wait for it instead of queueing without bound.
+    virtual void OnDrain(const DrainCallback &callback) = 0;
+
+    virtual bool IsClosed() const = 0;
+};
+
+typedef boost::shared_ptr<HttpStream> HttpStreamPtr;
+typedef boost::function< void(const HttpStreamPtr &) > HttpStreamCallback;
+
+#endif // HTTP_STREAM_H
@@ -0,0 +1,159 @@
+#include "HttpWorkerPool.h"
+#include <boost/bind.hpp>
+#include <time.h>
+
+namespace
+{
+    const size_t kQueueCapacity = 256;
+}
+
+HttpWorkerPool::HttpWorkerPool(size_t threads)
+    : m_next(0),
+      m_stop(false),
+      m_sleeping(0),
+      m_submitted(0),
+      m_started(0),
+      m_completed(0),
+      m_maxQueued(0),
+      m_totalWaitUs(0),
+      m_maxWaitUs(0)
+{
+    if (threads == 0)
+        threads = boost::thread::hardware_concurrency();
+    if (threads == 0)
+        threads = 1;
+
+    for (size_t i = 0; i < threads; ++i)
+        m_queues.push_back(new JobQueue(kQueueCapacity));
+    for (size_t i = 0; i < threads; ++i)
+        m_threads.create_thread(boost::bind(&HttpWorkerPool::Run, this, i));
+}
+
+HttpWorkerPool::~HttpWorkerPool()
+{
+    {
+        boost::mutex::scoped_lock lock(m_sleepMutex);
+        m_stop = true;
+    }
+    m_wakeup.notify_all();
+    m_threads.join_all();
+
+    // Submitted while the workers were leaving
+    for (size_t i = 0; i < m_queues.size(); ++i)
+    {
+        Job *job;
+        while (m_queues[i]->pop(job))
+        {
+            m_started.fetch_add(1);
+            RunJob(job);
+        }
+        delete m_queues[i];
+    }
+}
+
+void HttpWorkerPool::Submit(const Task &task)
+{
+    Job *job = new Job;
+    job->task = task;
+    job->submitUs = NowUs();
+
+    size_t index = m_next.fetch_add(1, boost::memory_order_relaxed) %
+        m_queues.size();
+    m_queues[index]->push(job);
+
+    uint64_t submitted = m_submitted.fetch_add(1) + 1;
+    UpdateMax(m_maxQueued, submitted - m_started.load());
+
+    // A worker going to sleep checks m_submitted under the mutex after
+    // counting itself in m_sleeping, so either it sees this job or we
+    // see it sleeping
+    if (m_sleeping.load())
+    {
+        boost::mutex::scoped_lock lock(m_sleepMutex);
+        m_wakeup.notify_one();
+    }
+}
+
+HttpWorkerPool::Stats HttpWorkerPool::GetStats() const
+{
+    Stats stats;
+    stats.submitted = m_submitted.load();
+    stats.completed = m_completed.load();
+    uint64_t started = m_started.load();
+    stats.queued = stats.submitted > started ? stats.submitted - started : 0;
+    stats.maxQueued = m_maxQueued.load();
+    stats.totalWaitUs = m_totalWaitUs.load();
+    stats.maxWaitUs = m_maxWaitUs.load();
+    return stats;
+}
+
+size_t HttpWorkerPool::GetThreadCount() const
+{
+    return m_queues.size();
+}
+
+void HttpWorkerPool::Run(size_t index)
+{
+    while (1)
+    {
+        Job *job = TakeJob(index);
+        if (job)
+        {
+            RunJob(job);
+            continue;
+        }
+
+        boost::mutex::scoped_lock lock(m_sleepMutex);
+        m_sleeping.fetch_add(1);
+        while (!m_stop && m_submitted.load() == m_started.load())
+            m_wakeup.wait(lock);
+        m_sleeping.fetch_sub(1);
+
+        // Stopping still runs what was queued before
+        if (m_stop && m_submitted.load() == m_started.load())
+            return;
+    }
+}
+
+// Own queue first, then the others starting from the next one
+HttpWorkerPool::Job * HttpWorkerPool::TakeJob(size_t index)
+{
+    Job *job;
+    size_t count = m_queues.size();
+    for (size_t i = 0; i < count; ++i)
+    {
+        if (m_queues[(index + i) % count]->pop(job))
+        {
+            m_started.fetch_add(1);
+            return job;
+        }
+    }
+    return 0;
+}
+
+void HttpWorkerPool::RunJob(Job *job)
+{
+    uint64_t waitUs = NowUs() - job->submitUs;
+    m_totalWaitUs.fetch_add(waitUs, boost::memory_order_relaxed);
+    UpdateMax(m_maxWaitUs, waitUs);
+
+    job->task();
+    delete job;
+    m_completed.fetch_add(1, boost::memory_order_relaxed);
+}
+
+uint64_t HttpWorkerPool::NowUs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+void HttpWorkerPool::UpdateMax(boost::atomic<uint64_t> &max, uint64_t value)
+{
+    uint64_t current = max.load(boost::memory_order_relaxed);
+    while (value > current &&
+           !max.compare_exchange_weak(current, value,
+                                      boost::memory_order_relaxed))
+    { }
+}
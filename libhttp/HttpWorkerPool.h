@@ -0,0 +1,79 @@
+#ifndef HTTP_WORKER_POOL_H
+#define HTTP_WORKER_POOL_H
+
+#include <boost/atomic.hpp>
+#include <boost/function.hpp>
+#include <boost/lockfree/queue.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+#include <stdint.h>
+#include <vector>
+
+// Threads for handlers too slow to run on the io_service. Each worker
+// has its own lock-free queue, tasks are spread over them round robin
+// and a worker that runs dry steals from the others before sleeping.
+class HttpWorkerPool : private boost::noncopyable
+{
+public:
+    typedef boost::function< void() > Task;
+
+    struct Stats
+    {
+        uint64_t submitted;
+        uint64_t completed;
+        // Submitted but not started yet
+        uint64_t queued;
+        uint64_t maxQueued;
+        // Between Submit and the task starting, in microseconds
+        uint64_t totalWaitUs;
+        uint64_t maxWaitUs;
+    };
+
+    // 0 threads picks one per core
+    explicit HttpWorkerPool(size_t threads);
+
+    // Runs what is still queued, then joins the threads
+    ~HttpWorkerPool();
+
+    // From any thread
+    void Submit(const Task &task);
+
+    Stats GetStats() const;
+    size_t GetThreadCount() const;
+
+private:
+    struct Job
+    {
+        Task task;
+        uint64_t submitUs;
+    };
+
+    typedef boost::lockfree::queue<Job *> JobQueue;
+
+    void Run(size_t index);
+    Job * TakeJob(size_t index);
+    void RunJob(Job *job);
+
+    static uint64_t NowUs();
+    static void UpdateMax(boost::atomic<uint64_t> &max, uint64_t value);
+
+    std::vector<JobQueue *> m_queues;
+    boost::thread_group m_threads;
+    boost::atomic<size_t> m_next;
+    boost::atomic<bool> m_stop;
+
+    boost::mutex m_sleepMutex;
+    boost::condition_variable m_wakeup;
+    boost::atomic<size_t> m_sleeping;
+
+    boost::atomic<uint64_t> m_submitted;
+    boost::atomic<uint64_t> m_started;
+    boost::atomic<uint64_t> m_completed;
+    boost::atomic<uint64_t> m_maxQueued;
+    boost::atomic<uint64_t> m_totalWaitUs;
+    boost::atomic<uint64_t> m_maxWaitUs;
+};
+
+#endif // HTTP_WORKER_POOL_H
@@ -0,0 +1,436 @@
+// Echo benchmark of the Session layer alone, without any HTTP:
+//   tcp_echo_bench [-t threads] [-c connections] [-d seconds]
+//                  [-w seconds] [-s size[,size...]] [-P port]
+// A server process running a minimal echo Session is forked off. Each
+// client connection then sends a message, waits until all of it came
+// back and sends the next. Every message size gets its own round with
+// fresh connections, reported as messages/s, payload MB/s, round trip
+// percentiles and, for the server process, syscalls per message (when
+// the raw_syscalls tracepoint can be opened), context switches per
+// message and resident memory per connection above the idle server.
+
+#include "../TcpServer.h"
+#include "../HdrHistogram.h"
+#include <boost/thread/thread.hpp>
+#include <linux/perf_event.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+
+namespace
+{
+    class EchoSession : public Session
+    {
+    public:
+        explicit EchoSession(boost::asio::io_service &service)
+            : Session(service)
+        {
+            SetReadTimeout(0);
+            SetWriteTimeout(0);
+        }
+
+    protected:
+        virtual bool OnData(const char *buffer, std::size_t bufferLength)
+        {
+            WriteResponse(buffer, bufferLength);
+            return true;
+        }
+
+        virtual void OnClose()
+        { }
+    };
+
+    SessionPtr NewEchoSession(boost::asio::io_service &service)
+    {
+        return SessionPtr(new EchoSession(service));
+    }
+
+    void RunServer(unsigned short port)
+    {
+        prctl(PR_SET_PDEATHSIG, SIGKILL);
+        // Session reports every closed connection there
+        if (!freopen("/dev/null", "w", stderr))
+            _exit(1);
+
+        boost::asio::io_service service;
+        TcpServer server(port, service,
+                         boost::bind(NewEchoSession, boost::ref(service)));
+        server.Go();
+        service.run();
+        _exit(0);
+    }
+
+    struct EchoRound
+    {
+        EchoRound()
+            : connections(0),
+              size(0),
+              startUs(0),
+              endUs(0)
+        { }
+
+        boost::asio::ip::tcp::endpoint endpoint;
+        size_t connections;
+        size_t size;
+        // Messages are counted between these
+        uint64_t startUs;
+        uint64_t endUs;
+    };
+
+    struct EchoStats
+    {
+        EchoStats()
+            : messages(0),
+              errors(0)
+        { }
+
+        void Add(const EchoStats &other)
+        {
+            latency.Add(other.latency);
+            messages += other.messages;
+            errors += other.errors;
+        }
+
+        HdrHistogram latency;
+        uint64_t messages;
+        uint64_t errors;
+    };
+
+    // One thread with its own io_service driving some of the connections
+    class EchoClients : private boost::noncopyable
+    {
+    public:
+        EchoClients(const EchoRound &round, size_t count)
+            : m_round(round),
+              m_count(count)
+        { }
+
+        void Run()
+        {
+            for (size_t i = 0; i < m_count; ++i)
+                boost::asio::spawn(m_service, boost::bind(
+                    &EchoClients::Client, this, _1));
+            m_service.run();
+        }
+
+        const EchoStats & GetStats() const
+        {
+            return m_stats;
+        }
+
+    private:
+        void Client(boost::asio::yield_context yield)
+        {
+            boost::system::error_code error;
+            boost::asio::ip::tcp::socket socket(m_service);
+            socket.async_connect(m_round.endpoint, yield[error]);
+            if (error)
+            {
+                ++m_stats.errors;
+                return;
+            }
+            socket.set_option(boost::asio::ip::tcp::no_delay(true), error);
+
+            std::vector<char> message(m_round.size, 'x');
+            std::vector<char> reply(m_round.size);
+            while (true)
+            {
+                uint64_t sent = CoarseClock::NowUs();
+                if (sent >= m_round.endUs)
+                    break;
+
+                boost::asio::async_write(
+                    socket, boost::asio::buffer(message), yield[error]);
+                if (!error)
+                    boost::asio::async_read(
+                        socket, boost::asio::buffer(reply), yield[error]);
+                if (error)
+                {
+                    ++m_stats.errors;
+                    break;
+                }
+
+                uint64_t received = CoarseClock::NowUs();
+                if (sent >= m_round.startUs && received <= m_round.endUs)
+                {
+                    m_stats.latency.Record(received - sent);
+                    ++m_stats.messages;
+                }
+            }
+        }
+
+        const EchoRound &m_round;
+        size_t m_count;
+        boost::asio::io_service m_service;
+        EchoStats m_stats;
+    };
+
+    // Counts the syscalls entered by pid, -1 without tracepoint access
+    int OpenSyscallCounter(pid_t pid)
+    {
+        static const char *kPaths[] = {
+            "/sys/kernel/tracing/events/raw_syscalls/sys_enter/id",
+            "/sys/kernel/debug/tracing/events/raw_syscalls/sys_enter/id"
+        };
+
+        for (size_t i = 0; i < sizeof(kPaths) / sizeof(kPaths[0]); ++i)
+        {
+            FILE *file = fopen(kPaths[i], "r");
+            if (!file)
+                continue;
+            unsigned long long id = 0;
+            bool ok = fscanf(file, "%llu", &id) == 1;
+            fclose(file);
+            if (!ok)
+                continue;
+
+            struct perf_event_attr attr;
+            memset(&attr, 0, sizeof(attr));
+            attr.type = PERF_TYPE_TRACEPOINT;
+            attr.size = sizeof(attr);
+            attr.config = id;
+            attr.inherit = 1;
+            return syscall(__NR_perf_event_open, &attr, pid, -1, -1, 0);
+        }
+        return -1;
+    }
+
+    uint64_t ReadCounter(int fd)
+    {
+        uint64_t count = 0;
+        if (fd < 0 || read(fd, &count, sizeof(count)) != sizeof(count))
+            return 0;
+        return count;
+    }
+
+    // Voluntary and involuntary switches of the process' main thread
+    uint64_t ReadContextSwitches(pid_t pid)
+    {
+        char path[64];
+        snprintf(path, sizeof(path), "/proc/%d/status", static_cast<int>(pid));
+        FILE *file = fopen(path, "r");
+        if (!file)
+            return 0;
+
+        uint64_t total = 0;
+        char line[256];
+        while (fgets(line, sizeof(line), file))
+        {
+            unsigned long long count;
+            if (sscanf(line, "voluntary_ctxt_switches: %llu", &count) == 1 ||
+                sscanf(line, "nonvoluntary_ctxt_switches: %llu", &count) == 1)
+                total += count;
+        }
+        fclose(file);
+        return total;
+    }
+
+    uint64_t ReadRss(pid_t pid)
+    {
+        char path[64];
+        snprintf(path, sizeof(path), "/proc/%d/statm", static_cast<int>(pid));
+        FILE *file = fopen(path, "r");
+        if (!file)
+            return 0;
+
+        unsigned long long size = 0;
+        unsigned long long resident = 0;
+        if (fscanf(file, "%llu %llu", &size, &resident) != 2)
+            resident = 0;
+        fclose(file);
+        return resident * sysconf(_SC_PAGESIZE);
+    }
+
+    void SleepUntil(uint64_t us)
+    {
+        uint64_t now = CoarseClock::NowUs();
+        if (us > now)
+            usleep(us - now);
+    }
+
+    bool WaitForServer(const boost::asio::ip::tcp::endpoint &endpoint)
+    {
+        boost::asio::io_service service;
+        for (int i = 0; i < 200; ++i)
+        {
+            boost::system::error_code error;
+            boost::asio::ip::tcp::socket socket(service);
+            socket.connect(endpoint, error);
+            if (!error)
+                return true;
+            usleep(10000);
+        }
+        return false;
+    }
+
+    void Usage(const char *name)
+    {
+        fprintf(stderr, "usage: %s [-t threads] [-c connections] "
+                "[-d seconds] [-w seconds] [-s size[,size...]] [-P port]\n",
+                name);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    size_t threads = 1;
+    size_t connections = 64;
+    double duration = 5;
+    double warmup = 0.5;
+    unsigned short port = 7090;
+    std::vector<size_t> sizes;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        const char *arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (strcmp(arg, "-t") == 0 && hasValue)
+            threads = strtoul(argv[++i], 0, 10);
+        else if (strcmp(arg, "-c") == 0 && hasValue)
+            connections = strtoul(argv[++i], 0, 10);
+        else if (strcmp(arg, "-d") == 0 && hasValue)
+            duration = strtod(argv[++i], 0);
+        else if (strcmp(arg, "-w") == 0 && hasValue)
+            warmup = strtod(argv[++i], 0);
+        else if (strcmp(arg, "-P") == 0 && hasValue)
+            port = static_cast<unsigned short>(strtoul(argv[++i], 0, 10));
+        else if (strcmp(arg, "-s") == 0 && hasValue)
+        {
+            for (char *p = argv[++i]; *p; )
+            {
+                char *end;
+                size_t size = strtoul(p, &end, 10);
+                if (end == p || !size)
+                    break;
+                sizes.push_back(size);
+                p = *end == ',' ? end + 1 : end;
+            }
+        }
+        else
+        {
+            Usage(argv[0]);
+            return 2;
+        }
+    }
+
+    if (sizes.empty())
+    {
+        sizes.push_back(64);
+        sizes.push_back(1024);
+        sizes.push_back(16 * 1024);
+    }
+    if (!threads || !connections || duration <= 0 || warmup < 0)
+    {
+        Usage(argv[0]);
+        return 2;
+    }
+    if (threads > connections)
+        threads = connections;
+
+    // Before any thread exists
+    pid_t server = fork();
+    if (server < 0)
+    {
+        perror("fork");
+        return 1;
+    }
+    if (server == 0)
+        RunServer(port);
+
+    boost::asio::ip::tcp::endpoint endpoint(
+        boost::asio::ip::address_v4::loopback(), port);
+    if (!WaitForServer(endpoint))
+    {
+        fprintf(stderr, "echo server did not come up on port %u\n", port);
+        kill(server, SIGKILL);
+        waitpid(server, 0, 0);
+        return 1;
+    }
+
+    usleep(100000);
+    uint64_t idleRss = ReadRss(server);
+    int syscalls = OpenSyscallCounter(server);
+
+    printf("%8s %6s %10s %10s %8s %8s %8s %8s %8s %10s %10s %10s %6s\n",
+           "size", "conns", "msgs/s", "MB/s", "p50us", "p90us", "p99us",
+           "p999us", "maxus", "sys/msg", "cs/msg", "rssKB/conn", "errors");
+
+    for (size_t s = 0; s < sizes.size(); ++s)
+    {
+        EchoRound round;
+        round.endpoint = endpoint;
+        round.connections = connections;
+        round.size = sizes[s];
+        round.startUs = CoarseClock::NowUs() +
+            static_cast<uint64_t>(warmup * 1e6);
+        round.endUs = round.startUs + static_cast<uint64_t>(duration * 1e6);
+
+        std::vector< boost::shared_ptr<EchoClients> > clients;
+        boost::thread_group group;
+        for (size_t i = 0; i < threads; ++i)
+        {
+            size_t count = connections / threads +
+                (i < connections % threads ? 1 : 0);
+            clients.push_back(boost::shared_ptr<EchoClients>(
+                new EchoClients(round, count)));
+            group.create_thread(boost::bind(&EchoClients::Run,
+                                            clients.back().get()));
+        }
+
+        SleepUntil(round.startUs);
+        uint64_t syscallsStart = ReadCounter(syscalls);
+        uint64_t switchesStart = ReadContextSwitches(server);
+        SleepUntil(round.startUs + (round.endUs - round.startUs) / 2);
+        uint64_t rss = ReadRss(server);
+        SleepUntil(round.endUs);
+        uint64_t syscallsEnd = ReadCounter(syscalls);
+        uint64_t switchesEnd = ReadContextSwitches(server);
+        group.join_all();
+
+        EchoStats stats;
+        for (size_t i = 0; i < clients.size(); ++i)
+            stats.Add(clients[i]->GetStats());
+
+        double seconds = duration;
+        double messages = stats.messages ? stats.messages : 1;
+        char perMessage[32] = "-";
+        if (syscalls >= 0)
+            snprintf(perMessage, sizeof(perMessage), "%.2f",
+                     (syscallsEnd - syscallsStart) / messages);
+
+        printf("%8zu %6zu %10.0f %10.1f %8llu %8llu %8llu %8llu %8llu "
+               "%10s %10.2f %10.1f %6llu\n",
+               round.size, connections, stats.messages / seconds,
+               stats.messages * round.size / seconds / (1024 * 1024),
+               static_cast<unsigned long long>(stats.latency.GetPercentile(0.5)),
+               static_cast<unsigned long long>(stats.latency.GetPercentile(0.9)),
+               static_cast<unsigned long long>(stats.latency.GetPercentile(0.99)),
+               static_cast<unsigned long long>(
+                   stats.latency.GetPercentile(0.999)),
+               static_cast<unsigned long long>(stats.latency.GetMax()),
+               perMessage, (switchesEnd - switchesStart) / messages,
+               rss > idleRss ? (rss - idleRss) / 1024.0 / connections : 0.0,
+               static_cast<unsigned long long>(stats.errors));
+        fflush(stdout);
+
+        // Lets the server drop the connections of this round
+        usleep(100000);
+    }
+
+    if (syscalls < 0)
+        fprintf(stderr, "no syscall counts: the raw_syscalls tracepoint "
+                "needs tracefs and perf_event_paranoid <= 1\n");
+    else
+        close(syscalls);
+
+    kill(server, SIGTERM);
+    waitpid(server, 0, 0);
+    return 0;
+}